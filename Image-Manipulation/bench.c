@@ -0,0 +1,531 @@
+//bench.c
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include "ppm_io.h"
+#include "qoi_io.h"
+#include "image_manip.h"
+#include "thread_pool.h"
+
+// Return (exit) codes
+#define RC_SUCCESS       0
+#define RC_BAD_ARGS      1
+#define RC_WRITE_FAILED  2
+
+// most sizes and results one run can have
+#define MAX_SIZES 16
+#define MAX_RESULTS 512
+
+/* how an operation is timed: it gets a fresh copy of the test image (and
+ * the image itself as the second input) and returns the result, which the
+ * benchmark frees. bytes_per_pixel is a rough peak of the memory it needs,
+ * used to skip sizes that can't fit. */
+typedef struct {
+  const char *name;
+  int bytes_per_pixel;
+  Image (*run)( Image in , Image other , FILE *fp );
+} BenchOp;
+
+/* the timing of one operation at one size */
+typedef struct {
+  const char *op;
+  int size;
+  int reps;
+  double seconds; // fastest run
+  double mpx_per_s;
+  size_t allocs; // allocation calls in one run
+  size_t alloc_bytes;
+} Result;
+
+void print_usage();
+double now();
+int parse_sizes(const char *text, int sizes[]);
+int wanted(const char *name, const char *list);
+size_t physical_memory();
+int bench_op(const BenchOp *op, int size, const Image master, FILE *fp, double min_time, Result *result);
+int write_csv(const char *name, const Result results[], int count);
+int write_json(const char *name, const Result results[], int count);
+
+
+/* Allocation counting: the benchmark is linked with --wrap for malloc,
+ * calloc, realloc, posix_memalign and mmap (see the Makefile), so every call the image code
+ * makes to them comes here first. Calls made inside the C library itself
+ * aren't counted. */
+static size_t alloc_calls = 0;
+static size_t alloc_bytes = 0;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void *ptr, size_t size);
+int __real_posix_memalign(void **ptr, size_t alignment, size_t size);
+void* __real_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
+
+void* __wrap_malloc(size_t size) {
+  __sync_fetch_and_add(&alloc_calls, 1);
+  __sync_fetch_and_add(&alloc_bytes, size);
+  return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+  __sync_fetch_and_add(&alloc_calls, 1);
+  __sync_fetch_and_add(&alloc_bytes, count * size);
+  return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void *ptr, size_t size) {
+  __sync_fetch_and_add(&alloc_calls, 1);
+  __sync_fetch_and_add(&alloc_bytes, size);
+  return __real_realloc(ptr, size);
+}
+
+int __wrap_posix_memalign(void **ptr, size_t alignment, size_t size) {
+  __sync_fetch_and_add(&alloc_calls, 1);
+  __sync_fetch_and_add(&alloc_bytes, size);
+  return __real_posix_memalign(ptr, alignment, size);
+}
+
+void* __wrap_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset) {
+  __sync_fetch_and_add(&alloc_calls, 1);
+  __sync_fetch_and_add(&alloc_bytes, length);
+  return __real_mmap(addr, length, prot, flags, fd, offset);
+}
+
+
+/* the test image as a QOI file, for read_qoi and write_qoi */
+static FILE *qoi_file = NULL;
+
+/* the operations, wrapped to one signature; fp holds the image as a PPM */
+static Image runRead(Image in, Image other, FILE *fp) {
+  (void)other;
+  free_image(&in);
+  rewind(fp);
+  return read_ppm(fp);
+}
+
+static Image runMap(Image in, Image other, FILE *fp) {
+  (void)other;
+  free_image(&in);
+  rewind(fp);
+  return map_ppm(fp);
+}
+
+static Image runWrite(Image in, Image other, FILE *fp) {
+  (void)other;
+  rewind(fp);
+  write_ppm(fp, in);
+  fflush(fp);
+  return in;
+}
+
+static Image runReadQoi(Image in, Image other, FILE *fp) {
+  (void)other;
+  (void)fp;
+  free_image(&in);
+  rewind(qoi_file);
+  return read_qoi(qoi_file);
+}
+
+static Image runWriteQoi(Image in, Image other, FILE *fp) {
+  (void)other;
+  (void)fp;
+  rewind(qoi_file);
+  write_qoi(qoi_file, in);
+  fflush(qoi_file);
+  return in;
+}
+
+static Image runGrayscale(Image in, Image other, FILE *fp) {
+  (void)other;
+  (void)fp;
+  return grayscale(in);
+}
+
+static Image runSaturate(Image in, Image other, FILE *fp) {
+  (void)other;
+  (void)fp;
+  return saturate(in, 1.5);
+}
+
+static Image runBlend(Image in, Image other, FILE *fp) {
+  (void)fp;
+  Image result = blend(in, other, 0.5);
+  free_image(&in);
+  return result;
+}
+
+static Image runRotateCcw(Image in, Image other, FILE *fp) {
+  (void)other;
+  (void)fp;
+  return rotate_ccw(in);
+}
+
+static Image runRotateCw(Image in, Image other, FILE *fp) {
+  (void)other;
+  (void)fp;
+  return rotate_cw(in);
+}
+
+static Image runRotate180(Image in, Image other, FILE *fp) {
+  (void)other;
+  (void)fp;
+  return rotate_180(in);
+}
+
+static Image runFlipH(Image in, Image other, FILE *fp) {
+  (void)other;
+  (void)fp;
+  return flip_h(in);
+}
+
+static Image runFlipV(Image in, Image other, FILE *fp) {
+  (void)other;
+  (void)fp;
+  return flip_v(in);
+}
+
+static Image runPointilism(Image in, Image other, FILE *fp) {
+  (void)other;
+  (void)fp;
+  return pointilism(in, 1);
+}
+
+static Image runBlurExact(Image in, Image other, FILE *fp) {
+  (void)other;
+  (void)fp;
+  return blur_with_mode(in, 2.0, BLUR_EXACT);
+}
+
+static Image runBlurBox(Image in, Image other, FILE *fp) {
+  (void)other;
+  (void)fp;
+  return blur_with_mode(in, 8.0, BLUR_BOX);
+}
+
+static Image runBlurIir(Image in, Image other, FILE *fp) {
+  (void)other;
+  (void)fp;
+  return blur_with_mode(in, 8.0, BLUR_IIR);
+}
+
+static Image runBoxBlur(Image in, Image other, FILE *fp) {
+  (void)other;
+  (void)fp;
+  return box_blur(in, 8);
+}
+
+static Image runSharpen(Image in, Image other, FILE *fp) {
+  (void)other;
+  (void)fp;
+  static const double weights[] = { 0, -1, 0, -1, 5, -1, 0, -1, 0 };
+  Kernel kernel = { 3 , 3 , weights , 1.0 , 0.0 };
+  return convolve(in, &kernel);
+}
+
+static Image runGauss5(Image in, Image other, FILE *fp) {
+  (void)other;
+  (void)fp;
+  static const double weights[] = { 1, 4, 6, 4, 1, 4, 16, 24, 16, 4, 6, 24, 36, 24, 6, 4, 16, 24, 16, 4, 1, 4, 6, 4, 1 };
+  Kernel kernel = { 5 , 5 , weights , 256.0 , 0.0 };
+  return convolve(in, &kernel);
+}
+
+static Image runRotate(Image in, Image other, FILE *fp) {
+  (void)other;
+  (void)fp;
+  return rotate(in, 7.5, ROTATE_BILINEAR);
+}
+
+static const BenchOp ops[] = {
+  { "read_ppm" , 9 , runRead },
+  { "map_ppm" , 9 , runMap },
+  { "write_ppm" , 9 , runWrite },
+  { "read_qoi" , 9 , runReadQoi },
+  { "write_qoi" , 9 , runWriteQoi },
+  { "grayscale" , 6 , runGrayscale },
+  { "saturate" , 6 , runSaturate },
+  { "blend" , 9 , runBlend },
+  { "rotate-ccw" , 6 , runRotateCcw },
+  { "rotate-cw" , 6 , runRotateCw },
+  { "rotate-180" , 6 , runRotate180 },
+  { "rotate-7.5" , 6 , runRotate },
+  { "flip-h" , 6 , runFlipH },
+  { "flip-v" , 6 , runFlipV },
+  { "pointilism" , 9 , runPointilism },
+  { "blur-exact-2" , 21 , runBlurExact },
+  { "blur-box-8" , 33 , runBlurBox },
+  { "blur-iir-8" , 21 , runBlurIir },
+  { "box-blur-8" , 21 , runBoxBlur },
+  { "sharpen-3x3" , 6 , runSharpen },
+  { "gauss-5x5" , 6 , runGauss5 },
+};
+
+
+/* time the operations on square test images:
+ *   ./benchmark [--sizes 256,1024,...] [--ops name,...] [--min-time seconds]
+ *               [-j threads] [--csv file] [--json file]
+ */
+int main (int argc, char* argv[]) {
+  const char *sizes_text = "256,1024,4096,16384";
+  const char *op_list = NULL;
+  const char *csv = NULL;
+  const char *json = NULL;
+  double min_time = 0.5;
+  for (int i = 1; i < argc; i++) {
+    if (i + 1 >= argc) {
+      print_usage();
+      return RC_BAD_ARGS;
+    }
+    if (strcmp(argv[i], "--sizes") == 0) {
+      sizes_text = argv[++i];
+    }
+    else if (strcmp(argv[i], "--ops") == 0) {
+      op_list = argv[++i];
+    }
+    else if (strcmp(argv[i], "--csv") == 0) {
+      csv = argv[++i];
+    }
+    else if (strcmp(argv[i], "--json") == 0) {
+      json = argv[++i];
+    }
+    else if (strcmp(argv[i], "--min-time") == 0) {
+      min_time = atof(argv[++i]);
+    }
+    else if (strcmp(argv[i], "-j") == 0) {
+      set_thread_count(atoi(argv[++i]));
+    }
+    else {
+      print_usage();
+      return RC_BAD_ARGS;
+    }
+  }
+  int sizes[MAX_SIZES];
+  int nsizes = parse_sizes(sizes_text, sizes);
+  if (nsizes == 0) {
+    print_usage();
+    return RC_BAD_ARGS;
+  }
+
+  static Result results[MAX_RESULTS];
+  int count = 0;
+  size_t memory = physical_memory();
+  int nops = (int)(sizeof(ops) / sizeof(ops[0]));
+  printf("%-14s %7s %5s %12s %10s %9s %14s\n", "operation", "size", "reps", "seconds", "Mpx/s", "allocs", "alloc bytes");
+
+  for (int s = 0; s < nsizes; s++) {
+    int size = sizes[s];
+    size_t pixels = (size_t)size * size;
+
+    //a noisy gradient, so no operation gets an unrealistically easy image
+    Image master = make_image(size, size);
+    FILE *fp = tmpfile();
+    qoi_file = tmpfile();
+    if (master.data == NULL || fp == NULL || qoi_file == NULL) {
+      printf("%-14s %7d  skipped, could not allocate the test image\n", "*", size);
+      free_image(&master);
+      if (fp != NULL) {
+	fclose(fp);
+      }
+      if (qoi_file != NULL) {
+	fclose(qoi_file);
+      }
+      continue;
+    }
+    unsigned int seed = 1;
+    for (size_t i = 0; i < pixels; i++) {
+      seed = seed * 1103515245u + 12345u;
+      master.data[i].r = (unsigned char)((i % size) * 255 / size + (seed >> 28));
+      master.data[i].g = (unsigned char)((i / size) * 255 / size + ((seed >> 24) & 15));
+      master.data[i].b = (unsigned char)(seed >> 16);
+    }
+    write_ppm(fp, master);
+    fflush(fp);
+    write_qoi(qoi_file, master);
+    fflush(qoi_file);
+
+    for (int o = 0; o < nops && count < MAX_RESULTS; o++) {
+      if (!wanted(ops[o].name, op_list)) {
+	continue;
+      }
+      if (memory != 0 && pixels * ops[o].bytes_per_pixel > memory / 10 * 8) {
+	printf("%-14s %7d  skipped, needs about %zu MB\n", ops[o].name, size, pixels * ops[o].bytes_per_pixel >> 20);
+	continue;
+      }
+      Result *result = &results[count];
+      int failed = bench_op(&ops[o], size, master, fp, min_time, result) != 0;
+      trim_buffers(); //every operation starts with an empty pool
+      if (failed) {
+	printf("%-14s %7d  failed\n", ops[o].name, size);
+	continue;
+      }
+      printf("%-14s %7d %5d %12.6f %10.1f %9zu %14zu\n", result->op, result->size, result->reps, result->seconds, result->mpx_per_s, result->allocs, result->alloc_bytes);
+      fflush(stdout);
+      count++;
+    }
+
+    free_image(&master);
+    fclose(fp);
+    fclose(qoi_file);
+  }
+
+  int rc = RC_SUCCESS;
+  if (csv != NULL && write_csv(csv, results, count) != 0) {
+    fprintf(stderr, "could not write %s\n", csv);
+    rc = RC_WRITE_FAILED;
+  }
+  if (json != NULL && write_json(json, results, count) != 0) {
+    fprintf(stderr, "could not write %s\n", json);
+    rc = RC_WRITE_FAILED;
+  }
+  return rc;
+}
+
+
+void print_usage() {
+  printf("USAGE: ./benchmark [options]\n");
+  printf("OPTIONS:\n");
+  printf("   --sizes <n,n,...>     sides of the square test images (default 256,1024,4096,16384)\n");
+  printf("   --ops <name,...>      only time these operations\n");
+  printf("   --min-time <seconds>  repeat each operation for at least this long (default 0.5)\n");
+  printf("   -j <threads>          run the operations on this many threads (0 = one per CPU)\n");
+  printf("   --csv <file>          also write the results as CSV\n");
+  printf("   --json <file>         also write the results as JSON\n");
+}
+
+
+/* seconds on a monotonic clock
+ */
+double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+/* parse a list such as 256,1024 into sizes; returns how many, or 0 if invalid
+ */
+int parse_sizes(const char *text, int sizes[]) {
+  int count = 0;
+  while (*text != '\0' && count < MAX_SIZES) {
+    char *end;
+    long size = strtol(text, &end, 10);
+    if (end == text || size <= 0 || size > 65536 || (*end != ',' && *end != '\0')) {
+      return 0;
+    }
+    sizes[count++] = (int)size;
+    text = *end == ',' ? end + 1 : end;
+  }
+  return *text == '\0' ? count : 0;
+}
+
+
+/* true if name is in the comma separated list, or there is no list
+ */
+int wanted(const char *name, const char *list) {
+  if (list == NULL) {
+    return 1;
+  }
+  size_t len = strlen(name);
+  for (const char *p = list; p != NULL; p = strchr(p, ',') ? strchr(p, ',') + 1 : NULL) {
+    if (strncmp(p, name, len) == 0 && (p[len] == ',' || p[len] == '\0')) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+
+/* bytes of physical memory, or 0 if it can't be found out
+ */
+size_t physical_memory() {
+#ifdef _SC_PHYS_PAGES
+  long pages = sysconf(_SC_PHYS_PAGES);
+  long page = sysconf(_SC_PAGESIZE);
+  if (pages > 0 && page > 0) {
+    return (size_t)pages * (size_t)page;
+  }
+#endif
+  return 0;
+}
+
+
+/* run op on copies of master until min_time has passed (at least 3 and at
+ * most 100 times) and fill in result with the fastest run. Copying the
+ * input and freeing the output aren't timed or counted.
+ * Returns 0, or -1 if the operation failed.
+ */
+int bench_op(const BenchOp *op, int size, const Image master, FILE *fp, double min_time, Result *result) {
+  size_t pixels = (size_t)size * size;
+  double best = -1, total = 0;
+  int reps = 0;
+  while (reps < 3 || (total < min_time && reps < 100)) {
+    Image in = make_image(size, size);
+    if (in.data == NULL) {
+      return -1;
+    }
+    memcpy(in.data, master.data, sizeof(Pixel) * pixels);
+
+    size_t calls_before = alloc_calls, bytes_before = alloc_bytes;
+    double start = now();
+    Image out = op->run(in, master, fp);
+    double seconds = now() - start;
+    result->allocs = alloc_calls - calls_before;
+    result->alloc_bytes = alloc_bytes - bytes_before;
+
+    if (out.data == NULL) {
+      return -1;
+    }
+    free_image(&out);
+    if (best < 0 || seconds < best) {
+      best = seconds;
+    }
+    total += seconds;
+    reps++;
+  }
+  result->op = op->name;
+  result->size = size;
+  result->reps = reps;
+  result->seconds = best;
+  result->mpx_per_s = best > 0 ? pixels / best / 1e6 : 0;
+  return 0;
+}
+
+
+/* write the results as CSV, one row per operation and size; returns 0 or -1
+ */
+int write_csv(const char *name, const Result results[], int count) {
+  FILE *fp = fopen(name, "w");
+  if (fp == NULL) {
+    return -1;
+  }
+  fprintf(fp, "operation,size,threads,reps,seconds,mpx_per_s,allocs,alloc_bytes\n");
+  for (int i = 0; i < count; i++) {
+    const Result *r = &results[i];
+    fprintf(fp, "%s,%d,%d,%d,%.9f,%.3f,%zu,%zu\n", r->op, r->size, get_thread_count(), r->reps, r->seconds, r->mpx_per_s, r->allocs, r->alloc_bytes);
+  }
+  return fclose(fp) == 0 ? 0 : -1;
+}
+
+
+/* write the results as a JSON object with one entry per operation and size;
+ * returns 0 or -1
+ */
+int write_json(const char *name, const Result results[], int count) {
+  FILE *fp = fopen(name, "w");
+  if (fp == NULL) {
+    return -1;
+  }
+  fprintf(fp, "{\n  \"threads\": %d,\n  \"results\": [", get_thread_count());
+  for (int i = 0; i < count; i++) {
+    const Result *r = &results[i];
+    fprintf(fp, "%s\n    {\"operation\": \"%s\", \"size\": %d, \"reps\": %d, \"seconds\": %.9f, \"mpx_per_s\": %.3f, \"allocs\": %zu, \"alloc_bytes\": %zu}",
+	    i > 0 ? "," : "", r->op, r->size, r->reps, r->seconds, r->mpx_per_s, r->allocs, r->alloc_bytes);
+  }
+  fprintf(fp, "\n  ]\n}\n");
+  return fclose(fp) == 0 ? 0 : -1;
+}
@@ -0,0 +1,136 @@
+//checkerboard.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ppm_io.h"
+
+// Return (exit) codes
+#define RC_SUCCESS       0
+#define RC_BAD_ARGS      1
+#define RC_OPEN_FAILED   2
+#define RC_WRITE_FAILED  3
+#define RC_NO_MEMORY     4
+
+/* the images this program can make */
+typedef enum { PATTERN_CHECKERBOARD , PATTERN_NOISE , PATTERN_GRADIENT } Pattern;
+
+void print_usage();
+void fill_row(Pixel *row, int y, int rows, int cols, Pattern pattern, long param, unsigned long long *state);
+
+
+/* make a synthetic test image of any size, a row at a time so that even
+ * very large images take almost no memory:
+ *   ./checkerboard <output.ppm> <cols> <rows> [checkerboard [square] | noise [seed] | gradient]
+ */
+int main (int argc, char* argv[]) {
+  if (argc < 4 || argc > 6) {
+    print_usage();
+    return RC_BAD_ARGS;
+  }
+
+  char *end;
+  long cols = strtol(argv[2], &end, 10);
+  int ok = *end == '\0' && cols > 0 && cols <= 1 << 20;
+  long rows = strtol(argv[3], &end, 10);
+  ok = ok && *end == '\0' && rows > 0 && rows <= 1 << 20;
+
+  Pattern pattern = PATTERN_CHECKERBOARD;
+  long param = 32; //square size, or noise seed
+  if (argc > 4) {
+    if (strcmp(argv[4], "checkerboard") == 0) {
+      pattern = PATTERN_CHECKERBOARD;
+    }
+    else if (strcmp(argv[4], "noise") == 0) {
+      pattern = PATTERN_NOISE;
+      param = 1;
+    }
+    else if (strcmp(argv[4], "gradient") == 0 && argc == 5) {
+      pattern = PATTERN_GRADIENT;
+    }
+    else {
+      ok = 0;
+    }
+  }
+  if (argc > 5) {
+    param = strtol(argv[5], &end, 10);
+    ok = ok && *end == '\0' && (pattern == PATTERN_NOISE || param > 0);
+  }
+  if (!ok) {
+    print_usage();
+    return RC_BAD_ARGS;
+  }
+
+  Pixel *row = malloc(sizeof(Pixel) * cols);
+  if (row == NULL) {
+    fprintf(stderr, "could not allocate a row of %ld pixels\n", cols);
+    return RC_NO_MEMORY;
+  }
+  FILE *fp = fopen(argv[1], "wb");
+  if (fp == NULL) {
+    fprintf(stderr, "could not open %s\n", argv[1]);
+    free(row);
+    return RC_OPEN_FAILED;
+  }
+
+  int rc = RC_SUCCESS;
+  unsigned long long state = 0x9E3779B97F4A7C15ULL ^ (unsigned long long)param;
+  if (write_ppm_header(fp, (int)rows, (int)cols) != 0) {
+    rc = RC_WRITE_FAILED;
+  }
+  for (int y = 0; y < rows && rc == RC_SUCCESS; y++) {
+    fill_row(row, y, (int)rows, (int)cols, pattern, param, &state);
+    if (write_ppm_rows(fp, row, (int)cols, 1) != 1) {
+      rc = RC_WRITE_FAILED;
+    }
+  }
+  if (fclose(fp) != 0) {
+    rc = RC_WRITE_FAILED;
+  }
+  if (rc != RC_SUCCESS) {
+    fprintf(stderr, "could not write %s\n", argv[1]);
+  }
+  free(row);
+  return rc;
+}
+
+
+void print_usage() {
+  printf("USAGE: ./checkerboard <output-image> <cols> <rows> [pattern]\n");
+  printf("PATTERNS:\n");
+  printf("   checkerboard [square]   alternating squares, 32 pixels by default\n");
+  printf("   noise [seed]            random pixels, the same for the same seed\n");
+  printf("   gradient                red across, green down, blue diagonally\n");
+}
+
+
+/* fill row y of the image with the pattern; state is the noise generator,
+ * which carries on from row to row
+ */
+void fill_row(Pixel *row, int y, int rows, int cols, Pattern pattern, long param, unsigned long long *state) {
+  for (int x = 0; x < cols; x++) {
+    Pixel p;
+    if (pattern == PATTERN_CHECKERBOARD) {
+      int odd = (x / param + y / param) % 2;
+      p.r = odd ? 230 : 25;
+      p.g = odd ? 200 : 60;
+      p.b = odd ? 40 : 140;
+    }
+    else if (pattern == PATTERN_NOISE) {
+      //xorshift64*, so the image doesn't depend on the C library's rand()
+      *state ^= *state >> 12;
+      *state ^= *state << 25;
+      *state ^= *state >> 27;
+      unsigned long long bits = *state * 0x2545F4914F6CDD1DULL;
+      p.r = (unsigned char)(bits >> 56);
+      p.g = (unsigned char)(bits >> 48);
+      p.b = (unsigned char)(bits >> 40);
+    }
+    else {
+      p.r = cols > 1 ? (unsigned char)(255L * x / (cols - 1)) : 0;
+      p.g = rows > 1 ? (unsigned char)(255L * y / (rows - 1)) : 0;
+      p.b = (unsigned char)(255L * (x + y) / (cols + rows - 1));
+    }
+    row[x] = p;
+  }
+}
@@ -1,9 +1,16 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <limits.h>
 #include <math.h>
+#include <string.h>
 #include <assert.h>
+#include <pthread.h>
 #include "image_manip.h"
+#include "image_simd.h"
 #include "ppm_io.h"
+#include "thread_pool.h"
+#include "stats.h"
 
 
 ////////////////////////////////////////
@@ -13,6 +20,7 @@
 Image make_image(int rows, int cols);
 double** createMatrix(int *n, double sigma);
 Pixel applyBlur(Image im, double** gaussian, int size, int dx, int dy);
+double* createKernel(int *n, double sigma);
 
 
 //______grayscale______                                                       
@@ -20,25 +28,143 @@ Pixel applyBlur(Image im, double** gaussian, int size, int dx, int dy);
  * RGB, but the three values will be equal)                                    
  */
 
-Image grayscale( const Image in ) {
+/* Helper function for grayscale and apply_pointwise
+ * gray count pixels in place
+ */
+static void grayscalePixels(PixelSpan pix, size_t count) {
 
   unsigned char gray;
    
-  //traverse through the space allocated for in which is laid out in a single line rather than a 2D array
-  for(int i = 0; i < in.rows * in.cols; i++){
+  //traverse through the pixels of the span one at a time
+  //(the vector kernel does what it can, this loop finishes the rest)
+  for(size_t i = grayscale_simd(pix, count); i < count; i++){
+    unsigned char *r = pix.chan[0] + i * pix.step;
+    unsigned char *g = pix.chan[1] + i * pix.step;
+    unsigned char *b = pix.chan[2] + i * pix.step;
     //calculate the gray factor based on r b and g
-    gray = (unsigned char)((0.3 * in.data[i].r) + (in.data[i].g * 0.59) + (in.data[i].b * 0.11));
+    gray = (unsigned char)((0.3 * *r) + (*g * 0.59) + (*b * 0.11));
 
     //gray each of the red blue and green values by makin1g it equal to teh gray factor
-    in.data[i].r = gray;
-    in.data[i].g = gray;
-    in.data[i].b = gray;
+    *r = gray;
+    *g = gray;
+    *b = gray;
+  }
+}
+
+Image grayscale( const Image in ) {
+  PointOp op = { POINT_GRAYSCALE , 0.0 , 0.0 , 0.0 };
+  return apply_pointwise(in, &op, 1);
+}
+
+/* work shared out by parallel_for for blend */
+typedef struct {
+  Image in1;
+  Image in2;
+  double alpha;
+  int rowMIN; // overlap of the two images
+  int colMIN;
+  Image out;
+} BlendJob;
+
+/* Helper function for blendRows
+ * the blend loop for spans of different layouts
+ */
+static inline void blendPixels(PixelSpan out, int out_step, PixelSpan p1, int step1, PixelSpan p2, int step2, int count, double alpha) {
+  for (int c = 0; c < 3; c++) {
+    unsigned char *o = out.chan[c];
+    const unsigned char *a = p1.chan[c];
+    const unsigned char *b = p2.chan[c];
+    for (int j = 0; j < count; j++) {
+      o[j * out_step] = (unsigned char)((a[j * step1] * alpha) + (b[j * step2] * (1 - alpha)));
+    }
+  }
+}
+
+/* Helper function for blendRows
+ * blend n bytes of matching layouts: the vector kernel does what it can,
+ * this loop finishes the rest
+ */
+static void blendBytes(unsigned char *out, const unsigned char *a, const unsigned char *b, size_t n, double alpha) {
+  for (size_t i = blend_simd(out, a, b, n, alpha); i < n; i++) {
+    out[i] = (unsigned char)((a[i] * alpha) + (b[i] * (1 - alpha)));
+  }
+}
+
+/* Helper function for blendRows
+ * copy pixels from to to - 1 of src into dst, or make them black if src is NULL
+ */
+static void fillPixels(PixelSpan dst, const PixelSpan *src, int from, int to) {
+  if (from >= to || (src != NULL && src->chan[0] == dst.chan[0])) { //nothing to do, or blending in place
+    return;
+  }
+  if (src == NULL || src->step == dst.step) { //whole runs of bytes
+    size_t count = (size_t)(to - from) * (dst.step == 1 ? 1 : dst.step);
+    for (int c = 0; c < (dst.step == 1 ? 3 : 1); c++) {
+      unsigned char *d = dst.chan[c] + (size_t)from * dst.step;
+      if (src == NULL) {
+	memset(d, 0, count);
+      }
+      else {
+	memcpy(d, src->chan[c] + (size_t)from * src->step, count);
+      }
+    }
+    return;
+  }
+  for (int j = from; j < to; j++) {
+    for (int c = 0; c < 3; c++) {
+      dst.chan[c][j * dst.step] = src->chan[c][j * src->step];
+    }
+  }
+}
+
+/* Helper function for blend
+ * fill the output rows begin to end - 1: blended where the images
+ * overlap, otherwise whichever image covers the pixel, otherwise black.
+ * The images may have any layouts.
+ */
+static void blendRows(void *arg, int begin, int end) {
+  const BlendJob *job = arg;
+  const Image in1 = job->in1;
+  const Image in2 = job->in2;
+  int cols = job->out.cols;
+  for (int i = begin; i < end; i++) {
+    PixelSpan row = image_row(job->out, i);
+    PixelSpan p1 = image_row(in1, i < in1.rows ? i : 0);
+    PixelSpan p2 = image_row(in2, i < in2.rows ? i : 0);
+    int cols1 = i < in1.rows ? in1.cols : 0; //pixels of this row each image covers
+    int cols2 = i < in2.rows ? in2.cols : 0;
+
+    int j = 0;
+    if (i < job->rowMIN) {
+      if (row.step == p1.step && row.step == p2.step && row.step == 1) { //three runs of bytes
+	for (int c = 0; c < 3; c++) {
+	  blendBytes(row.chan[c], p1.chan[c], p2.chan[c], job->colMIN, job->alpha);
+	}
+      }
+      else if (row.step == p1.step && row.step == p2.step) { //one run, RGBX padding and all
+	blendBytes(row.chan[0], p1.chan[0], p2.chan[0], (size_t)job->colMIN * row.step, job->alpha);
+      }
+      else {
+	blendPixels(row, row.step, p1, p1.step, p2, p2.step, job->colMIN, job->alpha);
+      }
+      j = job->colMIN;
+    }
+    // assign pixels outside the blended area to their original image
+    if (j < cols1) {
+      fillPixels(row, &p1, j, cols1);
+      j = cols1;
+    }
+    if (j < cols2) {
+      fillPixels(row, &p2, j, cols2);
+      j = cols2;
+    }
+    fillPixels(row, NULL, j, cols);
   }
-  return in;
 }
 
 /* _______alpha blend________                                                 
  * blend two images into one using the given alpha factor                      
+ * (the result has the layout of in1)
  */
 Image blend(const Image in1, const Image in2, double alpha) {
   
@@ -79,208 +205,2596 @@ Image blend(const Image in1, const Image in2, double alpha) {
     rowMIN = in2.rows;
   }
 
-  Image image = make_image(rowMAX, colMAX);
-  
-  // Initialize all pixels in new image to black
-  for (int i = 0; i < rowMAX * colMAX; i++) {
-    image.data[i].r = 0;
-    image.data[i].g = 0;
-    image.data[i].b = 0;
+  Image image = make_image_uninit(rowMAX, colMAX, in1.layout);
+  if (image.data == NULL) {
+    return image;
   }
+
+  BlendJob job = { in1 , in2 , alpha , rowMIN , colMIN , image };
+  parallel_for(rowMAX, blendRows, &job);
   
-  // blend area of smaller image
-  for (int i = 0; i < rowMIN; i++) {
-    for (int j = 0; j < colMIN; j++) {
-      // change pixels 
-      image.data[i * image.cols + j].r = (unsigned char)((in1.data[i * in1.cols + j].r * alpha) + (in2.data[i * in2.cols + j].r * (1 - alpha)));
-      image.data[i * image.cols + j].g = (unsigned char)((in1.data[i * in1.cols + j].g * alpha) + (in2.data[i * in2.cols + j].g * (1 - alpha)));
-      image.data[i * image.cols + j].b = (unsigned char)((in1.data[i * in1.cols + j].b * alpha) + (in2.data[i * in2.cols + j].b * (1 - alpha)));
+  return image;
+}
+
+/* _______blend_in_place________
+ * blend like blend, writing into whichever input already covers the result
+ */
+Image blend_in_place(Image in1, Image in2, double alpha) {
+  Image target;
+  if (in1.rows >= in2.rows && in1.cols >= in2.cols) {
+    target = in1;
+  }
+  else if (in2.rows >= in1.rows && in2.cols >= in1.cols && in2.layout == in1.layout) {
+    target = in2;
+  }
+  else { //neither input is big enough, so blend into a new image
+    Image result = blend(in1, in2, alpha);
+    if (result.data != NULL) {
+      free_image(&in1);
+      free_image(&in2);
     }
+    return result;
+  }
+
+  int rowMIN = in1.rows < in2.rows ? in1.rows : in2.rows;
+  int colMIN = in1.cols < in2.cols ? in1.cols : in2.cols;
+  //the overlap is blended pixel by pixel into target and the rest of
+  //target is already the right image, so nothing is copied or cleared
+  BlendJob job = { in1 , in2 , alpha , rowMIN , colMIN , target };
+  parallel_for(target.rows, blendRows, &job);
+
+  if (target.data == in1.data) {
+    free_image(&in2);
+  }
+  else {
+    free_image(&in1);
   }
+  return target;
+}
   
-  // assign pixels outside the blended area to their original image
-  if (rowMAX > rowMIN) {
-    for (int i = rowMIN; i < rowMAX; i++) { // area between smaller and larger image boundaries
-      for (int j = 0; j < colMAX; j++) {
-        if (i < in1.rows && j < in1.cols) {
-          image.data[i * image.cols + j] = in1.data[i * in1.cols + j]; // result image at that spot is set to input image
-        } 
-        else if (i < in2.rows && j < in2.cols) {
-          image.data[i * image.cols + j] = in2.data[i * in2.cols + j]; // result image at that spot is set to input image
-        }
+
+/* the ways the rotate/flip engine can turn an image */
+typedef enum { TURN_CCW , TURN_CW , TURN_180 , TURN_FLIP_H , TURN_FLIP_V } Turn;
+
+/* work shared out by parallel_for for the rotations and flips */
+typedef struct {
+  Image in;
+  Image out; // same as in when working in place
+  Turn turn;
+} TurnJob;
+
+/* Helper function for the rotations
+ * quarter turn into a new image, for the bands of ROTATE_TILE output rows
+ * begin to end - 1. Each tile of the band reads a ROTATE_TILE wide strip
+ * of ROTATE_TILE input rows, which stays in cache while the tile is
+ * written out row by row.
+ */
+static void quarterTiles(void *arg, int begin, int end) {
+  const TurnJob *job = arg;
+  const Image in = job->in;
+  const Image out = job->out;
+  //output pixel (r, c) is input pixel base + r * dr + c * dc
+  ptrdiff_t base, dr, dc;
+  if (job->turn == TURN_CCW) {
+    base = in.cols - 1;
+    dr = -1;
+    dc = in.cols;
+  }
+  else {
+    base = (ptrdiff_t)(in.rows - 1) * in.cols;
+    dr = 1;
+    dc = -in.cols;
+  }
+
+  for (int band = begin; band < end; band++) {
+    int r0 = band * ROTATE_TILE;
+    int r1 = r0 + ROTATE_TILE < out.rows ? r0 + ROTATE_TILE : out.rows;
+    for (int c0 = 0; c0 < out.cols; c0 += ROTATE_TILE) {
+      int c1 = c0 + ROTATE_TILE < out.cols ? c0 + ROTATE_TILE : out.cols;
+      for (int r = r0; r < r1; r++) {
+	Pixel *dst = out.data + (size_t)r * out.cols;
+	const Pixel *src = in.data + base + r * dr;
+	for (int c = c0; c < c1; c++) {
+	  dst[c] = src[c * dc];
+	}
       }
     }
   }
-  // do the same but with columns
-  if (colMAX > colMIN) {
-    for (int i = 0; i < rowMIN; i++) {
-      for (int j = colMIN; j < colMAX; j++) {
-        if (j < in1.cols) {
-          image.data[i * image.cols + j] = in1.data[i * in1.cols + j];
-        } 
-        else if (j < in2.cols) {
-          image.data[i * image.cols + j] = in2.data[i * in2.cols + j];
-        }
+}
+
+/* Helper function for the rotations
+ * quarter turn of a square image in place, for the bands of ROTATE_TILE
+ * rows begin to end - 1 of its top left quadrant. Every pixel (y, x) of
+ * the quadrant starts a cycle of four pixels that trade places, one in
+ * each quadrant, so a tile of the quadrant touches one tile per quadrant.
+ */
+static void quarterInPlace(void *arg, int begin, int end) {
+  const TurnJob *job = arg;
+  Pixel *pix = job->in.data;
+  int n = job->in.rows;
+  int half_rows = n / 2;
+  int half_cols = (n + 1) / 2; //the middle column of an odd image goes with the left
+#define AT(y, x) pix[(size_t)(y) * n + (x)]
+
+  for (int band = begin; band < end; band++) {
+    int y0 = band * ROTATE_TILE;
+    int y1 = y0 + ROTATE_TILE < half_rows ? y0 + ROTATE_TILE : half_rows;
+    for (int x0 = 0; x0 < half_cols; x0 += ROTATE_TILE) {
+      int x1 = x0 + ROTATE_TILE < half_cols ? x0 + ROTATE_TILE : half_cols;
+      for (int y = y0; y < y1; y++) {
+	for (int x = x0; x < x1; x++) {
+	  Pixel t = AT(y, x);
+	  if (job->turn == TURN_CCW) {
+	    AT(y, x) = AT(x, n - 1 - y);
+	    AT(x, n - 1 - y) = AT(n - 1 - y, n - 1 - x);
+	    AT(n - 1 - y, n - 1 - x) = AT(n - 1 - x, y);
+	    AT(n - 1 - x, y) = t;
+	  }
+	  else {
+	    AT(y, x) = AT(n - 1 - x, y);
+	    AT(n - 1 - x, y) = AT(n - 1 - y, n - 1 - x);
+	    AT(n - 1 - y, n - 1 - x) = AT(x, n - 1 - y);
+	    AT(x, n - 1 - y) = t;
+	  }
+	}
       }
     }
   }
-  
-  return image;
+#undef AT
 }
-  
 
-/* _______rotate-ccw________                                                  
- * rotate the input image counter-clockwise                                    
+/* Helper function for the flips
+ * in place flip of rows begin to end - 1: flip-h reverses each row, flip-v
+ * swaps it with its mirror row and rotate-180 does both (only the top
+ * half of the rows, plus the middle one, are handed out for those two)
  */
-Image rotate_ccw(const Image in) {
-  // Create a new image with the swapped dimensions                    
-  Image rotated_image = make_image(in.cols, in.rows);
+static void mirrorRows(void *arg, int begin, int end) {
+  const TurnJob *job = arg;
+  const Image im = job->in;
+  for (int r = begin; r < end; r++) {
+    Pixel *top = im.data + (size_t)r * im.cols;
+    Pixel *bottom = im.data + (size_t)(im.rows - 1 - r) * im.cols;
+    if (job->turn == TURN_FLIP_V) {
+      for (int c = 0; c < im.cols; c++) {
+	Pixel t = top[c];
+	top[c] = bottom[c];
+	bottom[c] = t;
+      }
+    }
+    else if (job->turn == TURN_180 && top != bottom) {
+      for (int c = 0; c < im.cols; c++) {
+	Pixel t = top[c];
+	top[c] = bottom[im.cols - 1 - c];
+	bottom[im.cols - 1 - c] = t;
+      }
+    }
+    else { //flip-h, or the middle row of rotate-180
+      for (int c = 0; c < im.cols / 2; c++) {
+	Pixel t = top[c];
+	top[c] = top[im.cols - 1 - c];
+	top[im.cols - 1 - c] = t;
+      }
+    }
+  }
+}
 
-  // Transpose the image                                               
-  for (int i = 0; i < in.rows; i++) {
-    for (int j = 0; j < in.cols; j++) {
-      rotated_image.data[j * rotated_image.cols + i].r = in.data[i * in.cols + j].r;
-      rotated_image.data[j * rotated_image.cols + i].g = in.data[i * in.cols + j].g;
-      rotated_image.data[j * rotated_image.cols + i].b = in.data[i * in.cols + j].b;
+/* Helper function for the rotations and flips
+ * turn the image, in place when the shape allows it; images in the other
+ * layouts are packed first
+ */
+static Image turnImage(const Image original, Turn turn) {
+  Image in = original;
+  if (original.layout != LAYOUT_PACKED) { //the tiles copy whole Pixels
+    in = copy_layout(original, LAYOUT_PACKED);
+    if (in.data == NULL) {
+      return in;
     }
   }
+  TurnJob job = { in , in , turn };
 
-  // Flip the columns of the transposed image                             
-  for (int i = 0; i < rotated_image.rows / 2; i++) {
-    for (int j = 0; j < rotated_image.cols; j++) {
-      // Swap the data in the rows                                 
-      Pixel tempdata = rotated_image.data[i * rotated_image.cols + j];
-      rotated_image.data[i * rotated_image.cols + j] = rotated_image.data[(rotated_image.rows - 1 - i) * rotated_image.cols + j];
-      rotated_image.data[(rotated_image.rows - 1 - i) * rotated_image.cols + j] = tempdata;
+  if (turn == TURN_FLIP_H) {
+    parallel_for(in.rows, mirrorRows, &job);
+  }
+  else if (turn == TURN_FLIP_V) {
+    parallel_for(in.rows / 2, mirrorRows, &job);
+  }
+  else if (turn == TURN_180) {
+    parallel_for((in.rows + 1) / 2, mirrorRows, &job);
+  }
+  else if (in.rows == in.cols) {
+    parallel_for((in.rows / 2 + ROTATE_TILE - 1) / ROTATE_TILE, quarterInPlace, &job);
+  }
+  else {
+    // Create a new image with the swapped dimensions
+    job.out = make_image(in.cols, in.rows);
+    if (job.out.data == NULL) {
+      if (in.data != original.data) {
+	free_image(&in);
+      }
+      return job.out;
+    }
+    parallel_for((job.out.rows + ROTATE_TILE - 1) / ROTATE_TILE, quarterTiles, &job);
+    if (in.data != original.data) {
+      free_image(&in);
     }
   }
 
-  // Free the input image data 
-  free(in.data);
+  // Free the input image data unless the result is it
+  if (job.out.data != original.data) {
+    Image old = original;
+    free_image(&old);
+  }
+  return job.out;
+}
+
+/* _______rotate-ccw________                                                  
+ * rotate the input image counter-clockwise                                    
+ */
+Image rotate_ccw(const Image in) {
+  return turnImage(in, TURN_CCW);
+}
+
+/* _______rotate-cw________
+ * rotate the input image clockwise
+ */
+Image rotate_cw(const Image in) {
+  return turnImage(in, TURN_CW);
+}
 
-  // Return the rotated image
-  return rotated_image;
+/* _______rotate-180________
+ * turn the input image upside down
+ */
+Image rotate_180(const Image in) {
+  return turnImage(in, TURN_180);
 }
 
-/* _______pointilism________                                                  
- * apply a painting like effect i.e. poitilism technique.                      
+/* _______flip-h________
+ * mirror the input image left to right
  */
-Image pointilism(const Image in, unsigned int seed) {
-  srand(seed); // create the standardized random
+Image flip_h(const Image in) {
+  return turnImage(in, TURN_FLIP_H);
+}
 
-  int numPix = in.rows * in.cols; // total pixels because dynamic allocation uses one continuous array of memory
-  int pointPix = (int)numPix * 0.03; // 3% of total grid to apply pointilism
-  Image black_image = make_image(in.rows,in.cols);
+/* _______flip-v________
+ * mirror the input image top to bottom
+ */
+Image flip_v(const Image in) {
+  return turnImage(in, TURN_FLIP_V);
+}
+
+/* Helper function for the in-place rotations
+ * transpose a rows x cols packed image whose rows are back to back into a
+ * cols x rows one in the same memory. Pixel i = y * cols + x belongs at
+ * x * rows + y, which is i * rows modulo the last index (the first and
+ * last pixels stay put), so the pixels trade places along the cycles of
+ * that map. Each cycle is followed once, from the first pixel of it the
+ * scan meets; moved has a bit per pixel marking the ones already placed.
+ */
+static void transposeCycles(Pixel *pix, int rows, int cols, unsigned long long *moved) {
+  size_t last = (size_t)rows * cols - 1;
+  for (size_t i = 1; i < last; i++) {
+    if (moved[i >> 6] == ~0ULL) { //a whole word already placed
+      i |= 63;
+      continue;
+    }
+    if (moved[i >> 6] >> (i & 63) & 1) {
+      continue;
+    }
+    Pixel carry = pix[i];
+    size_t at = i;
+    do {
+      at = (size_t)((unsigned long long)at * rows % last);
+      Pixel t = pix[at];
+      pix[at] = carry;
+      carry = t;
+      moved[at >> 6] |= 1ULL << (at & 63);
+    } while (at != i);
+  }
+}
 
-  for (int i = 0; i < in.rows * in.cols; i++) { // initialize new image to black
-    black_image.data[i].r = 0;
-    black_image.data[i].g = 0;
-    black_image.data[i].b = 0;
+/* Helper function for the in-place rotations
+ * quarter turn without a second image: square images and the other
+ * layouts go through turnImage, the rest are transposed and then mirrored
+ */
+static Image turnInPlace(const Image in, Turn turn) {
+  if (in.layout != LAYOUT_PACKED || in.stride != sizeof(Pixel) * in.cols || in.rows == in.cols) {
+    return turnImage(in, turn);
+  }
+  Image out = { NULL , 0 , 0 , NULL , 0 , LAYOUT_PACKED , 0 };
+  size_t count = (size_t)in.rows * in.cols;
+  unsigned long long *moved = calloc((count + 63) / 64, sizeof(unsigned long long));
+  if (moved == NULL) {
+    return out;
   }
+  StatsMark t = stats_begin();
+  transposeCycles(in.data, in.rows, in.cols, moved);
+  stats_end("rotate.cycles", t);
+  free(moved);
 
-  int radius;
-  int randX;
-  int randY;
-  
-  for (int i = 0; i < pointPix; i++) { // choose pixels to change using random seed
-    radius = rand() % 5 + 1;
-    randX = rand() % in.cols;
-    randY = rand() % in.rows;
+  out = in;
+  out.rows = in.cols;
+  out.cols = in.rows;
+  out.stride = sizeof(Pixel) * out.cols;
+  //ccw is the transpose upside down, cw the transpose mirrored
+  TurnJob job = { out , out , turn == TURN_CCW ? TURN_FLIP_V : TURN_FLIP_H };
+  parallel_for(turn == TURN_CCW ? out.rows / 2 : out.rows, mirrorRows, &job);
+  return out;
+}
 
-    // Get the color of the center pixel
-    Pixel centerColor = in.data[randY * in.cols + randX];
-
-    for (int j = -radius; j <= radius; j++) { // create a circle around each pixel to pointillate
-      for (int k = -radius; k <= radius; k++) {
-	if ((j * j) + (k * k) <= (radius * radius)) {
-	  int resultY = randY + j;
-	  int resultX = randX + k;
-	  if (resultX >= 0 && resultY >= 0 && resultX < in.cols && resultY < in.rows) {
-	    // Assign the adjusted color of the center pixel to the pixels within the radius
-	    black_image.data[resultY * in.cols + resultX] =  centerColor;
-	  }
+/* _______rotate_ccw_in_place________
+ * rotate counter-clockwise in the input's own memory
+ */
+Image rotate_ccw_in_place(const Image in) {
+  return turnInPlace(in, TURN_CCW);
+}
+
+/* _______rotate_cw_in_place________
+ * rotate clockwise in the input's own memory
+ */
+Image rotate_cw_in_place(const Image in) {
+  return turnInPlace(in, TURN_CW);
+}
+
+#define ROTATE_PI 3.14159265358979323846
+#define ROTATE_FRAC 16 // fraction bits of the fixed point input positions
+#define ROTATE_BIAS 4 // pixels added to the positions so they stay positive
+#define ROTATE_CUBIC_BITS 10 // the cubic weights sum to 1 << ROTATE_CUBIC_BITS
+
+/* work shared out by parallel_for for rotate */
+typedef struct {
+  Image in;
+  Image out;
+  RotateFilter filter;
+  double cos_a; // input columns and rows moved per output column
+  double sin_a;
+  int tiles_across; // tiles in a row of the output
+  int cubic[256][4]; // Catmull-Rom weights for each 1/256 of a pixel
+} RotateJob;
+
+/* Helper function for rotate
+ * the output pixels from to to - 1 of a row, stepping the input position
+ * (fx, fy) by (dx, dy) for each. Positions are in fixed point, plus
+ * ROTATE_BIAS pixels, and have to land on the input (within half a pixel
+ * of its edge samples) to be sampled; the rest are black. The sample
+ * neighbours are clamped to the input. Inlined with constant steps and
+ * filters by rotateTiles.
+ */
+static inline void rotateRow(const RotateJob *job, PixelSpan src, PixelSpan dst, int step, int bicubic,
+			     long long fx, long long fy, long long dx, long long dy, int from, int to) {
+  const long long one = 1LL << ROTATE_FRAC;
+  const long long lo = (2 * ROTATE_BIAS - 1) * one / 2;
+  const long long hi_x = lo + job->in.cols * one, hi_y = lo + job->in.rows * one;
+  int last_x = job->in.cols - 1, last_y = job->in.rows - 1;
+  size_t stride = job->in.stride;
+  for (int c = from; c < to; c++, fx += dx, fy += dy) {
+    if (fx < lo || fx > hi_x || fy < lo || fy > hi_y) {
+      for (int k = 0; k < 3; k++) {
+	dst.chan[k][c * step] = 0;
+      }
+      continue;
+    }
+    int ix = (int)(fx >> ROTATE_FRAC) - ROTATE_BIAS, iy = (int)(fy >> ROTATE_FRAC) - ROTATE_BIAS;
+    int wx = (int)(fx >> (ROTATE_FRAC - 8)) & 255, wy = (int)(fy >> (ROTATE_FRAC - 8)) & 255;
+    if (!bicubic) {
+      size_t x0, x1, y0, y1;
+      if (ix >= 0 && ix < last_x && iy >= 0 && iy < last_y) { //inside, the usual case
+	x0 = (size_t)ix * step + (size_t)iy * stride;
+	y0 = 0;
+	x1 = x0 + step;
+	y1 = stride;
+      }
+      else {
+	x0 = (size_t)(ix < 0 ? 0 : ix) * step;
+	x1 = (size_t)(ix + 1 > last_x ? last_x : ix + 1) * step;
+	y0 = (size_t)(iy < 0 ? 0 : iy) * stride;
+	y1 = (size_t)(iy + 1 > last_y ? last_y : iy + 1) * stride;
+      }
+      int w00 = (256 - wx) * (256 - wy), w01 = wx * (256 - wy), w10 = (256 - wx) * wy, w11 = wx * wy;
+      for (int k = 0; k < 3; k++) {
+	const unsigned char *p = src.chan[k];
+	int v = p[y0 + x0] * w00 + p[y0 + x1] * w01 + p[y1 + x0] * w10 + p[y1 + x1] * w11;
+	dst.chan[k][c * step] = (unsigned char)((v + (1 << 15)) >> 16);
+      }
+    }
+    else {
+      size_t xs[4], ys[4];
+      for (int i = 0; i < 4; i++) {
+	int x = ix - 1 + i, y = iy - 1 + i;
+	xs[i] = (size_t)(x < 0 ? 0 : x > last_x ? last_x : x) * step;
+	ys[i] = (size_t)(y < 0 ? 0 : y > last_y ? last_y : y) * stride;
+      }
+      const int *kx = job->cubic[wx], *ky = job->cubic[wy];
+      for (int k = 0; k < 3; k++) {
+	const unsigned char *p = src.chan[k];
+	int v = 0;
+	for (int j = 0; j < 4; j++) {
+	  const unsigned char *line = p + ys[j];
+	  v += ky[j] * (kx[0] * line[xs[0]] + kx[1] * line[xs[1]] + kx[2] * line[xs[2]] + kx[3] * line[xs[3]]);
 	}
+	v = v <= 0 ? 0 : (v + (1 << (2 * ROTATE_CUBIC_BITS - 1))) >> (2 * ROTATE_CUBIC_BITS);
+	dst.chan[k][c * step] = (unsigned char)(v > 255 ? 255 : v);
       }
     }
+  }
+}
 
-
+/* Helper function for rotate
+ * the ROTATE_TILE square tiles begin to end - 1 of the output, counted
+ * row by row. The input position of the first pixel of each row of a
+ * tile is worked out in doubles and the rest stepped from it, so the
+ * rounding of the steps never adds up over more than a tile.
+ */
+static void rotateTiles(void *arg, int begin, int end) {
+  const RotateJob *job = arg;
+  const Image in = job->in, out = job->out;
+  PixelSpan src = image_row(in, 0);
+  int bicubic = job->filter == ROTATE_BICUBIC;
+  const double one = (double)(1LL << ROTATE_FRAC);
+  long long dx = llround(job->cos_a * one), dy = llround(job->sin_a * one);
+  for (int tile = begin; tile < end; tile++) {
+    int r0 = tile / job->tiles_across * ROTATE_TILE, c0 = tile % job->tiles_across * ROTATE_TILE;
+    int r1 = r0 + ROTATE_TILE < out.rows ? r0 + ROTATE_TILE : out.rows;
+    int c1 = c0 + ROTATE_TILE < out.cols ? c0 + ROTATE_TILE : out.cols;
+    for (int r = r0; r < r1; r++) {
+      //output pixel centres relative to the middle of the output, turned
+      //back onto the input's pixel grid
+      double u = c0 + 0.5 - out.cols / 2.0, v = r + 0.5 - out.rows / 2.0;
+      double x = u * job->cos_a - v * job->sin_a + in.cols / 2.0 - 0.5 + ROTATE_BIAS;
+      double y = u * job->sin_a + v * job->cos_a + in.rows / 2.0 - 0.5 + ROTATE_BIAS;
+      long long fx = llround(x * one), fy = llround(y * one);
+      PixelSpan dst = image_row(out, r);
+      if (src.step == 3) {
+	if (bicubic) {
+	  rotateRow(job, src, dst, 3, 1, fx, fy, dx, dy, c0, c1);
+	}
+	else {
+	  rotateRow(job, src, dst, 3, 0, fx, fy, dx, dy, c0, c1);
+	}
+      }
+      else if (src.step == 4) {
+	if (bicubic) {
+	  rotateRow(job, src, dst, 4, 1, fx, fy, dx, dy, c0, c1);
+	}
+	else {
+	  rotateRow(job, src, dst, 4, 0, fx, fy, dx, dy, c0, c1);
+	}
+      }
+      else if (bicubic) {
+	rotateRow(job, src, dst, 1, 1, fx, fy, dx, dy, c0, c1);
+      }
+      else {
+	rotateRow(job, src, dst, 1, 0, fx, fy, dx, dy, c0, c1);
+      }
+    }
   }
-  
-  free(in.data); // free original image data
-  return black_image; 
 }
 
+/* Helper function for rotate
+ * the Catmull-Rom weights of the 4 pixels around a point t (0 to 255
+ * 256ths) past the second one, rounded so they sum to exactly
+ * 1 << ROTATE_CUBIC_BITS
+ */
+static void cubicWeights(int cubic[256][4]) {
+  for (int i = 0; i < 256; i++) {
+    double t = i / 256.0;
+    double w[4] = { (-t * t * t + 2 * t * t - t) / 2 , (3 * t * t * t - 5 * t * t + 2) / 2 ,
+		    (-3 * t * t * t + 4 * t * t + t) / 2 , (t * t * t - t * t) / 2 };
+    int total = 0;
+    for (int j = 0; j < 4; j++) {
+      cubic[i][j] = (int)lround(w[j] * (1 << ROTATE_CUBIC_BITS));
+      total += cubic[i][j];
+    }
+    cubic[i][i < 128 ? 1 : 2] += (1 << ROTATE_CUBIC_BITS) - total; //the rounding goes to the nearest pixel
+  }
+}
 
-//______blur______                                                            
-/* apply a blurring filter to the image                                       
+//______rotate______
+/* quarter turns go to turnImage; anything else is resampled into a new
+ * image sized to the turned corners
  */
-Image blur( const Image in , double sigma ) {
-  
-  if (sigma == 0) { //edge case
+Image rotate( const Image in , double degrees , RotateFilter filter ) {
+  Image result = { NULL , 0 , 0 , NULL , 0 , LAYOUT_PACKED , 0 };
+  if (!isfinite(degrees)) {
+    return result;
+  }
+  double turn = fmod(degrees, 360.0);
+  if (turn < 0) {
+    turn += 360.0;
+  }
+  if (turn == 0) {
     return in;
   }
-  int n;
-  double **gaussian = createMatrix(&n, sigma); // generate gaussian matrix
-  
-  Image result = make_image(in.rows, in.cols); // create new image with same dimensions
-    
-  for (int x = 0; x < in.rows; x++) {
-    for (int y = 0; y < in.cols; y++) {
-      Pixel pix = applyBlur(in, gaussian, n, x, y); // iterate through pixels and apply blur
-      result.data[x * result.cols + y] = pix; // Ensure result uses its own dimensions for indexing
-    }
+  if (turn == 90) {
+    return turnImage(in, TURN_CCW);
+  }
+  if (turn == 180) {
+    return turnImage(in, TURN_180);
+  }
+  if (turn == 270) {
+    return turnImage(in, TURN_CW);
   }
 
-  
-  for (int i = 0; i < n; i++) { //free dynamically allocated matrix
-    free(gaussian[i]);
+  RotateJob job;
+  job.in = in;
+  job.filter = filter;
+  job.cos_a = cos(turn * ROTATE_PI / 180.0);
+  job.sin_a = sin(turn * ROTATE_PI / 180.0);
+  //the corners' reach; a column or row they'd cross by less than a
+  //hundredth of a pixel isn't added
+  double cols = ceil(fabs(in.cols * job.cos_a) + fabs(in.rows * job.sin_a) - 0.01);
+  double rows = ceil(fabs(in.cols * job.sin_a) + fabs(in.rows * job.cos_a) - 0.01);
+  if (cols > INT_MAX || rows > INT_MAX) {
+    return result;
   }
-  free(gaussian);
-  free(in.data); //free original image data
+  result = make_image_uninit(rows < 1 ? 1 : (int)rows, cols < 1 ? 1 : (int)cols, in.layout);
+  if (result.data == NULL) {
+    return result;
+  }
+  job.out = result;
+  job.tiles_across = (result.cols + ROTATE_TILE - 1) / ROTATE_TILE;
+  if (filter == ROTATE_BICUBIC) {
+    cubicWeights(job.cubic);
+  }
+  StatsMark t = stats_begin();
+  parallel_for(job.tiles_across * ((result.rows + ROTATE_TILE - 1) / ROTATE_TILE), rotateTiles, &job);
+  stats_end("rotate.resample", t);
 
+  Image old = in;
+  free_image(&old);
   return result;
-
 }
 
-//______saturate______                                                        
-/* Saturate the image by scaling the deviation from gray                      
+/* half widths of the pointilism dots: row j of a dot of radius r (counting
+ * out from the centre) covers the centre column +- disk_half[r][j], i.e.
+ * every k with j*j + k*k <= r*r */
+static const int disk_half[6][6] = {
+  { 0 },
+  { 1 , 0 },
+  { 2 , 1 , 0 },
+  { 3 , 2 , 2 , 0 },
+  { 4 , 3 , 3 , 2 , 0 },
+  { 5 , 4 , 4 , 4 , 3 , 0 },
+};
+
+/* rows of the output each pointilism paint job covers */
+#define DOT_BAND 64
+
+/* one dot of pointilism, with the colour of its centre pixel */
+typedef struct {
+  int x;
+  int y;
+  int radius;
+  unsigned char color[3];
+} Dot;
+
+/* the work shared by the pointilism jobs */
+typedef struct {
+  Image in;
+  Image out;
+  unsigned long long key; // from the seed
+  Dot *dots;
+  int *band_start; // dots touching band b are band_dots[band_start[b] .. band_start[b + 1] - 1]
+  int *band_dots; // indices into dots, in drawing order within each band
+} DotJob;
+
+/* Helper function for pointilism
+ * the splitmix64 mixing function, a fast hash of a 64-bit counter
  */
-Image saturate(const Image in, double scale) {
-  for (int i = 0; i < in.rows * in.cols; i++) {
-    // Compute the pixel's gray-scale value
-    unsigned char gray = (unsigned char)(0.3 * in.data[i].r + 0.59 * in.data[i].g + 0.11 * in.data[i].b);
+static unsigned long long splitmix64(unsigned long long x) {
+  x += 0x9E3779B97F4A7C15ULL;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+  return x ^ (x >> 31);
+}
 
-    //scaled difference
-    double difference_red = ((double)((in.data[i].r) - gray) * scale) + gray;
-    double difference_green = ((double)((in.data[i].g) - gray) * scale) + gray;
-    double difference_blue = ((double)((in.data[i].b) - gray) * scale) + gray;
+/* Helper function for pointilism
+ * place the dots begin to end - 1. Each dot's position and radius are a
+ * hash of the seed and its index, so any thread can make any dot and the
+ * result doesn't depend on who made it.
+ */
+static void makeDots(void *arg, int begin, int end) {
+  const DotJob *job = arg;
+  PixelSpan src = image_row(job->in, 0);
+  for (int i = begin; i < end; i++) {
+    unsigned long long place = splitmix64(job->key + 2 * (unsigned long long)i);
+    unsigned long long size = splitmix64(job->key + 2 * (unsigned long long)i + 1);
+    Dot *dot = &job->dots[i];
+    dot->x = (int)(((place >> 32) * (unsigned long long)job->in.cols) >> 32);
+    dot->y = (int)(((place & 0xFFFFFFFFULL) * (unsigned long long)job->in.rows) >> 32);
+    dot->radius = (int)(size % 5) + 1;
 
-    //clamp the values
-    if (difference_red <= 0){
-      difference_red = 0;
+    // Get the color of the center pixel
+    size_t center = (size_t)dot->y * job->in.stride + (size_t)dot->x * src.step;
+    for (int c = 0; c < 3; c++) {
+      dot->color[c] = src.chan[c][center];
     }
-    
-    if (difference_red >= 255){
-      difference_red = 255;
+  }
+}
+
+/* Helper function for pointilism
+ * set count pixels of a row to one colour
+ */
+static inline void fillRun(PixelSpan row, int from, int count, const unsigned char color[3]) {
+  if (row.step == 1) { //planar rows are three plain runs
+    for (int c = 0; c < 3; c++) {
+      memset(row.chan[c] + from, color[c], count);
     }
-    if (difference_blue <= 0){
-      difference_blue = 0;
+    return;
+  }
+  for (int c = 0; c < 3; c++) {
+    unsigned char *p = row.chan[c] + (size_t)from * row.step;
+    for (int i = 0; i < count; i++) {
+      p[i * row.step] = color[c];
     }
-    if (difference_blue >= 255){
-      difference_blue = 255;
+  }
+}
+
+/* Helper function for pointilism
+ * paint the bands begin to end - 1: every dot touching a band, in dot
+ * order so later dots cover earlier ones, clipped to the band's rows
+ */
+static void paintBands(void *arg, int begin, int end) {
+  const DotJob *job = arg;
+  for (int b = begin; b < end; b++) {
+    int top = b * DOT_BAND;
+    int bottom = top + DOT_BAND < job->out.rows ? top + DOT_BAND : job->out.rows;
+    for (int n = job->band_start[b]; n < job->band_start[b + 1]; n++) {
+      const Dot *dot = &job->dots[job->band_dots[n]];
+      int first = dot->y - dot->radius < top ? top : dot->y - dot->radius;
+      int last = dot->y + dot->radius >= bottom ? bottom - 1 : dot->y + dot->radius;
+      for (int y = first; y <= last; y++) {
+	int half = disk_half[dot->radius][y > dot->y ? y - dot->y : dot->y - y];
+	int from = dot->x - half < 0 ? 0 : dot->x - half;
+	int to = dot->x + half >= job->out.cols ? job->out.cols - 1 : dot->x + half;
+	fillRun(image_row(job->out, y), from, to - from + 1, dot->color);
+      }
     }
-    if (difference_green <= 0){
-      difference_green = 0;
+  }
+}
+
+/* Helper function for pointilism and pointilism_in_place
+ * paint the dots of in over out, which is either a black image of the same
+ * size or in itself, cleared to black once the dots have their colors.
+ * Returns 0, or -1 if memory runs out (out is left as it was).
+ */
+static int paintDots(const Image in, Image out, unsigned int seed) {
+  int numPix = in.rows * in.cols; // total pixels because dynamic allocation uses one continuous array of memory
+  int pointPix = (int)numPix * 0.03; // 3% of total grid to apply pointilism
+  int bands = (in.rows + DOT_BAND - 1) / DOT_BAND;
+
+  DotJob job;
+  job.in = in;
+  job.out = out;
+  job.key = splitmix64(seed);
+  job.dots = malloc(sizeof(Dot) * (pointPix > 0 ? pointPix : 1));
+  job.band_start = calloc(bands + 1, sizeof(int));
+  job.band_dots = malloc(sizeof(int) * 2 * (pointPix > 0 ? pointPix : 1)); // a dot is never taller than a band, so it touches at most 2
+  int *next = malloc(sizeof(int) * (bands > 0 ? bands : 1));
+  if (job.dots == NULL || job.band_start == NULL || job.band_dots == NULL || next == NULL) {
+    free(job.dots);
+    free(job.band_start);
+    free(job.band_dots);
+    free(next);
+    return -1;
+  }
+
+  StatsMark t = stats_begin();
+  parallel_for(pointPix, makeDots, &job);
+  stats_end("pointilism.dots", t);
+
+  //sort the dots into the bands they touch, keeping them in order
+  for (int i = 0; i < pointPix; i++) {
+    const Dot *dot = &job.dots[i];
+    int top = dot->y - dot->radius < 0 ? 0 : (dot->y - dot->radius) / DOT_BAND;
+    int bottom = dot->y + dot->radius >= in.rows ? bands - 1 : (dot->y + dot->radius) / DOT_BAND;
+    for (int b = top; b <= bottom; b++) {
+      job.band_start[b + 1]++;
     }
-    if (difference_green >= 255){
-      difference_green = 255;
+  }
+  for (int b = 0; b < bands; b++) {
+    job.band_start[b + 1] += job.band_start[b];
+  }
+  memcpy(next, job.band_start, sizeof(int) * bands);
+  for (int i = 0; i < pointPix; i++) {
+    const Dot *dot = &job.dots[i];
+    int top = dot->y - dot->radius < 0 ? 0 : (dot->y - dot->radius) / DOT_BAND;
+    int bottom = dot->y + dot->radius >= in.rows ? bands - 1 : (dot->y + dot->radius) / DOT_BAND;
+    for (int b = top; b <= bottom; b++) {
+      job.band_dots[next[b]++] = i;
     }
-    
-    //assigned the weigheted grayscale values to the data at i
-    in.data[i].r = (unsigned char) ( difference_red);
-    in.data[i].g =(unsigned char) (difference_green);
-    in.data[i].b = (unsigned char) (difference_blue);
+  }
+  free(next);
+
+  if (out.data == in.data) { //every dot has its color, so the picture can go
+    memset(out.data, 0, image_bytes(out));
+  }
+  t = stats_begin();
+  parallel_for(bands, paintBands, &job);
+  stats_end("pointilism.paint", t);
+  free(job.dots);
+  free(job.band_start);
+  free(job.band_dots);
+  return 0;
+}
+
+/* _______pointilism________                                                  
+ * apply a painting like effect i.e. poitilism technique.                      
+ */
+Image pointilism(const Image in, unsigned int seed) {
+  Image black_image = make_image_zeroed(in.rows, in.cols, in.layout); // initialize new image to black
+  if (black_image.data != NULL && paintDots(in, black_image, seed) != 0) {
+    free_image(&black_image);
+  }
+  if (black_image.data == NULL) {
+    return black_image;
+  }
+
+  Image old = in;
+  free_image(&old); // free original image data
+  return black_image; 
+}
 
+/* _______pointilism_in_place________
+ * paint the dots over the input itself
+ */
+Image pointilism_in_place(const Image in, unsigned int seed) {
+  if (paintDots(in, in, seed) != 0) {
+    Image failed = { NULL , 0 , 0 , NULL , 0 , LAYOUT_PACKED , 0 };
+    return failed;
   }
   return in;
 }
+
+
+/* work shared out by parallel_for for the blur passes */
+typedef struct {
+  Image in; // source pixels (exact passes)
+  const double *kernel; // exact passes
+  int n;
+  float *tmp; // horizontally blurred rows (exact), or the float image
+  float *dst; // second float image (box passes)
+  int tmp_row; // image row held in the first row of tmp
+  int rows; // height of the whole image
+  int cols;
+  Image out; // destination pixels
+  int out_row; // image row held in the first row of out
+  int radius; // box passes
+  double coef[4]; // recursive passes
+  int *failed; // set by a pass whose scratch couldn't be allocated
+} BlurPass;
+
+/* Helper function for blur
+ * one channel of one row for blurRows: the channel's bytes are step apart
+ * and the sums go to every third float of out
+ */
+static inline void blurChannel(const unsigned char *row, int step, int cols, const double *kernel, int n, float *out) {
+  int half = n / 2;
+  for (int y = 0; y < cols; y++) {
+    double v = 0.0;
+    if (y >= half && y < cols - half) {
+      const unsigned char *p = row + (y - half) * step;
+      for (int i = 0; i < n; i++) {
+	v += p[i * step] * kernel[i];
+      }
+    }
+    else {
+      double total = 0.0;
+      for (int i = -half; i <= half; i++) {
+	if (y + i >= 0 && y + i < cols) {
+	  v += row[(y + i) * step] * kernel[i + half];
+	  total += kernel[i + half];
+	}
+      }
+      v /= total;
+    }
+    out[3 * y] = (float)v;
+  }
+}
+
+/* Helper function for blur
+ * horizontal pass: blur the rows begin to end - 1 of in with the 1D kernel,
+ * writing the unrounded r,g,b sums into tmp (3 floats per pixel). Pixels
+ * whose kernel window lies fully inside the row take the branch-free path;
+ * the pixels within half a kernel of the left/right edge renormalize by the
+ * weights that actually landed inside the image, like applyBlur does.
+ */
+static void blurRows(void *arg, int begin, int end) {
+  const BlurPass *pass = arg;
+  const Image in = pass->in;
+  for (int x = begin; x < end; x++) {
+    PixelSpan row = image_row(in, x);
+    float *out = pass->tmp + (size_t)x * in.cols * 3;
+    for (int c = 0; c < 3; c++) { //constant steps let the loads be unrolled
+      if (row.step == 3) {
+	blurChannel(row.chan[c], 3, in.cols, pass->kernel, pass->n, out + c);
+      }
+      else if (row.step == 1) {
+	blurChannel(row.chan[c], 1, in.cols, pass->kernel, pass->n, out + c);
+      }
+      else {
+	blurChannel(row.chan[c], row.step, in.cols, pass->kernel, pass->n, out + c);
+      }
+    }
+  }
+}
+
+/* Helper function for blur
+ * truncate (after multiplying by scale, if scaled) a row of interleaved
+ * r,g,b floats into the pixels of dst
+ */
+static void storeRow(PixelSpan dst, const float *src, int cols, int scaled, float scale) {
+  if (dst.step == 3) { //packed, so the bytes are in the same order
+    unsigned char *out = dst.chan[0];
+    if (scaled) {
+      for (int j = 0; j < cols * 3; j++) {
+	out[j] = (unsigned char)(src[j] * scale);
+      }
+    }
+    else {
+      for (int j = 0; j < cols * 3; j++) {
+	out[j] = (unsigned char)src[j];
+      }
+    }
+    return;
+  }
+  for (int c = 0; c < 3; c++) {
+    unsigned char *out = dst.chan[c];
+    for (int y = 0; y < cols; y++) {
+      out[y * dst.step] = scaled ? (unsigned char)(src[3 * y + c] * scale) : (unsigned char)src[3 * y + c];
+    }
+  }
+}
+
+/* Helper function for blur
+ * vertical pass for the output rows begin to end - 1 (counted from the
+ * first row of out): accumulate whole rows of tmp into acc one kernel tap
+ * at a time so the inner loop runs contiguously over the row, then
+ * truncate into the output row. Rows near the top/bottom renormalize like
+ * blurRows. tmp holds the image rows starting at tmp_row and out the rows
+ * starting at out_row, of an image that is rows tall in total.
+ */
+static void blurColumns(void *arg, int begin, int end) {
+  const BlurPass *pass = arg;
+  const double *kernel = pass->kernel;
+  int n = pass->n;
+  int half = n / 2;
+  int width = pass->cols * 3;
+  float *acc = malloc(sizeof(float) * width);
+  if (acc == NULL) {
+    range_failed(pass->failed);
+    return;
+  }
+  for (int x = pass->out_row + begin; x < pass->out_row + end; x++) {
+    int first = x - half < 0 ? 0 : x - half;
+    int last = x + half >= pass->rows ? pass->rows - 1 : x + half;
+    double total = 0.0;
+
+    for (int j = 0; j < width; j++) {
+      acc[j] = 0.0f;
+    }
+    for (int i = first; i <= last; i++) {
+      const float *src = pass->tmp + (size_t)(i - pass->tmp_row) * width;
+      float factor = (float)kernel[i - x + half];
+      for (int j = 0; j < width; j++) {
+	acc[j] += src[j] * factor;
+      }
+      total += kernel[i - x + half];
+    }
+
+    //interior rows need no scaling, the kernel already sums to 1
+    PixelSpan dst = image_row(pass->out, x - pass->out_row);
+    storeRow(dst, acc, pass->cols, last - first + 1 != n, (float)(1.0 / total));
+  }
+  free(acc);
+}
+
+/* kernels made by createKernel, kept so that blurring many images with the
+ * same sigma (batch mode) doesn't rebuild them; they live until exit */
+#define KERNEL_CACHE 16
+static struct {
+  double sigma;
+  int n;
+  double *kernel;
+} kernels[KERNEL_CACHE];
+static int kernel_count = 0;
+static pthread_mutex_t kernel_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Helper function for blur
+ * the createKernel kernel for sigma, shared from the cache. If the cache
+ * is full the kernel is made just for the caller, and *owned is set to it
+ * so the caller can free it (otherwise *owned is NULL).
+ */
+static const double* sharedKernel(double sigma, int *n, double **owned) {
+  *owned = NULL;
+  pthread_mutex_lock(&kernel_lock);
+  for (int i = 0; i < kernel_count; i++) {
+    if (kernels[i].sigma == sigma) {
+      *n = kernels[i].n;
+      pthread_mutex_unlock(&kernel_lock);
+      return kernels[i].kernel;
+    }
+  }
+  StatsMark t = stats_begin();
+  double *kernel = createKernel(n, sigma);
+  stats_end("blur.kernel", t);
+  if (kernel != NULL && kernel_count < KERNEL_CACHE) {
+    kernels[kernel_count].sigma = sigma;
+    kernels[kernel_count].n = *n;
+    kernels[kernel_count].kernel = kernel;
+    kernel_count++;
+  }
+  else {
+    *owned = kernel;
+  }
+  pthread_mutex_unlock(&kernel_lock);
+  return kernel;
+}
+
+/* Helper function for blur
+ * run both gaussian passes: in holds the image rows starting at in_row and
+ * out receives the rows starting at out_row, of an image that is rows tall.
+ * Returns 0, or -1 if memory runs out.
+ */
+static int gaussianPasses(const Image in, int in_row, int rows, double sigma, Image out, int out_row) {
+  double *owned;
+  size_t size = sizeof(float) * 3 * in.rows * in.cols;
+  BlurPass pass;
+  pass.in = in;
+  pass.kernel = sharedKernel(sigma, &pass.n, &owned); // 1D gaussian kernel
+  pass.tmp = alloc_buffer(size); // horizontally blurred rows
+  pass.tmp_row = in_row;
+  pass.rows = rows;
+  pass.cols = in.cols;
+  pass.out = out;
+  pass.out_row = out_row;
+  int failed = 0;
+  pass.failed = &failed;
+
+  int ok = pass.kernel != NULL && pass.tmp != NULL;
+  if (ok) {
+    StatsMark t = stats_begin();
+    parallel_for(in.rows, blurRows, &pass); // blur along each row
+    stats_end("blur.rows", t);
+    t = stats_begin();
+    parallel_for(out.rows, blurColumns, &pass); // then down each column
+    stats_end("blur.columns", t);
+  }
+
+  free(owned);
+  release_buffer(pass.tmp, size);
+  return ok && !failed ? 0 : -1;
+}
+
+/* Helper function for blur
+ * widths of the three box filters whose repeated application best matches
+ * a gaussian of the given sigma (Kovesi, "Fast almost-gaussian filtering").
+ * Widths are odd so every box is centered on its pixel.
+ */
+static void boxWidths(double sigma, int widths[3]) {
+  double ideal = sqrt(12.0 * sigma * sigma / 3 + 1);
+  int lower = (int)floor(ideal);
+  if (lower % 2 == 0) {
+    lower--;
+  }
+  int upper = lower + 2;
+  int m = (int)round((12.0 * sigma * sigma - 3 * lower * lower - 12 * lower - 9) / (-4.0 * lower - 4));
+  for (int i = 0; i < 3; i++) {
+    widths[i] = i < m ? lower : upper;
+  }
+}
+
+/* Helper function for blur
+ * one running-sum box pass of radius r along the rows begin to end - 1 of
+ * an interleaved 3-channel float buffer, from tmp into dst. Windows that
+ * hang off the edge are averaged over the pixels actually inside the row.
+ */
+static void boxRows(void *arg, int begin, int end) {
+  const BlurPass *pass = arg;
+  int cols = pass->cols;
+  int r = pass->radius;
+  for (int x = begin; x < end; x++) {
+    const float *in = pass->tmp + (size_t)x * cols * 3;
+    float *out = pass->dst + (size_t)x * cols * 3;
+    double sum[3] = {0.0, 0.0, 0.0};
+    int count = 0;
+    for (int y = 0; y <= r && y < cols; y++) {
+      for (int c = 0; c < 3; c++) {
+	sum[c] += in[3 * y + c];
+      }
+      count++;
+    }
+    for (int y = 0; y < cols; y++) {
+      for (int c = 0; c < 3; c++) {
+	out[3 * y + c] = (float)(sum[c] / count);
+      }
+      if (y + r + 1 < cols) { //slide the window right
+	for (int c = 0; c < 3; c++) {
+	  sum[c] += in[3 * (y + r + 1) + c];
+	}
+	count++;
+      }
+      if (y - r >= 0) {
+	for (int c = 0; c < 3; c++) {
+	  sum[c] -= in[3 * (y - r) + c];
+	}
+	count--;
+      }
+    }
+  }
+}
+
+/* Helper function for blur
+ * the vertical version of boxRows, from dst back into tmp, for the float
+ * columns begin to end - 1. It keeps one running sum per column in acc so
+ * every update walks a stretch of a row contiguously.
+ */
+static void boxColumns(void *arg, int begin, int end) {
+  const BlurPass *pass = arg;
+  size_t width = (size_t)pass->cols * 3;
+  int rows = pass->rows;
+  int r = pass->radius;
+  int span = end - begin;
+  double *acc = malloc(sizeof(double) * span);
+  if (acc == NULL) {
+    range_failed(pass->failed);
+    return;
+  }
+  const float *src = pass->dst + begin;
+  float *dst = pass->tmp + begin;
+
+  int count = 0;
+  for (int j = 0; j < span; j++) {
+    acc[j] = 0.0;
+  }
+  for (int x = 0; x <= r && x < rows; x++) {
+    const float *in = src + x * width;
+    for (int j = 0; j < span; j++) {
+      acc[j] += in[j];
+    }
+    count++;
+  }
+  for (int x = 0; x < rows; x++) {
+    float *out = dst + x * width;
+    double scale = 1.0 / count;
+    for (int j = 0; j < span; j++) {
+      out[j] = (float)(acc[j] * scale);
+    }
+    if (x + r + 1 < rows) {
+      const float *in = src + (x + r + 1) * width;
+      for (int j = 0; j < span; j++) {
+	acc[j] += in[j];
+      }
+      count++;
+    }
+    if (x - r >= 0) {
+      const float *in = src + (x - r) * width;
+      for (int j = 0; j < span; j++) {
+	acc[j] -= in[j];
+      }
+      count--;
+    }
+  }
+  free(acc);
+}
+
+/* Helper function for blur
+ * coefficients of the Young-van Vliet recursive gaussian
+ * ("Recursive implementation of the Gaussian filter", 1995).
+ * coef[0] is the input gain B, coef[1..3] the feedback taps b1/b0..b3/b0.
+ */
+static void iirCoefficients(double sigma, double coef[4]) {
+  double q;
+  if (sigma >= 2.5) {
+    q = 0.98711 * sigma - 0.96330;
+  }
+  else {
+    q = 3.97156 - 4.14554 * sqrt(1 - 0.26891 * sigma);
+  }
+  double b0 = 1.57825 + 2.44413 * q + 1.4281 * q * q + 0.422205 * q * q * q;
+  double b1 = 2.44413 * q + 2.85619 * q * q + 1.26661 * q * q * q;
+  double b2 = -(1.4281 * q * q + 1.26661 * q * q * q);
+  double b3 = 0.422205 * q * q * q;
+  coef[1] = b1 / b0;
+  coef[2] = b2 / b0;
+  coef[3] = b3 / b0;
+  coef[0] = 1 - (coef[1] + coef[2] + coef[3]);
+}
+
+/* Helper function for blur
+ * causal then anti-causal recursive filter along the rows begin to end - 1
+ * of tmp, in place. The recursion is started from the edge pixel as if the
+ * row continued with that color, which is the steady state of the filter.
+ */
+static void iirRows(void *arg, int begin, int end) {
+  const BlurPass *pass = arg;
+  const double *coef = pass->coef;
+  int cols = pass->cols;
+  for (int x = begin; x < end; x++) {
+    float *row = pass->tmp + (size_t)x * cols * 3;
+    for (int c = 0; c < 3; c++) {
+      double w1 = row[c], w2 = row[c], w3 = row[c];
+      for (int y = 0; y < cols; y++) {
+	double w = coef[0] * row[3 * y + c] + coef[1] * w1 + coef[2] * w2 + coef[3] * w3;
+	row[3 * y + c] = (float)w;
+	w3 = w2;
+	w2 = w1;
+	w1 = w;
+      }
+      double last = row[3 * (cols - 1) + c];
+      w1 = w2 = w3 = last;
+      for (int y = cols - 1; y >= 0; y--) {
+	double w = coef[0] * row[3 * y + c] + coef[1] * w1 + coef[2] * w2 + coef[3] * w3;
+	row[3 * y + c] = (float)w;
+	w3 = w2;
+	w2 = w1;
+	w1 = w;
+      }
+    }
+  }
+}
+
+/* Helper function for blur
+ * the vertical version of iirRows for the float columns begin to end - 1.
+ * The three previous output rows are the filter state, so each step is a
+ * contiguous sweep over a stretch of a row; edge holds a copy of the row
+ * the recursion is started from.
+ */
+static void iirColumns(void *arg, int begin, int end) {
+  const BlurPass *pass = arg;
+  const double *coef = pass->coef;
+  size_t width = (size_t)pass->cols * 3;
+  int rows = pass->rows;
+  int span = end - begin;
+  float *buf = pass->tmp + begin;
+  float *edge = malloc(sizeof(float) * span);
+  if (edge == NULL) {
+    range_failed(pass->failed);
+    return;
+  }
+
+  memcpy(edge, buf, sizeof(float) * span);
+  for (int x = 0; x < rows; x++) { //causal pass, top to bottom
+    float *row = buf + x * width;
+    const float *p1 = x >= 1 ? row - width : edge;
+    const float *p2 = x >= 2 ? row - 2 * width : edge;
+    const float *p3 = x >= 3 ? row - 3 * width : edge;
+    for (int j = 0; j < span; j++) {
+      row[j] = (float)(coef[0] * row[j] + coef[1] * p1[j] + coef[2] * p2[j] + coef[3] * p3[j]);
+    }
+  }
+  memcpy(edge, buf + (rows - 1) * width, sizeof(float) * span);
+  for (int x = rows - 1; x >= 0; x--) { //anti-causal pass, bottom to top
+    float *row = buf + x * width;
+    const float *p1 = x + 1 < rows ? row + width : edge;
+    const float *p2 = x + 2 < rows ? row + 2 * width : edge;
+    const float *p3 = x + 3 < rows ? row + 3 * width : edge;
+    for (int j = 0; j < span; j++) {
+      row[j] = (float)(coef[0] * row[j] + coef[1] * p1[j] + coef[2] * p2[j] + coef[3] * p3[j]);
+    }
+  }
+  free(edge);
+}
+
+/* Helper function for blur
+ * copy the rows begin to end - 1 of the input pixels into the float image
+ */
+static void toFloatRows(void *arg, int begin, int end) {
+  const BlurPass *pass = arg;
+  int cols = pass->cols;
+  for (int x = begin; x < end; x++) {
+    PixelSpan src = image_row(pass->in, x);
+    float *dst = pass->tmp + (size_t)x * cols * 3;
+    for (int y = 0; y < cols; y++) {
+      for (int c = 0; c < 3; c++) {
+	dst[3 * y + c] = src.chan[c][y * src.step];
+      }
+    }
+  }
+}
+
+/* Helper function for blur
+ * clamp and truncate the rows begin to end - 1 of the float image into the
+ * output pixels (the recursive filter can ring slightly past 0..255)
+ */
+static void fromFloatRows(void *arg, int begin, int end) {
+  const BlurPass *pass = arg;
+  int cols = pass->cols;
+  for (int x = begin; x < end; x++) {
+    const float *src = pass->tmp + (size_t)x * cols * 3;
+    PixelSpan dst = image_row(pass->out, x);
+    for (int y = 0; y < cols; y++) {
+      for (int c = 0; c < 3; c++) {
+	float v = src[3 * y + c];
+	dst.chan[c][y * dst.step] = v <= 0 ? 0 : (v >= 255 ? 255 : (unsigned char)v);
+      }
+    }
+  }
+}
+
+/* Helper function for blur
+ * separable truncated gaussian, the same filter as createMatrix/applyBlur.
+ * Returns a new image; in is left alone.
+ */
+static Image exactBlur(const Image in, double sigma) {
+  Image result = make_image_uninit(in.rows, in.cols, in.layout); // create new image with same dimensions
+  if (result.data != NULL && gaussianPasses(in, 0, in.rows, sigma, result, 0) != 0) {
+    free_image(&result);
+  }
+  return result;
+}
+
+/* Helper function for blur
+ * run the box or recursive approximation on a float copy of the image and
+ * truncate the result back into a new image. Returns a new image; in is
+ * left alone.
+ */
+static Image approximateBlur(const Image in, double sigma, BlurMode mode) {
+  Image result = { NULL , 0 , 0 , NULL , 0 , LAYOUT_PACKED , 0 };
+  size_t size = (size_t)in.rows * in.cols * 3;
+  BlurPass pass;
+  pass.in = in;
+  pass.rows = in.rows;
+  pass.cols = in.cols;
+  pass.tmp = alloc_buffer(sizeof(float) * size);
+  pass.dst = mode == BLUR_BOX ? alloc_buffer(sizeof(float) * size) : NULL; // box passes ping-pong
+  int failed = 0;
+  pass.failed = &failed;
+
+  if (pass.tmp != NULL && (mode != BLUR_BOX || pass.dst != NULL)) {
+    result = make_image_uninit(in.rows, in.cols, in.layout);
+  }
+  if (result.data != NULL) {
+    pass.out = result;
+    parallel_for(in.rows, toFloatRows, &pass);
+
+    StatsMark t = stats_begin();
+    if (mode == BLUR_BOX) {
+      int widths[3];
+      boxWidths(sigma, widths);
+      for (int i = 0; i < 3; i++) {
+	pass.radius = widths[i] / 2;
+	parallel_for(in.rows, boxRows, &pass);
+	parallel_for(in.cols * 3, boxColumns, &pass);
+      }
+    }
+    else {
+      iirCoefficients(sigma, pass.coef);
+      parallel_for(in.rows, iirRows, &pass);
+      parallel_for(in.cols * 3, iirColumns, &pass);
+    }
+    stats_end(mode == BLUR_BOX ? "blur.box" : "blur.iir", t);
+
+    parallel_for(in.rows, fromFloatRows, &pass);
+    if (failed) {
+      free_image(&result);
+    }
+  }
+
+  release_buffer(pass.tmp, sizeof(float) * size);
+  release_buffer(pass.dst, sizeof(float) * size);
+  return result;
+}
+
+//______blur______                                                            
+/* apply a blurring filter to the image                                       
+ */
+Image blur( const Image in , double sigma ) {
+  return blur_with_mode(in, sigma, BLUR_AUTO);
+}
+
+//______blur_with_mode______
+/* apply a blurring filter to the image with the chosen engine
+ */
+Image blur_with_mode( const Image in , double sigma , BlurMode mode ) {
+
+  if (sigma == 0) { //edge case
+    return in;
+  }
+  mode = blur_engine(sigma, mode);
+
+  Image result;
+  if (mode == BLUR_EXACT) {
+    result = exactBlur(in, sigma);
+  }
+  else {
+    result = approximateBlur(in, sigma, mode);
+  }
+
+  if (result.data != NULL) {
+    Image old = in;
+    free_image(&old); //free original image data
+  }
+  return result;
+
+}
+
+//______blur_engine______
+/* BLUR_AUTO by sigma, anything else as it is
+ */
+BlurMode blur_engine( double sigma , BlurMode mode ) {
+  if (mode == BLUR_AUTO) {
+    return sigma >= BLUR_AUTO_SIGMA ? BLUR_BOX : BLUR_EXACT;
+  }
+  return mode;
+}
+
+//______blur_in_place______
+/* blur a band of rows at a time back into the image: the rows are blurred
+ * across as they come into a window of float rows, which keeps those the
+ * bands below still need after their pixels have been overwritten
+ */
+Image blur_in_place( const Image in , double sigma ) {
+  if (sigma == 0) { //edge case
+    return in;
+  }
+  if (in.layout != LAYOUT_PACKED) {
+    return blur_with_mode(in, sigma, BLUR_EXACT);
+  }
+  Image failed = { NULL , 0 , 0 , NULL , 0 , LAYOUT_PACKED , 0 };
+  int rows = in.rows, cols = in.cols;
+  size_t width = (size_t)cols * 3; //floats per row
+  double *owned;
+  BlurPass pass;
+  pass.kernel = sharedKernel(sigma, &pass.n, &owned); // 1D gaussian kernel
+  pass.rows = rows;
+  pass.cols = cols;
+  int stopped = 0;
+  pass.failed = &stopped;
+  int halo = pass.n / 2;
+  int band = 2 * halo > BLUR_BAND_ROWS ? 2 * halo : BLUR_BAND_ROWS;
+  band = band > rows ? rows : band;
+  int window_rows = band + 2 * halo > rows ? rows : band + 2 * halo;
+  size_t size = sizeof(float) * width * window_rows;
+  float *window = alloc_buffer(size);
+  if (pass.kernel == NULL || window == NULL) {
+    free(owned);
+    release_buffer(window, size);
+    return failed;
+  }
+
+  int window_row = 0; //first image row held in window
+  int loaded = 0; //number of rows in window
+  for (int row = 0; row < rows && !stopped; row += band) {
+    int count = rows - row < band ? rows - row : band;
+    int need_first = row - halo < 0 ? 0 : row - halo;
+    int need_last = row + count + halo > rows ? rows : row + count + halo;
+
+    //slide the rows still needed to the front of the window
+    if (need_first > window_row) {
+      int keep = window_row + loaded - need_first;
+      if (keep > 0) {
+	memmove(window, window + (size_t)(need_first - window_row) * width, sizeof(float) * width * keep);
+      }
+      loaded = keep > 0 ? keep : 0;
+      window_row = need_first;
+    }
+    //and blur the new ones across, from pixels not overwritten yet
+    int first_new = window_row + loaded;
+    Image fresh = { (Pixel *)((unsigned char *)in.data + in.stride * first_new) , need_last - first_new , cols , NULL , 0 , LAYOUT_PACKED , in.stride };
+    pass.in = fresh;
+    pass.tmp = window + (size_t)loaded * width;
+    StatsMark t = stats_begin();
+    parallel_for(fresh.rows, blurRows, &pass);
+    stats_end("blur.rows", t);
+    loaded += fresh.rows;
+
+    Image out = { (Pixel *)((unsigned char *)in.data + in.stride * row) , count , cols , NULL , 0 , LAYOUT_PACKED , in.stride };
+    pass.tmp = window;
+    pass.tmp_row = window_row;
+    pass.out = out;
+    pass.out_row = row;
+    t = stats_begin();
+    parallel_for(count, blurColumns, &pass);
+    stats_end("blur.columns", t);
+  }
+
+  free(owned);
+  release_buffer(window, size);
+  return stopped ? failed : in;
+}
+
+//______blur_band______
+/* blur part of an image that is streamed through memory a band at a time
+ */
+int blur_band( const Image window , int window_row , int rows , double sigma , Image out , int out_row ) {
+  int half = blur_halo(sigma);
+
+  //the window has to cover the halo of every output row
+  int first = out_row - half < 0 ? 0 : out_row - half;
+  int last = out_row + out.rows - 1 + half >= rows ? rows - 1 : out_row + out.rows - 1 + half;
+  if (first < window_row || last >= window_row + window.rows) {
+    return -1;
+  }
+
+  return gaussianPasses(window, window_row, rows, sigma, out, out_row);
+}
+
+//______blur_halo______
+/* number of rows above and below each output row that blur_band needs
+ */
+int blur_halo( double sigma ) {
+  int n;
+  double *owned;
+  sharedKernel(sigma, &n, &owned);
+  free(owned);
+  return n / 2;
+}
+
+//______saturate______                                                        
+/* Saturate the image by scaling the deviation from gray                      
+ */
+/* Helper function for saturate and apply_pointwise
+ * saturate count pixels in place
+ */
+static void saturatePixels(PixelSpan pix, size_t count, double scale) {
+  //the vector kernel does what it can, this loop finishes the rest
+  for (size_t i = saturate_simd(pix, count, scale); i < count; i++) {
+    unsigned char *r = pix.chan[0] + i * pix.step;
+    unsigned char *g = pix.chan[1] + i * pix.step;
+    unsigned char *b = pix.chan[2] + i * pix.step;
+    // Compute the pixel's gray-scale value
+    unsigned char gray = (unsigned char)(0.3 * *r + 0.59 * *g + 0.11 * *b);
+
+    //scaled difference
+    double difference_red = ((double)((*r) - gray) * scale) + gray;
+    double difference_green = ((double)((*g) - gray) * scale) + gray;
+    double difference_blue = ((double)((*b) - gray) * scale) + gray;
+
+    //clamp the values
+    if (difference_red <= 0){
+      difference_red = 0;
+    }
+    
+    if (difference_red >= 255){
+      difference_red = 255;
+    }
+    if (difference_blue <= 0){
+      difference_blue = 0;
+    }
+    if (difference_blue >= 255){
+      difference_blue = 255;
+    }
+    if (difference_green <= 0){
+      difference_green = 0;
+    }
+    if (difference_green >= 255){
+      difference_green = 255;
+    }
+    
+    //assigned the weigheted grayscale values to the data at i
+    *r = (unsigned char) ( difference_red);
+    *g =(unsigned char) (difference_green);
+    *b = (unsigned char) (difference_blue);
+
+  }
+}
+
+Image saturate(const Image in, double scale) {
+  PointOp op = { POINT_SATURATE , scale , 0.0 , 0.0 };
+  return apply_pointwise(in, &op, 1);
+}
+
+/* one pass of the compiled chain apply_pointwise runs over each chunk:
+ * STEP_TABLE    every channel through its table
+ * STEP_GRAY     gray = luma[0][r] + luma[1][g] + luma[2][b] (the weights
+ *               times whatever tables came before), then each channel set
+ *               to table[c][gray]; plain when that is just grayscale, so
+ *               the vector kernel can do it
+ * STEP_SATURATE saturatePixels with scale
+ */
+typedef enum { STEP_TABLE , STEP_GRAY , STEP_SATURATE } PointStepKind;
+
+typedef struct {
+  PointStepKind kind;
+  int plain;
+  double scale;
+  unsigned char table[3][256];
+  double luma[3][256];
+} PointStep;
+
+/* work shared out by parallel_for for apply_pointwise */
+typedef struct {
+  Image im;
+  size_t run_len; // pixels in each contiguous run: the whole image if packed, else a row
+  size_t per_run; // chunks in each run
+  const PointStep *steps;
+  int count;
+} PointwiseJob;
+
+/* Helper function for apply_pointwise
+ * what a table operation turns the channel value v into
+ */
+static unsigned char toneValue(const PointOp *op, int v) {
+  double x = v;
+  switch (op->kind) {
+  case POINT_GAMMA:
+    x = 255.0 * pow(v / 255.0, 1.0 / op->arg);
+    break;
+  case POINT_BRIGHTNESS:
+    x = v + op->arg;
+    break;
+  case POINT_CONTRAST:
+    x = (v - 127.5) * op->arg + 127.5;
+    break;
+  case POINT_LEVELS:
+    x = v < op->arg ? 0.0 : v > op->arg2 ? 1.0 : (v - op->arg) / (op->arg2 - op->arg);
+    x = 255.0 * pow(x, 1.0 / op->arg3);
+    break;
+  case POINT_INVERT:
+    x = 255 - v;
+    break;
+  default:
+    break;
+  }
+  x = floor(x + 0.5);
+  return x <= 0.0 ? 0 : x >= 255.0 ? 255 : (unsigned char)x;
+}
+
+/* Helper function for apply_pointwise
+ * turn the operations into as few steps as possible (see PointStep);
+ * returns the number of steps, at most count
+ */
+static int compileSteps(const PointOp *ops, int count, PointStep *steps) {
+  int n = 0;
+  for (int i = 0; i < count; i++) {
+    PointStep *last = n > 0 ? &steps[n - 1] : NULL;
+    if (ops[i].kind == POINT_SATURATE) {
+      steps[n].kind = STEP_SATURATE;
+      steps[n].scale = ops[i].arg;
+      n++;
+    }
+    else if (ops[i].kind == POINT_GRAYSCALE) {
+      //the gray of a table step is the weights times its tables
+      PointStep *step = last != NULL && last->kind == STEP_TABLE ? last : &steps[n++];
+      int plain = step != last;
+      for (int v = 0; v < 256; v++) {
+	int r = plain ? v : step->table[0][v];
+	int g = plain ? v : step->table[1][v];
+	int b = plain ? v : step->table[2][v];
+	step->luma[0][v] = 0.3 * r; //the products grayscalePixels adds up
+	step->luma[1][v] = g * 0.59;
+	step->luma[2][v] = b * 0.11;
+	step->table[0][v] = step->table[1][v] = step->table[2][v] = (unsigned char)v;
+      }
+      step->kind = STEP_GRAY;
+      step->plain = plain;
+    }
+    else {
+      //tables compose, whether on their own or applied to the gray
+      PointStep *step = last != NULL && last->kind != STEP_SATURATE ? last : &steps[n++];
+      if (step != last) {
+	step->kind = STEP_TABLE;
+	for (int v = 0; v < 256; v++) {
+	  step->table[0][v] = step->table[1][v] = step->table[2][v] = (unsigned char)v;
+	}
+      }
+      unsigned char tone[256];
+      for (int v = 0; v < 256; v++) {
+	tone[v] = toneValue(&ops[i], v);
+      }
+      for (int c = 0; c < 3; c++) {
+	for (int v = 0; v < 256; v++) {
+	  step->table[c][v] = tone[step->table[c][v]];
+	}
+      }
+      step->plain = 0;
+    }
+  }
+  return n;
+}
+
+/* Helper function for apply_pointwise
+ * run a table or gray step over count pixels
+ */
+static void tablePixels(PixelSpan pix, size_t count, const PointStep *step) {
+  unsigned char *r = pix.chan[0], *g = pix.chan[1], *b = pix.chan[2];
+  int s = pix.step;
+  if (step->kind == STEP_TABLE) {
+    for (size_t i = 0; i < count; i++) {
+      r[i * s] = step->table[0][r[i * s]];
+      g[i * s] = step->table[1][g[i * s]];
+      b[i * s] = step->table[2][b[i * s]];
+    }
+    return;
+  }
+  for (size_t i = 0; i < count; i++) {
+    unsigned char gray = (unsigned char)(step->luma[0][r[i * s]] + step->luma[1][g[i * s]] + step->luma[2][b[i * s]]);
+    r[i * s] = step->table[0][gray];
+    g[i * s] = step->table[1][gray];
+    b[i * s] = step->table[2][gray];
+  }
+}
+
+/* Helper function for apply_pointwise
+ * run every step on the chunks begin to end - 1, a chunk at a time
+ * so each one is still hot in cache for the next step
+ */
+static void pointwiseChunks(void *arg, int begin, int end) {
+  const PointwiseJob *job = arg;
+  for (int c = begin; c < end; c++) {
+    size_t start = (size_t)(c % job->per_run) * POINTWISE_CHUNK;
+    size_t len = job->run_len - start < POINTWISE_CHUNK ? job->run_len - start : POINTWISE_CHUNK;
+    PixelSpan pix = image_row(job->im, (int)(c / job->per_run));
+    for (int k = 0; k < 3; k++) {
+      pix.chan[k] += start * pix.step;
+    }
+    for (int i = 0; i < job->count; i++) {
+      const PointStep *step = &job->steps[i];
+      if (step->kind == STEP_SATURATE) {
+	saturatePixels(pix, len, step->scale);
+      }
+      else if (step->kind == STEP_GRAY && step->plain) {
+	grayscalePixels(pix, len);
+      }
+      else {
+	tablePixels(pix, len, step);
+      }
+    }
+  }
+}
+
+//______apply_pointwise______
+/* apply a chain of per-pixel operations in a single pass over the image
+ */
+Image apply_pointwise( const Image in , const PointOp *ops , int count ) {
+  PointStep one;
+  PointStep *steps = count > 1 ? malloc(sizeof(PointStep) * count) : &one;
+  if (steps == NULL) { //no room to fuse them, so one at a time
+    for (int i = 0; i < count; i++) {
+      apply_pointwise(in, &ops[i], 1);
+    }
+    return in;
+  }
+
+  //packed pixels are one contiguous run; the other layouts pad every row
+  int runs = in.layout == LAYOUT_PACKED ? 1 : in.rows;
+  size_t run_len = in.layout == LAYOUT_PACKED ? (size_t)in.rows * in.cols : (size_t)in.cols;
+  size_t per_run = (run_len + POINTWISE_CHUNK - 1) / POINTWISE_CHUNK;
+  PointwiseJob job = { in , run_len , per_run , steps , compileSteps(ops, count, steps) };
+  parallel_for((int)(runs * per_run), pointwiseChunks, &job);
+  if (steps != &one) {
+    free(steps);
+  }
+  return in;
+}
+
+
+/* pi, for the lanczos weights */
+#define RESIZE_PI 3.14159265358979323846
+
+/* work shared out by parallel_for for resize and shrink_band */
+typedef struct {
+  Image in;
+  Image out;
+  int kx; // box passes: pixels averaged across and down
+  int ky;
+  int out_row; // box passes: row of out the first block of in goes to
+  int taps; // resampling passes: weights per output pixel
+  const int *index; // the input pixel (or row) each weight applies to
+  const float *weights;
+  float *tmp; // rows resampled across, 3 floats per pixel
+  int *failed; // set by a pass whose scratch couldn't be allocated
+} ResizeJob;
+
+/* Helper function for shrink_band
+ * average each ky by kx block of in for the output rows begin to end - 1
+ * (counted from job->out_row), summing a whole row of blocks at once
+ */
+static void shrinkRows(void *arg, int begin, int end) {
+  const ResizeJob *job = arg;
+  int cols = job->out.cols, kx = job->kx, ky = job->ky;
+  unsigned int n = (unsigned int)(kx * ky);
+  unsigned int *sums = malloc(sizeof(unsigned int) * 3 * cols);
+  if (sums == NULL) {
+    range_failed(job->failed);
+    return;
+  }
+  for (int r = begin; r < end; r++) {
+    memset(sums, 0, sizeof(unsigned int) * 3 * cols);
+    for (int y = 0; y < ky; y++) {
+      PixelSpan src = image_row(job->in, r * ky + y);
+      for (int c = 0; c < 3; c++) {
+	const unsigned char *p = src.chan[c];
+	for (int x = 0; x < cols; x++) {
+	  unsigned int s = 0;
+	  for (int i = 0; i < kx; i++) {
+	    s += p[(x * kx + i) * src.step];
+	  }
+	  sums[3 * x + c] += s;
+	}
+      }
+    }
+    PixelSpan dst = image_row(job->out, job->out_row + r);
+    for (int c = 0; c < 3; c++) {
+      for (int x = 0; x < cols; x++) {
+	dst.chan[c][x * dst.step] = (unsigned char)((sums[3 * x + c] + n / 2) / n);
+      }
+    }
+  }
+  free(sums);
+}
+
+/* Helper function for resize
+ * the lanczos3 weights for resampling in_size pixels to out_size: output
+ * pixel o takes weights[o * taps + t] of input pixel index[o * taps + t].
+ * When shrinking the kernel is stretched by the scale so every input pixel
+ * counts; indexes past the edges are clamped to it. Returns taps, or 0 if
+ * memory runs out.
+ */
+static int resampleWeights(int in_size, int out_size, int **index, float **weights) {
+  double scale = (double)in_size / out_size;
+  double stretch = scale > 1.0 ? scale : 1.0;
+  double support = 3.0 * stretch;
+  int taps = in_size == out_size ? 1 : (int)ceil(2.0 * support) + 1;
+  *index = malloc(sizeof(int) * out_size * taps);
+  *weights = malloc(sizeof(float) * out_size * taps);
+  double *v = malloc(sizeof(double) * taps);
+  if (*index == NULL || *weights == NULL || v == NULL) {
+    free(*index);
+    free(*weights);
+    free(v);
+    return 0;
+  }
+  for (int o = 0; o < out_size; o++) {
+    int *idx = *index + (size_t)o * taps;
+    float *w = *weights + (size_t)o * taps;
+    if (taps == 1) { //same size, nothing to resample
+      idx[0] = o;
+      w[0] = 1.0f;
+      continue;
+    }
+    double center = (o + 0.5) * scale;
+    int first = (int)floor(center - support);
+    double total = 0.0;
+    for (int t = 0; t < taps; t++) {
+      double x = (first + t + 0.5 - center) / stretch;
+      if (x == 0.0) {
+	v[t] = 1.0;
+      }
+      else if (x > -3.0 && x < 3.0) {
+	v[t] = 3.0 * sin(RESIZE_PI * x) * sin(RESIZE_PI * x / 3.0) / (RESIZE_PI * RESIZE_PI * x * x);
+      }
+      else {
+	v[t] = 0.0;
+      }
+      total += v[t];
+      int i = first + t;
+      idx[t] = i < 0 ? 0 : i >= in_size ? in_size - 1 : i;
+    }
+    for (int t = 0; t < taps; t++) {
+      w[t] = (float)(v[t] / total);
+    }
+  }
+  free(v);
+  return taps;
+}
+
+/* Helper function for resize
+ * horizontal pass: resample the rows begin to end - 1 of in across into tmp
+ */
+static void resampleRows(void *arg, int begin, int end) {
+  const ResizeJob *job = arg;
+  int cols = job->out.cols, taps = job->taps;
+  for (int r = begin; r < end; r++) {
+    PixelSpan src = image_row(job->in, r);
+    float *out = job->tmp + (size_t)r * cols * 3;
+    for (int x = 0; x < cols; x++) {
+      const int *idx = job->index + (size_t)x * taps;
+      const float *w = job->weights + (size_t)x * taps;
+      for (int c = 0; c < 3; c++) {
+	float v = 0.0f;
+	for (int t = 0; t < taps; t++) {
+	  v += w[t] * src.chan[c][idx[t] * src.step];
+	}
+	out[3 * x + c] = v;
+      }
+    }
+  }
+}
+
+/* Helper function for resize
+ * vertical pass: resample tmp down into the output rows begin to end - 1,
+ * a whole row of weighted tmp rows at a time, rounding and clamping the
+ * lanczos overshoot
+ */
+static void resampleColumns(void *arg, int begin, int end) {
+  const ResizeJob *job = arg;
+  int width = job->out.cols * 3, taps = job->taps;
+  float *acc = malloc(sizeof(float) * width);
+  if (acc == NULL) {
+    range_failed(job->failed);
+    return;
+  }
+  for (int r = begin; r < end; r++) {
+    const int *idx = job->index + (size_t)r * taps;
+    const float *w = job->weights + (size_t)r * taps;
+    for (int j = 0; j < width; j++) {
+      acc[j] = 0.0f;
+    }
+    for (int t = 0; t < taps; t++) {
+      const float *src = job->tmp + (size_t)idx[t] * width;
+      for (int j = 0; j < width; j++) {
+	acc[j] += w[t] * src[j];
+      }
+    }
+    PixelSpan dst = image_row(job->out, r);
+    for (int x = 0; x < job->out.cols; x++) {
+      for (int c = 0; c < 3; c++) {
+	float v = acc[3 * x + c] + 0.5f;
+	dst.chan[c][x * dst.step] = v <= 0.0f ? 0 : v >= 255.0f ? 255 : (unsigned char)v;
+      }
+    }
+  }
+  free(acc);
+}
+
+/* Helper function for resize
+ * resample in to out (any sizes) with separable lanczos3; returns 0, or -1
+ * if memory runs out
+ */
+static int resample(const Image in, Image out) {
+  ResizeJob job;
+  job.in = in;
+  job.out = out;
+  int failed = 0;
+  job.failed = &failed;
+  int *col_index, *row_index;
+  float *col_weights, *row_weights;
+  int col_taps = resampleWeights(in.cols, out.cols, &col_index, &col_weights);
+  int row_taps = resampleWeights(in.rows, out.rows, &row_index, &row_weights);
+  size_t size = sizeof(float) * 3 * in.rows * out.cols;
+  job.tmp = col_taps > 0 && row_taps > 0 ? alloc_buffer(size) : NULL;
+  if (job.tmp != NULL) {
+    job.taps = col_taps;
+    job.index = col_index;
+    job.weights = col_weights;
+    parallel_for(in.rows, resampleRows, &job);
+    job.taps = row_taps;
+    job.index = row_index;
+    job.weights = row_weights;
+    parallel_for(out.rows, resampleColumns, &job);
+  }
+  if (col_taps > 0) {
+    free(col_index);
+    free(col_weights);
+  }
+  if (row_taps > 0) {
+    free(row_index);
+    free(row_weights);
+  }
+  release_buffer(job.tmp, size);
+  return job.tmp != NULL && !failed ? 0 : -1;
+}
+
+//______resize_factors______
+/* the box factors resize shrinks by before resampling
+ */
+void resize_factors( int in_rows , int in_cols , int rows , int cols , int *ky , int *kx ) {
+  *ky = in_rows / rows < 2 ? 1 : in_rows / rows > RESIZE_MAX_BOX ? RESIZE_MAX_BOX : in_rows / rows;
+  *kx = in_cols / cols < 2 ? 1 : in_cols / cols > RESIZE_MAX_BOX ? RESIZE_MAX_BOX : in_cols / cols;
+}
+
+//______shrink_band______
+/* average ky by kx blocks of band into rows of out
+ */
+int shrink_band( const Image band , int kx , int ky , Image out , int out_row ) {
+  int rows = band.rows / ky;
+  if (band.cols / kx < out.cols || out_row + rows > out.rows) {
+    return -1;
+  }
+  ResizeJob job;
+  job.in = band;
+  job.out = out;
+  job.kx = kx;
+  job.ky = ky;
+  job.out_row = out_row;
+  int failed = 0;
+  job.failed = &failed;
+  parallel_for(rows, shrinkRows, &job);
+  return failed ? -1 : 0;
+}
+
+//______resize______
+/* box average by the integer part of the scale, then lanczos3 the rest
+ */
+Image resize( const Image in , int rows , int cols ) {
+  int kx, ky;
+  resize_factors(in.rows, in.cols, rows, cols, &ky, &kx);
+  Image mid = in;
+  if (kx > 1 || ky > 1) {
+    mid = make_image_uninit(in.rows / ky, in.cols / kx, in.layout);
+    if (mid.data == NULL) {
+      return mid;
+    }
+    StatsMark t = stats_begin();
+    int shrunk = shrink_band(in, kx, ky, mid, 0);
+    stats_end("resize.box", t);
+    if (shrunk != 0) {
+      free_image(&mid);
+      return mid;
+    }
+  }
+
+  Image result = mid;
+  if (mid.rows != rows || mid.cols != cols) {
+    result = make_image_uninit(rows, cols, in.layout);
+    StatsMark t = stats_begin();
+    if (result.data != NULL && resample(mid, result) != 0) {
+      free_image(&result);
+    }
+    stats_end("resize.lanczos", t);
+    if (mid.data != in.data) {
+      free_image(&mid);
+    }
+  }
+  if (result.data != NULL && result.data != in.data) {
+    Image old = in;
+    free_image(&old);
+  }
+  return result;
+}
+
+
+/* work shared out by parallel_for for the summed-area tables */
+typedef struct {
+  Image in; // table building: the image summed
+  const AreaTable *table;
+  int bands; // table building: the number of row bands summed on their own
+  int offset_row; // table row added to the rows of the band being fixed up
+  Image out; // filtering: the means
+  int up; // filtering: rows above each pixel in its rectangle
+  int down; // rows below
+  const int *x0; // first and one past the last column of each pixel's rectangle
+  const int *x1;
+  const double *x_inv; // 1 / the width of each pixel's rectangle
+} AreaJob;
+
+/* Helper function for the summed-area tables
+ * the entry at row y, column x of a table (3 sums of the table's size)
+ */
+static inline void* areaEntry(const AreaTable *table, int y, int x) {
+  size_t entry = ((size_t)y * (table->cols + 1) + x) * 3;
+  return (unsigned char *)table->sums + entry * (table->wide ? sizeof(unsigned long long) : sizeof(unsigned int));
+}
+
+/* Helper function for the summed-area tables
+ * add table row src into table row dst, a run of vector adds
+ */
+static void addAreaRow(const AreaTable *table, int dst_row, int src_row) {
+  size_t n = (size_t)(table->cols + 1) * 3;
+  if (table->wide) {
+    unsigned long long *dst = areaEntry(table, dst_row, 0);
+    const unsigned long long *src = areaEntry(table, src_row, 0);
+    for (size_t i = accumulate_simd(dst, src, n, 1); i < n; i++) {
+      dst[i] += src[i];
+    }
+  }
+  else {
+    unsigned int *dst = areaEntry(table, dst_row, 0);
+    const unsigned int *src = areaEntry(table, src_row, 0);
+    for (size_t i = accumulate_simd(dst, src, n, 0); i < n; i++) {
+      dst[i] += src[i];
+    }
+  }
+}
+
+/* Helper function for areaBands
+ * the running sums of the count pixels of src, which are step apart,
+ * into dst from its second entry on (the first is 0)
+ */
+static inline void runningSums32(PixelSpan src, int step, int count, unsigned int *dst) {
+  unsigned int s0 = 0, s1 = 0, s2 = 0;
+  dst[0] = dst[1] = dst[2] = 0;
+  for (int x = 0; x < count; x++) {
+    s0 += src.chan[0][x * step];
+    s1 += src.chan[1][x * step];
+    s2 += src.chan[2][x * step];
+    dst[3 * x + 3] = s0;
+    dst[3 * x + 4] = s1;
+    dst[3 * x + 5] = s2;
+  }
+}
+
+static inline void runningSums64(PixelSpan src, int step, int count, unsigned long long *dst) {
+  unsigned long long s0 = 0, s1 = 0, s2 = 0;
+  dst[0] = dst[1] = dst[2] = 0;
+  for (int x = 0; x < count; x++) {
+    s0 += src.chan[0][x * step];
+    s1 += src.chan[1][x * step];
+    s2 += src.chan[2][x * step];
+    dst[3 * x + 3] = s0;
+    dst[3 * x + 4] = s1;
+    dst[3 * x + 5] = s2;
+  }
+}
+
+/* Helper function for make_area_table
+ * the summed-area table of the image rows in bands begin to end - 1, each
+ * band on its own as if it started the image: the running sums along a
+ * row (with the step of each layout known at compile time), then the
+ * table row above it, which is still in cache, added in. So the table is
+ * written once instead of being summed by rows and then by columns.
+ */
+static void areaBands(void *arg, int begin, int end) {
+  const AreaJob *job = arg;
+  const AreaTable *table = job->table;
+  int cols = table->cols;
+  for (int band = begin; band < end; band++) {
+    int first = (int)((long long)band * table->rows / job->bands);
+    int last = (int)((long long)(band + 1) * table->rows / job->bands);
+    for (int y = first; y < last; y++) {
+      PixelSpan src = image_row(job->in, y);
+      void *dst = areaEntry(table, y + 1, 0);
+      if (table->wide) {
+	switch (src.step) {
+	case 3:
+	  runningSums64(src, 3, cols, dst);
+	  break;
+	case 4:
+	  runningSums64(src, 4, cols, dst);
+	  break;
+	default:
+	  runningSums64(src, 1, cols, dst);
+	}
+      }
+      else {
+	switch (src.step) {
+	case 3:
+	  runningSums32(src, 3, cols, dst);
+	  break;
+	case 4:
+	  runningSums32(src, 4, cols, dst);
+	  break;
+	default:
+	  runningSums32(src, 1, cols, dst);
+	}
+      }
+      if (y > first) {
+	addAreaRow(table, y + 1, y);
+      }
+    }
+  }
+}
+
+/* Helper function for make_area_table
+ * add the table row job->offset_row (the last one of the bands above,
+ * already complete) into the rows offset_row + 1 + begin to
+ * offset_row + end of the band below it
+ */
+static void areaOffsets(void *arg, int begin, int end) {
+  const AreaJob *job = arg;
+  for (int y = begin; y < end; y++) {
+    addAreaRow(job->table, job->offset_row + 1 + y, job->offset_row);
+  }
+}
+
+/* Helper function for mean_filter
+ * the means of the output rows begin to end - 1: four lookups per channel
+ * for the rectangle sums, then one multiply by the inverse of its area.
+ * The rounding is half up: the inverse is only off by a few units in the
+ * last place, far less than the 1e-11 bias, and a mean that isn't a tie
+ * is at least 1 / (2 * area) from one.
+ */
+static void areaMeans(void *arg, int begin, int end) {
+  const AreaJob *job = arg;
+  const AreaTable *table = job->table;
+  int cols = table->cols;
+  for (int y = begin; y < end; y++) {
+    int y0 = y - job->up < 0 ? 0 : y - job->up;
+    int y1 = y + job->down + 1 > table->rows ? table->rows : y + job->down + 1;
+    double y_inv = 1.0 / (y1 - y0);
+    PixelSpan dst = image_row(job->out, y);
+    for (int x = 0; x < cols; x++) {
+      int x0 = job->x0[x], x1 = job->x1[x];
+      double inv = y_inv * job->x_inv[x];
+      unsigned long long sum[3];
+      if (table->wide) {
+	const unsigned long long *a = areaEntry(table, y0, 0), *b = areaEntry(table, y1, 0);
+	for (int c = 0; c < 3; c++) {
+	  sum[c] = b[3 * x1 + c] - b[3 * x0 + c] - a[3 * x1 + c] + a[3 * x0 + c];
+	}
+      }
+      else {
+	const unsigned int *a = areaEntry(table, y0, 0), *b = areaEntry(table, y1, 0);
+	for (int c = 0; c < 3; c++) {
+	  sum[c] = (unsigned int)(b[3 * x1 + c] - b[3 * x0 + c] - a[3 * x1 + c] + a[3 * x0 + c]);
+	}
+      }
+      for (int c = 0; c < 3; c++) {
+	dst.chan[c][x * dst.step] = (unsigned char)((double)sum[c] * inv + (0.5 + 1e-11));
+      }
+    }
+  }
+}
+
+//______make_area_table______
+/* build the summed-area table of in: one band of rows per thread, then
+ * the bands below the first fixed up by the sums above them
+ */
+int make_area_table( const Image in , long long max_area , AreaTable *table ) {
+  table->rows = in.rows;
+  table->cols = in.cols;
+  table->wide = max_area > AREA_NARROW_MAX;
+  size_t entries = (size_t)(in.rows + 1) * (in.cols + 1) * 3;
+  table->bytes = entries * (table->wide ? sizeof(unsigned long long) : sizeof(unsigned int));
+  table->sums = alloc_buffer(table->bytes);
+  if (table->sums == NULL) {
+    return -1;
+  }
+  memset(table->sums, 0, (size_t)(in.cols + 1) * 3 * (table->wide ? sizeof(unsigned long long) : sizeof(unsigned int)));
+
+  AreaJob job;
+  job.in = in;
+  job.table = table;
+  job.bands = get_thread_count() < in.rows ? get_thread_count() : in.rows;
+  if (job.bands > 1) {
+    parallel_for(job.bands, areaBands, &job);
+    for (int band = 1; band < job.bands; band++) {
+      int first = (int)((long long)band * in.rows / job.bands);
+      int last = (int)((long long)(band + 1) * in.rows / job.bands);
+      job.offset_row = first;
+      parallel_for(last - first, areaOffsets, &job);
+    }
+  }
+  else if (in.rows > 0) {
+    job.bands = 1;
+    areaBands(&job, 0, 1);
+  }
+  return 0;
+}
+
+//______area_sum______
+/* four lookups per channel
+ */
+void area_sum( const AreaTable *table , int y0 , int x0 , int y1 , int x1 , unsigned long long sum[3] ) {
+  for (int c = 0; c < 3; c++) {
+    if (table->wide) {
+      const unsigned long long *a = areaEntry(table, y0, 0), *b = areaEntry(table, y1, 0);
+      sum[c] = b[3 * x1 + c] - b[3 * x0 + c] - a[3 * x1 + c] + a[3 * x0 + c];
+    }
+    else {
+      const unsigned int *a = areaEntry(table, y0, 0), *b = areaEntry(table, y1, 0);
+      sum[c] = (unsigned int)(b[3 * x1 + c] - b[3 * x0 + c] - a[3 * x1 + c] + a[3 * x0 + c]);
+    }
+  }
+}
+
+//______free_area_table______
+/* give the sums back to the buffer pool
+ */
+void free_area_table( AreaTable *table ) {
+  release_buffer(table->sums, table->bytes);
+  table->sums = NULL;
+}
+
+//______mean_filter______
+/* a summed-area table of in, then four lookups per pixel and channel
+ */
+Image mean_filter( const Image in , int w , int h ) {
+  Image result = { NULL , 0 , 0 , NULL , 0 , LAYOUT_PACKED , 0 };
+  if (w < 1 || h < 1) {
+    return result;
+  }
+  //the rectangles are cut to the image, so none is bigger than it
+  long long area = (long long)(w < in.cols ? w : in.cols) * (h < in.rows ? h : in.rows);
+  int *x0 = malloc(sizeof(int) * in.cols);
+  int *x1 = malloc(sizeof(int) * in.cols);
+  double *x_inv = malloc(sizeof(double) * in.cols);
+  AreaTable table;
+  table.sums = NULL;
+  if (x0 != NULL && x1 != NULL && x_inv != NULL) {
+    StatsMark t = stats_begin();
+    if (make_area_table(in, area, &table) == 0) {
+      result = make_image_uninit(in.rows, in.cols, in.layout);
+    }
+    stats_end("mean.table", t);
+  }
+
+  if (result.data != NULL) {
+    int left = (w - 1) / 2, right = w / 2;
+    for (int x = 0; x < in.cols; x++) {
+      x0[x] = x - left < 0 ? 0 : x - left;
+      x1[x] = x + right + 1 > in.cols ? in.cols : x + right + 1;
+      x_inv[x] = 1.0 / (x1[x] - x0[x]);
+    }
+    AreaJob job;
+    job.table = &table;
+    job.out = result;
+    job.up = (h - 1) / 2;
+    job.down = h / 2;
+    job.x0 = x0;
+    job.x1 = x1;
+    job.x_inv = x_inv;
+    StatsMark t = stats_begin();
+    parallel_for(in.rows, areaMeans, &job);
+    stats_end("mean.lookups", t);
+  }
+
+  if (table.sums != NULL) {
+    free_area_table(&table);
+  }
+  free(x0);
+  free(x1);
+  free(x_inv);
+  if (result.data != NULL) {
+    Image old = in;
+    free_image(&old);
+  }
+  return result;
+}
+
+//______box_blur______
+/* the mean over a square
+ */
+Image box_blur( const Image in , int radius ) {
+  return mean_filter(in, 2 * radius + 1, 2 * radius + 1);
+}
+
+
+/* work shared out by parallel_for for convolve */
+typedef struct {
+  Image in;
+  Image out;
+  int width; // of the kernel
+  int height;
+  int separable; // the weights are a row factor then a column factor
+  int integer; // whole-number weights, summed in ints
+  const int *iweights; // the weights as ints (integer) or floats (the others):
+  const float *fweights; // height rows of width, or the two factors
+  double scale; // 1 / the divisor
+  double offset;
+  int *failed; // set by a range whose ring couldn't be allocated
+} ConvolveJob;
+
+/* Helper function for convolve
+ * a row as interleaved r,g,b samples, the edge pixels repeated pad
+ * times beyond either end: (cols + 2 * pad) * 3 samples in all
+ */
+static void padLineInt(PixelSpan src, int cols, int pad, int *line) {
+  int *mid = line + 3 * pad;
+  int x = 0;
+  if (src.step == 3) { //packed, so the bytes are in the same order
+    x = (int)widen_simd(mid, src.chan[0], 3 * (size_t)cols, 1);
+    for (; x < 3 * cols; x++) {
+      mid[x] = src.chan[0][x];
+    }
+  }
+  else {
+    for (; x < cols; x++) {
+      for (int c = 0; c < 3; c++) {
+	mid[3 * x + c] = src.chan[c][x * src.step];
+      }
+    }
+  }
+  for (x = 0; x < pad; x++) {
+    for (int c = 0; c < 3; c++) {
+      line[3 * x + c] = mid[c];
+      mid[3 * (cols + x) + c] = mid[3 * (cols - 1) + c];
+    }
+  }
+}
+
+static void padLineFloat(PixelSpan src, int cols, int pad, float *line) {
+  float *mid = line + 3 * pad;
+  int x = 0;
+  if (src.step == 3) {
+    x = (int)widen_simd(mid, src.chan[0], 3 * (size_t)cols, 0);
+    for (; x < 3 * cols; x++) {
+      mid[x] = src.chan[0][x];
+    }
+  }
+  else {
+    for (; x < cols; x++) {
+      for (int c = 0; c < 3; c++) {
+	mid[3 * x + c] = src.chan[c][x * src.step];
+      }
+    }
+  }
+  for (x = 0; x < pad; x++) {
+    for (int c = 0; c < 3; c++) {
+      line[3 * x + c] = mid[c];
+      mid[3 * (cols + x) + c] = mid[3 * (cols - 1) + c];
+    }
+  }
+}
+
+/* Helper function for convolve
+ * the weighted sums of a kw x kh window over kh interleaved lines (so
+ * the taps along a line are 3 samples apart), for the samples from to
+ * n - 1, into out. Inlined with constant sizes by sumInt/sumFloat so the
+ * taps of the small kernels are unrolled.
+ */
+static inline void windowInt(const int *const *lines, const int *w, int kw, int kh, int from, int n, int *out) {
+  for (int x = from; x < n; x++) {
+    int s = 0;
+    for (int k = 0; k < kh; k++) {
+      const int *l = lines[k] + x;
+      for (int j = 0; j < kw; j++) {
+	s += w[k * kw + j] * l[3 * j];
+      }
+    }
+    out[x] = s;
+  }
+}
+
+static inline void windowFloat(const float *const *lines, const float *w, int kw, int kh, int from, int n, float *out) {
+  for (int x = from; x < n; x++) {
+    float s = 0.0f;
+    for (int k = 0; k < kh; k++) {
+      const float *l = lines[k] + x;
+      for (int j = 0; j < kw; j++) {
+	s += w[k * kw + j] * l[3 * j];
+      }
+    }
+    out[x] = s;
+  }
+}
+
+/* Helper function for convolve
+ * the window sums, with the vector kernels and then windowInt/windowFloat
+ * for the rest, the sizes known at compile time for 3x3 and 5x5 kernels
+ * and for the 3 and 5 tap passes of separable ones
+ */
+static void sumInt(const int *const *lines, const int *w, int kw, int kh, int n, int *out) {
+  int x = (int)window_sums_simd(out, (const void *const *)lines, w, kw, kh, n, 1);
+  if (kw == 3 && kh == 3) {
+    windowInt(lines, w, 3, 3, x, n, out);
+  }
+  else if (kw == 5 && kh == 5) {
+    windowInt(lines, w, 5, 5, x, n, out);
+  }
+  else if (kw == 3 && kh == 1) {
+    windowInt(lines, w, 3, 1, x, n, out);
+  }
+  else if (kw == 1 && kh == 3) {
+    windowInt(lines, w, 1, 3, x, n, out);
+  }
+  else if (kw == 5 && kh == 1) {
+    windowInt(lines, w, 5, 1, x, n, out);
+  }
+  else if (kw == 1 && kh == 5) {
+    windowInt(lines, w, 1, 5, x, n, out);
+  }
+  else {
+    windowInt(lines, w, kw, kh, x, n, out);
+  }
+}
+
+static void sumFloat(const float *const *lines, const float *w, int kw, int kh, int n, float *out) {
+  int x = (int)window_sums_simd(out, (const void *const *)lines, w, kw, kh, n, 0);
+  if (kw == 3 && kh == 3) {
+    windowFloat(lines, w, 3, 3, x, n, out);
+  }
+  else if (kw == 5 && kh == 5) {
+    windowFloat(lines, w, 5, 5, x, n, out);
+  }
+  else if (kw == 3 && kh == 1) {
+    windowFloat(lines, w, 3, 1, x, n, out);
+  }
+  else if (kw == 1 && kh == 3) {
+    windowFloat(lines, w, 1, 3, x, n, out);
+  }
+  else if (kw == 5 && kh == 1) {
+    windowFloat(lines, w, 5, 1, x, n, out);
+  }
+  else if (kw == 1 && kh == 5) {
+    windowFloat(lines, w, 1, 5, x, n, out);
+  }
+  else {
+    windowFloat(lines, w, kw, kh, x, n, out);
+  }
+}
+
+/* Helper function for convolve
+ * divide a row of interleaved r,g,b sums by the divisor, add the offset,
+ * and clamp and round them into the pixels of dst
+ */
+static void storeSums(PixelSpan dst, const void *sums, int integer, int cols, double scale, double offset) {
+  int x = 0;
+  if (dst.step == 3) { //packed, so the bytes are in the same order
+    x = (int)store_sums_simd(dst.chan[0], sums, 3 * (size_t)cols, scale, offset, integer);
+  }
+  for (; x < 3 * cols; x++) {
+    double v = (integer ? ((const int *)sums)[x] : ((const float *)sums)[x]) * scale + offset;
+    dst.chan[x % 3][x / 3 * dst.step] = v <= 0 ? 0 : v >= 255 ? 255 : (unsigned char)(v + 0.5);
+  }
+}
+
+/* Helper function for convolve
+ * the output rows begin to end - 1. The image rows the kernel covers are
+ * kept in a ring of height lines, each taken in once: padded at the ends,
+ * and for separable kernels already summed along the row, so an output
+ * row only costs the new line and the sums down the window. Rows above
+ * and below the image repeat the edge rows.
+ */
+static void convolveRows(void *arg, int begin, int end) {
+  const ConvolveJob *job = arg;
+  int cols = job->in.cols, rows = job->in.rows;
+  int kw = job->width, kh = job->height;
+  int pad = kw / 2, half = kh / 2;
+  size_t len = 3 * ((size_t)cols + 2 * pad); //samples in a padded line
+  size_t run = job->separable ? 3 * (size_t)cols : len; //samples in a ring line
+  size_t sample = job->integer ? sizeof(int) : sizeof(float);
+  //the ring, a padded line for the separable pass and a row of sums
+  unsigned char *ring = malloc(sample * (run * kh + len + 3 * (size_t)cols));
+  int *held = malloc(sizeof(int) * kh); //image row in each line of the ring
+  if (ring == NULL || held == NULL) {
+    free(ring);
+    free(held);
+    range_failed(job->failed);
+    return;
+  }
+  unsigned char *padded = ring + sample * run * kh;
+  unsigned char *sums = padded + sample * len;
+  for (int k = 0; k < kh; k++) {
+    held[k] = -1;
+  }
+
+  for (int y = begin; y < end; y++) {
+    const int *iwindow[CONVOLVE_MAX];
+    const float *fwindow[CONVOLVE_MAX];
+    for (int k = 0; k < kh; k++) {
+      int src = y - half + k < 0 ? 0 : y - half + k >= rows ? rows - 1 : y - half + k;
+      int slot = src % kh;
+      unsigned char *line = ring + sample * run * slot;
+      if (held[slot] != src) {
+	PixelSpan pix = image_row(job->in, src);
+	unsigned char *to = job->separable ? padded : line;
+	if (job->integer) {
+	  padLineInt(pix, cols, pad, (int *)to);
+	}
+	else {
+	  padLineFloat(pix, cols, pad, (float *)to);
+	}
+	if (job->separable && job->integer) {
+	  const int *from = (const int *)padded;
+	  sumInt(&from, job->iweights, kw, 1, 3 * cols, (int *)line);
+	}
+	else if (job->separable) {
+	  const float *from = (const float *)padded;
+	  sumFloat(&from, job->fweights, kw, 1, 3 * cols, (float *)line);
+	}
+	held[slot] = src;
+      }
+      iwindow[k] = (const int *)line;
+      fwindow[k] = (const float *)line;
+    }
+
+    //down the window: the column factor of a separable kernel, else all of it
+    int skip = job->separable ? kw : 0, wide = job->separable ? 1 : kw;
+    if (job->integer) {
+      sumInt(iwindow, job->iweights + skip, wide, kh, 3 * cols, (int *)sums);
+    }
+    else {
+      sumFloat(fwindow, job->fweights + skip, wide, kh, 3 * cols, (float *)sums);
+    }
+    storeSums(image_row(job->out, y), sums, job->integer, cols, job->scale, job->offset);
+  }
+  free(ring);
+  free(held);
+}
+
+/* Helper function for convolve
+ * greatest common divisor of two non-negative numbers
+ */
+static long long gcd(long long a, long long b) {
+  while (b != 0) {
+    long long t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+/* Helper function for convolve
+ * whether the kernel is a column times a row (has rank 1), and if so the
+ * two factors. The row through the largest weight is the row factor,
+ * scaled so the column through it gives the column factor, and every
+ * weight is checked against their product. For whole-number kernels the
+ * row is divided by the common factor of its weights, and both factors
+ * have to come out whole and the products exact, so the separable sums
+ * are the same integers the direct ones would be.
+ */
+static int rankOne(const Kernel *kernel, int integer, double row[], double col[]) {
+  int kw = kernel->width, kh = kernel->height;
+  const double *w = kernel->weights;
+  int pivot = 0;
+  for (int i = 1; i < kw * kh; i++) {
+    if (fabs(w[i]) > fabs(w[pivot])) {
+      pivot = i;
+    }
+  }
+  double big = fabs(w[pivot]);
+  if (big == 0) {
+    return 0;
+  }
+  int pr = pivot / kw, pc = pivot % kw;
+
+  double g = w[pivot];
+  if (integer) {
+    long long common = 0;
+    for (int j = 0; j < kw; j++) {
+      common = gcd(common, llabs((long long)w[pr * kw + j]));
+    }
+    g = w[pivot] < 0 ? -(double)common : (double)common;
+    for (int i = 0; i < kh; i++) {
+      if ((long long)w[i * kw + pc] * (long long)g % (long long)w[pivot] != 0) {
+	return 0;
+      }
+    }
+  }
+  for (int j = 0; j < kw; j++) {
+    row[j] = w[pr * kw + j] / g;
+  }
+  for (int i = 0; i < kh; i++) {
+    col[i] = integer ? (double)((long long)w[i * kw + pc] * (long long)g / (long long)w[pivot]) : w[i * kw + pc] / w[pivot] * g;
+  }
+  for (int i = 0; i < kh; i++) {
+    for (int j = 0; j < kw; j++) {
+      double diff = fabs(col[i] * row[j] - w[i * kw + j]);
+      if (integer ? diff != 0 : diff > 1e-9 * big) {
+	return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+//______convolve______
+/* pick the sums (separable or not, whole numbers or not), then run the
+ * rows in parallel
+ */
+Image convolve( const Image in , const Kernel *kernel ) {
+  Image result = { NULL , 0 , 0 , NULL , 0 , LAYOUT_PACKED , 0 };
+  int kw = kernel->width, kh = kernel->height;
+  if (kw < 1 || kh < 1 || kw % 2 == 0 || kh % 2 == 0 || kw > CONVOLVE_MAX || kh > CONVOLVE_MAX || kernel->divisor == 0) {
+    return result;
+  }
+
+  //whole numbers are summed in ints when no sum can overflow one
+  double total = 0.0;
+  int whole = 1;
+  for (int i = 0; i < kw * kh; i++) {
+    total += fabs(kernel->weights[i]);
+    whole = whole && kernel->weights[i] == floor(kernel->weights[i]);
+  }
+  ConvolveJob job;
+  job.integer = whole && total * 255 <= INT_MAX;
+  double row[CONVOLVE_MAX], col[CONVOLVE_MAX];
+  job.separable = rankOne(kernel, job.integer, row, col);
+
+  int iweights[CONVOLVE_MAX * CONVOLVE_MAX];
+  float fweights[CONVOLVE_MAX * CONVOLVE_MAX];
+  int count = job.separable ? kw + kh : kw * kh;
+  for (int i = 0; i < count; i++) {
+    double v = !job.separable ? kernel->weights[i] : i < kw ? row[i] : col[i - kw];
+    iweights[i] = job.integer ? (int)v : 0;
+    fweights[i] = (float)v;
+  }
+  job.in = in;
+  job.width = kw;
+  job.height = kh;
+  job.iweights = iweights;
+  job.fweights = fweights;
+  job.scale = 1.0 / kernel->divisor;
+  job.offset = kernel->offset;
+
+  result = make_image_uninit(in.rows, in.cols, in.layout);
+  if (result.data == NULL) {
+    return result;
+  }
+  job.out = result;
+  int failed = 0;
+  job.failed = &failed;
+  StatsMark t = stats_begin();
+  parallel_for(in.rows, convolveRows, &job);
+  stats_end(job.separable ? "convolve.separable" : "convolve.direct", t);
+  if (failed) {
+    free_image(&result);
+    return result;
+  }
+
+  Image old = in;
+  free_image(&old);
+  return result;
+}
@@ -19,24 +19,360 @@ Image grayscale( const Image in );
 */
 Image blend( const Image in1, const Image in2 , double alpha );
 
+/* _______blend_in_place________
+* blend like blend, but write the result over in1, or over in2 if it has
+* in1's layout, when that input is at least as big as the other both
+* ways; otherwise blend into a new image. Frees the inputs that aren't
+* returned. On failure the result has NULL data and both inputs are
+* left alone.
+*/
+Image blend_in_place( Image in1 , Image in2 , double alpha );
+
 /* _______rotate-ccw________
 * rotate the input image counter-clockwise
 */
 Image rotate_ccw( const Image in );
 
+/* _______rotate-cw________
+* rotate the input image clockwise
+*/
+Image rotate_cw( const Image in );
+
+/* _______rotate-180________
+* turn the input image upside down
+*/
+Image rotate_180( const Image in );
+
+/* _______flip-h________
+* mirror the input image left to right
+*/
+Image flip_h( const Image in );
+
+/* _______flip-v________
+* mirror the input image top to bottom
+*/
+Image flip_v( const Image in );
+
+/* The rotations and flips work in place, returning in, whenever the
+* result has the same shape as the input (flips, 180 degrees and quarter
+* turns of square images); a quarter turn of any other image writes a new
+* one a tile at a time and frees in. If that allocation fails the result
+* has NULL data and in is left alone.
+*/
+
+/* pixels along each side of the tiles rotate_ccw and rotate_cw copy, and
+* rotate resamples, at a time, so the input rows a tile reads stay in
+* cache until it is done */
+#define ROTATE_TILE 64
+
+/* _______rotate_ccw_in_place________
+* rotate_ccw that never needs a second image, whatever the shape. A
+* packed image that isn't square is transposed by following the cycles of
+* the permutation that takes every pixel to its transposed place, then
+* flipped top to bottom. That takes one bit per pixel of scratch to mark
+* the pixels already moved, and is several times slower than rotate_ccw
+* since each move lands far from the last. Other images are turned like
+* rotate_ccw does. If the scratch can't be allocated the result has NULL
+* data and in is left alone.
+*/
+Image rotate_ccw_in_place( const Image in );
+
+/* _______rotate_cw_in_place________
+* rotate_cw like rotate_ccw_in_place, mirroring the transpose left to
+* right instead
+*/
+Image rotate_cw_in_place( const Image in );
+
+/* how rotate samples the input between its pixels
+* ROTATE_BILINEAR  weighs the 2x2 pixels around the point
+* ROTATE_BICUBIC   Catmull-Rom over the 4x4 pixels around it, sharper but
+*                  about three times the work
+*/
+typedef enum {
+  ROTATE_BILINEAR,
+  ROTATE_BICUBIC
+} RotateFilter;
+
+/* _______rotate________
+* rotate the input image counter-clockwise by any angle in degrees
+* (negative ones turn clockwise). Multiples of 90 go to the exact
+* rotations above. Other angles give a new image, in the same layout,
+* just big enough to hold the whole turned input; its corners are black.
+* Each output pixel is traced back into the input and sampled with the
+* filter, with the pixels past the input's edges repeating the edge
+* ones. The output is written a ROTATE_TILE square at a time, so the
+* input pixels a tile reads stay in cache whatever the angle, and the
+* tiles are shared between threads. Along a row of a tile the input
+* position is stepped in 16.16 fixed point rather than recomputed with
+* trigonometry. Frees in and returns the new image; if that can't be
+* allocated the result has NULL data and in is left alone.
+*/
+Image rotate( const Image in , double degrees , RotateFilter filter );
+
 /* _______pointilism________
 * apply a painting like effect i.e. poitilism technique.
+* The dots depend only on seed and the image size (not on the C library
+* or the thread count), so the same seed always paints the same picture.
 */
 Image pointilism( const Image in , unsigned int seed );
 
+/* _______pointilism_in_place________
+* pointilism painted over the input instead of a new black image (the
+* dots take their colors first, then the image is cleared), giving the
+* same picture. Returns in; if memory runs out the result has NULL data
+* and in is left alone.
+*/
+Image pointilism_in_place( const Image in , unsigned int seed );
+
 //______blur______
 /* apply a blurring filter to the image
+* (picks the engine like BLUR_AUTO below)
 */
 Image blur( const Image in , double sigma );
 
+/* engines available to blur_with_mode
+*
+* BLUR_EXACT  separable version of the createMatrix gaussian (matches it
+*             within 1 level), cost grows with sigma (about 20 * sigma taps
+*             per pixel)
+* BLUR_BOX    three running-sum box filters, constant cost per pixel
+* BLUR_IIR    Young-van Vliet recursive gaussian, constant cost per pixel.
+*             The image is extended with its border color instead of
+*             renormalized at the edges
+* BLUR_AUTO   BLUR_EXACT below BLUR_AUTO_SIGMA, BLUR_BOX from there on
+*
+* Difference from BLUR_EXACT in levels out of 255 ("edge" is within
+* 3 * sigma of the border). The max is the worst seen over uniform noise
+* (64x48 to 2000x1500, 10 seeds each) and black and white checkerboards
+* (squares of 1 to 32 pixels); the mean is for 2000x1500 noise. Smooth
+* photos stay within 1 level inside and 4 at the edges:
+*
+*            sigma    interior max/mean    edge max/mean
+*   box        4          3 / 0.20            8 / 0.43
+*   box        8          4 / 0.11           10 / 0.22
+*   box       30          1 / 0.03           14 / 0.06
+*   iir        4          5 / 0.25           41 / 1.47
+*   iir        8          7 / 0.09           38 / 1.04
+*   iir       30          1 / 0.01           40 / 0.50
+*
+* Below sigma 4 both approximations get visibly worse (box up to 9 levels
+* at the edges at sigma 3, 11 at sigma 2 and 44 anywhere at sigma 1),
+* which is why BLUR_AUTO keeps the exact filter there.
+*/
+typedef enum {
+  BLUR_AUTO,
+  BLUR_EXACT,
+  BLUR_BOX,
+  BLUR_IIR
+} BlurMode;
+
+#define BLUR_AUTO_SIGMA 4.0
+
+//______blur_with_mode______
+/* apply a blurring filter to the image with the chosen engine
+*/
+Image blur_with_mode( const Image in , double sigma , BlurMode mode );
+
+//______blur_engine______
+/* the engine blur_with_mode runs for sigma and mode: BLUR_AUTO resolved
+* to BLUR_EXACT or BLUR_BOX, the others as given. Callers that can only
+* use blur_in_place or blur_band check it first, so they never give other
+* pixels than a plain blur would.
+*/
+BlurMode blur_engine( double sigma , BlurMode mode );
+
+//______blur_in_place______
+/* blur with the BLUR_EXACT engine (the only one whose rows depend on
+* nearby rows alone) without a second image: a band of rows at a time is
+* blurred back into a packed image. Each row is blurred across once, into
+* a window of float rows that keeps the blur_halo rows above the band
+* after their pixels are overwritten, so the only scratch is that window,
+* 12 bytes per pixel of max(BLUR_BAND_ROWS, 2 * halo) + 2 * halo rows.
+* The pixels come out the same as blur_with_mode(in, sigma, BLUR_EXACT);
+* other layouts are blurred into a new image by it. Returns in, or a
+* result with NULL data if memory runs out (in isn't freed, but if that
+* happens part way through some of its rows are already blurred).
+*/
+Image blur_in_place( const Image in , double sigma );
+
+/* fewest rows blur_in_place blurs at a time, so the passes have enough
+* rows to spread over the threads */
+#define BLUR_BAND_ROWS 64
+
+//______blur_band______
+/* blur (with the BLUR_EXACT engine) the rows out_row to
+* out_row + out.rows - 1 of an image that is rows tall, writing them to out.
+* window holds the image rows starting at window_row and must include the
+* blur_halo(sigma) rows above and below the output rows (clipped to the
+* image). Returns 0, or -1 if the window is too small or memory runs out.
+*/
+int blur_band( const Image window , int window_row , int rows , double sigma , Image out , int out_row );
+
+//______blur_halo______
+/* number of rows above and below each output row that blur_band needs
+*/
+int blur_halo( double sigma );
+
 //______saturate______
 /* Saturate the image by scaling the deviation from gray
 */
 Image saturate( const Image in , double scale );
 
+//______resize______
+/* scale the image to rows x cols: first average blocks of
+* resize_factors pixels (area averaging, for large reductions), then
+* resample what is left of the scale (less than 2x when shrinking, or any
+* enlargement) with a separable lanczos3 filter. Frees in and returns a
+* new image, or returns in when the size doesn't change. On failure the
+* result has NULL data and in is left alone.
+*/
+Image resize( const Image in , int rows , int cols );
+
+/* largest block side resize averages over in one go */
+#define RESIZE_MAX_BOX 4096
+
+//______resize_factors______
+/* the block height ky and width kx resize averages over when scaling an
+* in_rows x in_cols image to rows x cols (1 when that side shrinks by less
+* than 2), so a reader can shrink the rows as they arrive instead
+*/
+void resize_factors( int in_rows , int in_cols , int rows , int cols , int *ky , int *kx );
+
+//______shrink_band______
+/* average the ky x kx blocks of band (leftover rows and columns are
+* dropped, as resize does) into out starting at row out_row, as resize's
+* first step; band and out may have any layouts. Returns 0, or -1 if out
+* is too small or memory runs out.
+*/
+int shrink_band( const Image band , int kx , int ky , Image out , int out_row );
+
+/* a summed-area table (integral image): entry (y, x) holds, for each
+* channel, the sum of the pixels above and to the left of pixel (y, x),
+* so the sum over any rectangle is four lookups. It has rows + 1 rows of
+* cols + 1 entries of 3 sums, the first row and column being 0. The sums
+* are kept modulo 2^32 (or 2^64 when wide), and the difference of four of
+* them is still exact for rectangles of up to AREA_NARROW_MAX pixels.
+*/
+typedef struct {
+  int rows; // of the image
+  int cols;
+  int wide; // unsigned long long sums, else unsigned int
+  void *sums;
+  size_t bytes;
+} AreaTable;
+
+/* most pixels a rectangle summed from a 32-bit table can have */
+#define AREA_NARROW_MAX 16843009 // 2^32 / 255
+
+//______make_area_table______
+/* build the summed-area table of in (any layout), wide enough for sums
+* over rectangles of up to max_area pixels: 32-bit when that is at most
+* AREA_NARROW_MAX, which always holds for images that small. Each thread
+* sums a band of rows in a single pass over its part of the table, and
+* the bands below the first then get the sums above them added in.
+* Returns 0, or -1 if memory runs out.
+*/
+int make_area_table( const Image in , long long max_area , AreaTable *table );
+
+//______area_sum______
+/* the sums of each channel over rows y0 to y1 - 1 and columns x0 to
+* x1 - 1 of the table's image
+*/
+void area_sum( const AreaTable *table , int y0 , int x0 , int y1 , int x1 , unsigned long long sum[3] );
+
+//______free_area_table______
+/* release the sums of a table from make_area_table
+*/
+void free_area_table( AreaTable *table );
+
+//______mean_filter______
+/* replace each pixel by the mean (rounded) of the w x h rectangle around
+* it, the extra row or column of an even size going below or right of it.
+* Near the edges the rectangle is cut to the image and the mean is over
+* what is left. Uses a summed-area table, so every pixel costs four
+* lookups per channel whatever the size. Frees in and returns a new image;
+* on failure the result has NULL data and in is left alone.
+*/
+Image mean_filter( const Image in , int w , int h );
+
+//______box_blur______
+/* mean_filter over the (2 * radius + 1) square centered on each pixel
+*/
+Image box_blur( const Image in , int radius );
+
+/* a convolution kernel for convolve: width x height weights, both odd so
+* the kernel is centered on its pixel */
+typedef struct {
+  int width;
+  int height;
+  const double *weights; // height rows of width
+  double divisor; // the weighted sum is divided by this
+  double offset; // then this is added
+} Kernel;
+
+/* largest width or height of a kernel */
+#define CONVOLVE_MAX 31
+
+//______convolve______
+/* replace each pixel by the weighted sum of the pixels under the kernel
+* (weights[0] lands on the top left one), divided by the divisor, plus the
+* offset, then rounded and clamped to 0-255; the rows and columns beyond
+* the edges repeat the edge pixels. A kernel that is a column times a row
+* (rank 1, e.g. a gaussian or Sobel) is run as a pass along the rows and
+* one down the columns, the others over the whole window, and the 3x3 and
+* 5x5 windows (and the 3 and 5 tap passes) are unrolled. Whole-number
+* weights are summed in ints, exactly and on either path; the others in
+* floats. Frees in and returns a new image; a bad kernel (even or too big
+* a side, or a 0 divisor) or a failed allocation gives NULL data and
+* leaves in alone.
+*/
+Image convolve( const Image in , const Kernel *kernel );
+
+/* per-pixel operations that apply_pointwise can fuse into one pass
+*
+* POINT_GRAYSCALE   like grayscale
+* POINT_SATURATE    like saturate, arg is the scale
+* POINT_GAMMA       v = 255 * (v / 255) ^ (1 / arg), so arg > 1 brightens
+* POINT_BRIGHTNESS  v = v + arg
+* POINT_CONTRAST    v = (v - 127.5) * arg + 127.5
+* POINT_LEVELS      stretch arg (black) to arg2 (white) over 0 to 255, then
+*                   apply gamma arg3 like POINT_GAMMA
+* POINT_INVERT      v = 255 - v
+*
+* The ones from POINT_GAMMA on treat every channel on its own and are
+* rounded and clamped to 0-255; apply_pointwise turns each into a table
+* of 256 values per channel, and a run of them into a single table.
+*/
+typedef enum {
+  POINT_GRAYSCALE,
+  POINT_SATURATE,
+  POINT_GAMMA,
+  POINT_BRIGHTNESS,
+  POINT_CONTRAST,
+  POINT_LEVELS,
+  POINT_INVERT
+} PointOpKind;
+
+typedef struct {
+  PointOpKind kind;
+  double arg; // the operation's argument, or the first one for POINT_LEVELS
+  double arg2; // POINT_LEVELS only
+  double arg3;
+} PointOp;
+
+/* pixels processed per chunk by apply_pointwise (12KB, fits in L1) */
+#define POINTWISE_CHUNK 4096
+
+//______apply_pointwise______
+/* apply count per-pixel operations, in order, in a single pass over the
+* image; the result is the same as applying them one after the other
+* (e.g. calling grayscale/saturate). The table operations are composed
+* into one table per run, and a run right before a grayscale is folded
+* into the gray weights (three tables of each channel's share of the
+* gray) and a run right after it into the table the gray goes through, so
+* e.g. gamma : grayscale : contrast is still one lookup per pixel. Works
+* in place like grayscale and saturate.
+*/
+Image apply_pointwise( const Image in , const PointOp *ops , int count );
+
 #endif
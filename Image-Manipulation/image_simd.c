@@ -0,0 +1,1019 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "image_simd.h"
+#include "ppm_io.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+
+/* instruction sets the kernels can use, in increasing order */
+#define SIMD_NONE  0
+#define SIMD_SSSE3 1
+#define SIMD_AVX2  2
+
+/* pixels handled per loop iteration by every kernel (48 bytes) */
+#define BLOCK 16
+
+
+/* Helper function for the kernels
+ * the luma exactly as grayscale/saturate compute it in image_manip.c
+ */
+static unsigned char scalarGray(int r, int g, int b) {
+  return (unsigned char)((0.3 * r) + (g * 0.59) + (b * 0.11));
+}
+
+/* The kernels compute luma in integers instead: with t = 30r + 59g + 11b,
+ * t / 100 is the same as scalarGray except when t is a multiple of 100
+ * ("tie" pixels), where the rounding of 0.3, 0.59 and 0.11 sometimes leaves
+ * the double sum just below the integer and scalarGray is one less (35206
+ * of the 16.7M colors). For a given r and g only b = b0, b0 + 100 and
+ * b0 + 200 give ties, so bit b / 100 of tie_drop[(r << 8) | g] records
+ * whether to subtract one. The 3 spare bytes keep 4-byte gathers in bounds.
+ */
+static unsigned char tie_drop[65536 + 3];
+
+/* Helper function for the kernels
+ * fill in tie_drop by checking every tie color against scalarGray
+ */
+static void buildTieTable(void) {
+  for (int r = 0; r < 256; r++) {
+    for (int g = 0; g < 256; g++) {
+      //11 * 91 = 1001, so 91 undoes the 11 mod 100
+      int b0 = ((100 - (30 * r + 59 * g) % 100) % 100 * 91) % 100;
+      unsigned char bits = 0;
+      for (int b = b0; b < 256; b += 100) {
+	if (scalarGray(r, g, b) != (30 * r + 59 * g + 11 * b) / 100) {
+	  bits |= 1 << (b / 100);
+	}
+      }
+      tie_drop[(r << 8) | g] = bits;
+    }
+  }
+}
+
+/* instruction set picked by detectLevel, set once for all threads */
+static int level = SIMD_NONE;
+static pthread_once_t level_once = PTHREAD_ONCE_INIT;
+
+/* Helper function for the kernels
+ * find the widest instruction set available, capped by IMG_SIMD if it is set
+ */
+static void detectLevel(void) {
+  int best = SIMD_NONE;
+#ifdef HAVE_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    best = SIMD_AVX2;
+  }
+  else if (__builtin_cpu_supports("ssse3")) {
+    best = SIMD_SSSE3;
+  }
+#endif
+  const char *cap = getenv("IMG_SIMD");
+  if (cap != NULL && strcmp(cap, "none") == 0) {
+    best = SIMD_NONE;
+  }
+  else if (cap != NULL && strcmp(cap, "ssse3") == 0 && best > SIMD_SSSE3) {
+    best = SIMD_SSSE3;
+  }
+  if (best != SIMD_NONE) {
+    buildTieTable();
+  }
+  level = best;
+}
+
+/* Helper function for the kernels
+ * the instruction set to use; safe to call from several threads at once
+ */
+static int simdLevel(void) {
+  pthread_once(&level_once, detectLevel);
+  return level;
+}
+
+/* Helper function for the kernels
+ * correct the gray of every tie pixel (set bit of ties) in gray, given the
+ * pixels' channels
+ */
+static void fixTies(unsigned char gray[BLOCK], const unsigned char ch[3][BLOCK], int ties) {
+  for (int i = 0; i < BLOCK; i++) {
+    if (ties & (1 << i)) {
+      gray[i] -= (tie_drop[(ch[0][i] << 8) | ch[1][i]] >> (ch[2][i] / 100)) & 1;
+    }
+  }
+}
+
+/* blend weights are fixed point with BLEND_SHIFT fraction bits, so that
+ * pmaddwd can form a * w + b * (1 - w) from two 16-bit samples at once */
+#define BLEND_SHIFT 15
+#define BLEND_ONE (1 << BLEND_SHIFT)
+
+/* Helper function for the blend kernels
+ * the scalar blend from image_manip.c
+ */
+static unsigned char scalarBlend(int a, int b, double alpha) {
+  return (unsigned char)((a * alpha) + (b * (1 - alpha)));
+}
+
+/* Helper function for the blend kernels
+ * the fixed-point weight of alpha, and the margin: with w rounded from
+ * alpha the sum is off by at most 255 * 2^-16, i.e. 127.5 units of
+ * 2^-15, so a lane whose fraction is within 128 units of a whole number
+ * may truncate differently from the double formula and is redone in
+ * scalar. If w is alpha exactly, both are exact and nothing is redone.
+ * Returns 0 when alpha can't be done in fixed point.
+ */
+static int blendWeight(double alpha, int *margin) {
+  if (!(alpha > 0 && alpha < 1)) {
+    return 0;
+  }
+  int w = (int)(alpha * BLEND_ONE + 0.5);
+  if (w < 1 || w > BLEND_ONE - 1) {
+    return 0;
+  }
+  *margin = alpha == (double)w / BLEND_ONE ? 0 : 128;
+  return w;
+}
+
+/* Helper function for the blend kernels
+ * redo the lanes flagged in unsure with the scalar formula
+ */
+static void fixBlend(unsigned char *out, const unsigned char *a, const unsigned char *b, unsigned int unsure, double alpha) {
+  for (int j = 0; unsure != 0; j++, unsure >>= 1) {
+    if (unsure & 1) {
+      out[j] = scalarBlend(a[j], b[j], alpha);
+    }
+  }
+}
+
+
+#ifdef HAVE_X86_SIMD
+
+/* pshufb masks gathering channel c of 16 pixels from the k-th 16 bytes */
+static const signed char deinterleave_mask[3][3][16] = {
+  { { 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+    { -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1 },
+    { -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13 } },
+  { { 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+    { -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1 },
+    { -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14 } },
+  { { 2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+    { -1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1 },
+    { -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15 } }
+};
+
+/* pshufb masks scattering channel c of 16 pixels into the k-th 16 bytes */
+static const signed char interleave_mask[3][3][16] = {
+  { { 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, 5 },
+    { -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10, -1 },
+    { -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1 } },
+  { { -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1 },
+    { 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10 },
+    { -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1 } },
+  { { -1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1 },
+    { -1, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1 },
+    { 10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15 } }
+};
+
+/* Helper function for the kernels
+ * split 16 packed pixels into one register of 16 bytes per channel
+ */
+__attribute__((target("ssse3")))
+static inline void deinterleave(const Pixel *pix, __m128i ch[3]) {
+  const __m128i *src = (const __m128i *)pix;
+  __m128i v[3] = { _mm_loadu_si128(src), _mm_loadu_si128(src + 1), _mm_loadu_si128(src + 2) };
+  for (int c = 0; c < 3; c++) {
+    __m128i out = _mm_setzero_si128();
+    for (int k = 0; k < 3; k++) {
+      __m128i mask = _mm_loadu_si128((const __m128i *)deinterleave_mask[c][k]);
+      out = _mm_or_si128(out, _mm_shuffle_epi8(v[k], mask));
+    }
+    ch[c] = out;
+  }
+}
+
+/* Helper function for the kernels
+ * the inverse of deinterleave
+ */
+__attribute__((target("ssse3")))
+static inline void interleave(Pixel *pix, const __m128i ch[3]) {
+  __m128i *dst = (__m128i *)pix;
+  for (int k = 0; k < 3; k++) {
+    __m128i out = _mm_setzero_si128();
+    for (int c = 0; c < 3; c++) {
+      __m128i mask = _mm_loadu_si128((const __m128i *)interleave_mask[c][k]);
+      out = _mm_or_si128(out, _mm_shuffle_epi8(ch[c], mask));
+    }
+    _mm_storeu_si128(dst + k, out);
+  }
+}
+
+/* pshufb mask grouping 4 RGBX pixels as rrrr gggg bbbb xxxx */
+static const signed char rgbx_split_mask[16] = { 0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15 };
+
+/* pshufb mask undoing rgbx_split_mask */
+static const signed char rgbx_join_mask[16] = { 0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15 };
+
+/* Helper function for the kernels
+ * transpose a 4x4 matrix of 32-bit lanes
+ */
+__attribute__((target("ssse3")))
+static inline void transpose4(__m128i v[4]) {
+  __m128i a = _mm_unpacklo_epi32(v[0], v[1]);
+  __m128i b = _mm_unpacklo_epi32(v[2], v[3]);
+  __m128i c = _mm_unpackhi_epi32(v[0], v[1]);
+  __m128i d = _mm_unpackhi_epi32(v[2], v[3]);
+  v[0] = _mm_unpacklo_epi64(a, b);
+  v[1] = _mm_unpackhi_epi64(a, b);
+  v[2] = _mm_unpacklo_epi64(c, d);
+  v[3] = _mm_unpackhi_epi64(c, d);
+}
+
+/* Helper function for the kernels
+ * load 16 pixels starting at pixel i of span, one register per channel.
+ * Packed pixels are shuffled apart, RGBX pixels are grouped by channel and
+ * transposed (keeping the unused bytes in x), planar ones are loaded as is.
+ */
+__attribute__((target("ssse3")))
+static inline void loadBlock(PixelSpan span, size_t i, __m128i ch[3], __m128i *x) {
+  *x = _mm_setzero_si128(); //only RGBX pixels have a fourth byte
+  if (span.step == 1) {
+    for (int c = 0; c < 3; c++) {
+      ch[c] = _mm_loadu_si128((const __m128i *)(span.chan[c] + i));
+    }
+  }
+  else if (span.step == 4) {
+    const __m128i *src = (const __m128i *)(span.chan[0] + 4 * i);
+    __m128i mask = _mm_loadu_si128((const __m128i *)rgbx_split_mask);
+    __m128i v[4];
+    for (int k = 0; k < 4; k++) {
+      v[k] = _mm_shuffle_epi8(_mm_loadu_si128(src + k), mask);
+    }
+    transpose4(v);
+    ch[0] = v[0];
+    ch[1] = v[1];
+    ch[2] = v[2];
+    *x = v[3];
+  }
+  else {
+    deinterleave((const Pixel *)(span.chan[0] + 3 * i), ch);
+  }
+}
+
+/* Helper function for the kernels
+ * the inverse of loadBlock
+ */
+__attribute__((target("ssse3")))
+static inline void storeBlock(PixelSpan span, size_t i, const __m128i ch[3], __m128i x) {
+  if (span.step == 1) {
+    for (int c = 0; c < 3; c++) {
+      _mm_storeu_si128((__m128i *)(span.chan[c] + i), ch[c]);
+    }
+  }
+  else if (span.step == 4) {
+    __m128i *dst = (__m128i *)(span.chan[0] + 4 * i);
+    __m128i mask = _mm_loadu_si128((const __m128i *)rgbx_join_mask);
+    __m128i v[4] = { ch[0], ch[1], ch[2], x };
+    transpose4(v);
+    for (int k = 0; k < 4; k++) {
+      _mm_storeu_si128(dst + k, _mm_shuffle_epi8(v[k], mask));
+    }
+  }
+  else {
+    interleave((Pixel *)(span.chan[0] + 3 * i), ch);
+  }
+}
+
+/* Helper function for the kernels
+ * 8 integer lumas t / 100 from 16-bit channels, flagging the lanes where
+ * t is a multiple of 100 in ties. 41944 / 2^22 is close enough to 1/100
+ * that the multiply-high and shift divide exactly for every t <= 25500.
+ */
+__attribute__((target("ssse3")))
+static inline __m128i luma8(__m128i r, __m128i g, __m128i b, __m128i *ties) {
+  __m128i t = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(30)),
+					  _mm_mullo_epi16(g, _mm_set1_epi16(59))),
+			    _mm_mullo_epi16(b, _mm_set1_epi16(11)));
+  __m128i q = _mm_srli_epi16(_mm_mulhi_epu16(t, _mm_set1_epi16((short)41944)), 6);
+  __m128i rem = _mm_sub_epi16(t, _mm_mullo_epi16(q, _mm_set1_epi16(100)));
+  *ties = _mm_cmpeq_epi16(rem, _mm_setzero_si128());
+  return q;
+}
+
+/* Helper function for the kernels
+ * the gray value of 16 pixels, bit-exact with scalarGray
+ */
+__attribute__((target("ssse3")))
+static inline __m128i gray16Ssse3(const __m128i ch[3]) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i tie_lo, tie_hi;
+  __m128i lo = luma8(_mm_unpacklo_epi8(ch[0], zero), _mm_unpacklo_epi8(ch[1], zero),
+		     _mm_unpacklo_epi8(ch[2], zero), &tie_lo);
+  __m128i hi = luma8(_mm_unpackhi_epi8(ch[0], zero), _mm_unpackhi_epi8(ch[1], zero),
+		     _mm_unpackhi_epi8(ch[2], zero), &tie_hi);
+  __m128i gray = _mm_packus_epi16(lo, hi);
+  int ties = _mm_movemask_epi8(_mm_packs_epi16(tie_lo, tie_hi));
+  if (ties) {
+    unsigned char fixed[BLOCK], chans[3][BLOCK];
+    _mm_storeu_si128((__m128i *)fixed, gray);
+    for (int c = 0; c < 3; c++) {
+      _mm_storeu_si128((__m128i *)chans[c], ch[c]);
+    }
+    fixTies(fixed, (const unsigned char (*)[BLOCK])chans, ties);
+    gray = _mm_loadu_si128((const __m128i *)fixed);
+  }
+  return gray;
+}
+
+/* Helper function for saturate_simd
+ * (diff * scale) + gray for 4 lanes of 32-bit integers, clamped to 0..255
+ * and truncated, the same double arithmetic as saturate()
+ */
+__attribute__((target("ssse3")))
+static inline __m128i scale4Ssse3(__m128i diff, __m128i gray, __m128d scale) {
+  __m128d low = _mm_setzero_pd(), high = _mm_set1_pd(255.0);
+  __m128d v0 = _mm_add_pd(_mm_mul_pd(_mm_cvtepi32_pd(diff), scale), _mm_cvtepi32_pd(gray));
+  __m128d v1 = _mm_add_pd(_mm_mul_pd(_mm_cvtepi32_pd(_mm_shuffle_epi32(diff, 0xEE)), scale),
+			  _mm_cvtepi32_pd(_mm_shuffle_epi32(gray, 0xEE)));
+  v0 = _mm_min_pd(_mm_max_pd(v0, low), high);
+  v1 = _mm_min_pd(_mm_max_pd(v1, low), high);
+  return _mm_unpacklo_epi64(_mm_cvttpd_epi32(v0), _mm_cvttpd_epi32(v1));
+}
+
+/* Helper function for saturate_simd
+ * saturate one channel of 16 pixels against their gray values
+ */
+__attribute__((target("ssse3")))
+static inline __m128i saturate16Ssse3(__m128i ch, __m128i gray, __m128d scale) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i out[2];
+  for (int h = 0; h < 2; h++) {
+    __m128i c16 = h ? _mm_unpackhi_epi8(ch, zero) : _mm_unpacklo_epi8(ch, zero);
+    __m128i g16 = h ? _mm_unpackhi_epi8(gray, zero) : _mm_unpacklo_epi8(gray, zero);
+    __m128i diff = _mm_sub_epi16(c16, g16);
+    __m128i sign = _mm_srai_epi16(diff, 15);
+    __m128i a = scale4Ssse3(_mm_unpacklo_epi16(diff, sign), _mm_unpacklo_epi16(g16, zero), scale);
+    __m128i b = scale4Ssse3(_mm_unpackhi_epi16(diff, sign), _mm_unpackhi_epi16(g16, zero), scale);
+    out[h] = _mm_packs_epi32(a, b);
+  }
+  return _mm_packus_epi16(out[0], out[1]);
+}
+
+__attribute__((target("ssse3")))
+static size_t grayscaleSsse3(PixelSpan span, size_t count) {
+  size_t i = 0;
+  for (; i + BLOCK <= count; i += BLOCK) {
+    __m128i ch[3], x;
+    loadBlock(span, i, ch, &x);
+    __m128i gray = gray16Ssse3(ch);
+    __m128i out[3] = { gray, gray, gray };
+    storeBlock(span, i, out, x);
+  }
+  return i;
+}
+
+__attribute__((target("ssse3")))
+static size_t saturateSsse3(PixelSpan span, size_t count, double scale) {
+  __m128d vscale = _mm_set1_pd(scale);
+  size_t i = 0;
+  for (; i + BLOCK <= count; i += BLOCK) {
+    __m128i ch[3], x;
+    loadBlock(span, i, ch, &x);
+    __m128i gray = gray16Ssse3(ch);
+    __m128i out[3];
+    for (int c = 0; c < 3; c++) {
+      out[c] = saturate16Ssse3(ch[c], gray, vscale);
+    }
+    storeBlock(span, i, out, x);
+  }
+  return i;
+}
+
+/* Helper function for the blend kernels
+ * 4 fixed-point blends from 4 (a, b) pairs of 16-bit samples, flagging
+ * the lanes within margin of a whole number in *near
+ */
+__attribute__((target("ssse3")))
+static inline __m128i blend4Ssse3(__m128i pairs, __m128i weights, __m128i margin, __m128i *near) {
+  __m128i t = _mm_madd_epi16(pairs, weights);
+  __m128i frac = _mm_and_si128(_mm_add_epi32(t, margin), _mm_set1_epi32(BLEND_ONE - 1));
+  *near = _mm_cmplt_epi32(frac, _mm_add_epi32(margin, margin));
+  return _mm_srli_epi32(t, BLEND_SHIFT);
+}
+
+__attribute__((target("ssse3")))
+static size_t blendSsse3(unsigned char *out, const unsigned char *a, const unsigned char *b, size_t n, double alpha, int w, int margin) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i weights = _mm_set1_epi32((BLEND_ONE - w) << 16 | w); // a's weight pairs with the low half
+  __m128i m = _mm_set1_epi32(margin);
+  size_t i = 0;
+  for (; i + BLOCK <= n; i += BLOCK) {
+    __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+    __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+    __m128i a_lo = _mm_unpacklo_epi8(va, zero), a_hi = _mm_unpackhi_epi8(va, zero);
+    __m128i b_lo = _mm_unpacklo_epi8(vb, zero), b_hi = _mm_unpackhi_epi8(vb, zero);
+    __m128i near[4];
+    __m128i q0 = blend4Ssse3(_mm_unpacklo_epi16(a_lo, b_lo), weights, m, &near[0]);
+    __m128i q1 = blend4Ssse3(_mm_unpackhi_epi16(a_lo, b_lo), weights, m, &near[1]);
+    __m128i q2 = blend4Ssse3(_mm_unpacklo_epi16(a_hi, b_hi), weights, m, &near[2]);
+    __m128i q3 = blend4Ssse3(_mm_unpackhi_epi16(a_hi, b_hi), weights, m, &near[3]);
+    __m128i result = _mm_packus_epi16(_mm_packs_epi32(q0, q1), _mm_packs_epi32(q2, q3));
+    unsigned int unsure = (unsigned int)_mm_movemask_epi8(_mm_packs_epi16(_mm_packs_epi32(near[0], near[1]), _mm_packs_epi32(near[2], near[3])));
+    if (unsure == 0) {
+      _mm_storeu_si128((__m128i *)(out + i), result);
+    }
+    else { //out may be a or b, so fix before storing
+      unsigned char block[BLOCK];
+      _mm_storeu_si128((__m128i *)block, result);
+      fixBlend(block, a + i, b + i, unsure, alpha);
+      memcpy(out + i, block, BLOCK);
+    }
+  }
+  return i;
+}
+
+/* Helper function for the kernels
+ * the AVX2 version of gray16Ssse3, working on all 16 lanes at once and
+ * looking the tie corrections up with gathers instead of a scalar loop
+ */
+__attribute__((target("avx2")))
+static inline __m128i gray16Avx2(const __m128i ch[3], __m256i *gray16) {
+  __m256i r = _mm256_cvtepu8_epi16(ch[0]);
+  __m256i g = _mm256_cvtepu8_epi16(ch[1]);
+  __m256i b = _mm256_cvtepu8_epi16(ch[2]);
+  __m256i t = _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(r, _mm256_set1_epi16(30)),
+						_mm256_mullo_epi16(g, _mm256_set1_epi16(59))),
+			       _mm256_mullo_epi16(b, _mm256_set1_epi16(11)));
+  __m256i q = _mm256_srli_epi16(_mm256_mulhi_epu16(t, _mm256_set1_epi16((short)41944)), 6);
+  __m256i rem = _mm256_sub_epi16(t, _mm256_mullo_epi16(q, _mm256_set1_epi16(100)));
+  __m256i tie = _mm256_cmpeq_epi16(rem, _mm256_setzero_si256());
+
+  if (!_mm256_testz_si256(tie, tie)) {
+    //bit b / 100 of tie_drop[(r << 8) | g], for each half of 8 lanes
+    __m256i index = _mm256_or_si256(_mm256_slli_epi16(r, 8), g);
+    __m256i bit = _mm256_sub_epi16(_mm256_setzero_si256(),
+				   _mm256_add_epi16(_mm256_cmpgt_epi16(b, _mm256_set1_epi16(99)),
+						    _mm256_cmpgt_epi16(b, _mm256_set1_epi16(199))));
+    __m256i drop[2];
+    for (int h = 0; h < 2; h++) {
+      __m128i index8 = h ? _mm256_extracti128_si256(index, 1) : _mm256_castsi256_si128(index);
+      __m128i bit8 = h ? _mm256_extracti128_si256(bit, 1) : _mm256_castsi256_si128(bit);
+      __m256i entry = _mm256_i32gather_epi32((const int *)tie_drop, _mm256_cvtepu16_epi32(index8), 1);
+      drop[h] = _mm256_and_si256(_mm256_srlv_epi32(entry, _mm256_cvtepu16_epi32(bit8)), _mm256_set1_epi32(1));
+    }
+    //packus interleaves the 128-bit halves, the permute puts them back in order
+    __m256i drop16 = _mm256_permute4x64_epi64(_mm256_packus_epi32(drop[0], drop[1]), 0xD8);
+    q = _mm256_sub_epi16(q, _mm256_and_si256(drop16, tie));
+  }
+
+  *gray16 = q;
+  return _mm_packus_epi16(_mm256_castsi256_si128(q), _mm256_extracti128_si256(q, 1));
+}
+
+/* Helper function for saturate_simd
+ * the AVX2 version of scale4Ssse3, for 4 lanes of 32-bit integers
+ */
+__attribute__((target("avx2")))
+static inline __m128i scale4Avx2(__m128i diff, __m128i gray, __m256d scale) {
+  __m256d v = _mm256_add_pd(_mm256_mul_pd(_mm256_cvtepi32_pd(diff), scale), _mm256_cvtepi32_pd(gray));
+  v = _mm256_min_pd(_mm256_max_pd(v, _mm256_setzero_pd()), _mm256_set1_pd(255.0));
+  return _mm256_cvttpd_epi32(v);
+}
+
+/* Helper function for saturate_simd
+ * the AVX2 version of saturate16Ssse3
+ */
+__attribute__((target("avx2")))
+static inline __m128i saturate16Avx2(__m128i ch, __m256i gray16, __m256d scale) {
+  __m256i diff = _mm256_sub_epi16(_mm256_cvtepu8_epi16(ch), gray16);
+  __m256i d32[2] = { _mm256_cvtepi16_epi32(_mm256_castsi256_si128(diff)),
+		     _mm256_cvtepi16_epi32(_mm256_extracti128_si256(diff, 1)) };
+  __m256i g32[2] = { _mm256_cvtepi16_epi32(_mm256_castsi256_si128(gray16)),
+		     _mm256_cvtepi16_epi32(_mm256_extracti128_si256(gray16, 1)) };
+  __m128i out[4];
+  for (int h = 0; h < 2; h++) {
+    out[2 * h] = scale4Avx2(_mm256_castsi256_si128(d32[h]), _mm256_castsi256_si128(g32[h]), scale);
+    out[2 * h + 1] = scale4Avx2(_mm256_extracti128_si256(d32[h], 1), _mm256_extracti128_si256(g32[h], 1), scale);
+  }
+  return _mm_packus_epi16(_mm_packs_epi32(out[0], out[1]), _mm_packs_epi32(out[2], out[3]));
+}
+
+__attribute__((target("avx2")))
+static size_t grayscaleAvx2(PixelSpan span, size_t count) {
+  size_t i = 0;
+  for (; i + BLOCK <= count; i += BLOCK) {
+    __m128i ch[3], x;
+    __m256i gray16;
+    loadBlock(span, i, ch, &x);
+    __m128i gray = gray16Avx2(ch, &gray16);
+    __m128i out[3] = { gray, gray, gray };
+    storeBlock(span, i, out, x);
+  }
+  return i;
+}
+
+__attribute__((target("avx2")))
+static size_t saturateAvx2(PixelSpan span, size_t count, double scale) {
+  __m256d vscale = _mm256_set1_pd(scale);
+  size_t i = 0;
+  for (; i + BLOCK <= count; i += BLOCK) {
+    __m128i ch[3], x;
+    __m256i gray16;
+    loadBlock(span, i, ch, &x);
+    gray16Avx2(ch, &gray16);
+    __m128i out[3];
+    for (int c = 0; c < 3; c++) {
+      out[c] = saturate16Avx2(ch[c], gray16, vscale);
+    }
+    storeBlock(span, i, out, x);
+  }
+  return i;
+}
+
+/* Helper function for the blend kernels
+ * blend4Ssse3 on two 128-bit lanes
+ */
+__attribute__((target("avx2")))
+static inline __m256i blend8Avx2(__m256i pairs, __m256i weights, __m256i margin, __m256i *near) {
+  __m256i t = _mm256_madd_epi16(pairs, weights);
+  __m256i frac = _mm256_and_si256(_mm256_add_epi32(t, margin), _mm256_set1_epi32(BLEND_ONE - 1));
+  *near = _mm256_cmpgt_epi32(_mm256_add_epi32(margin, margin), frac);
+  return _mm256_srli_epi32(t, BLEND_SHIFT);
+}
+
+/* the unpacks and packs work within each 128-bit lane, so the bytes come
+ * back out in the order they went in */
+__attribute__((target("avx2")))
+static size_t blendAvx2(unsigned char *out, const unsigned char *a, const unsigned char *b, size_t n, double alpha, int w, int margin) {
+  __m256i zero = _mm256_setzero_si256();
+  __m256i weights = _mm256_set1_epi32((BLEND_ONE - w) << 16 | w);
+  __m256i m = _mm256_set1_epi32(margin);
+  size_t i = 0;
+  for (; i + 2 * BLOCK <= n; i += 2 * BLOCK) {
+    __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+    __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+    __m256i a_lo = _mm256_unpacklo_epi8(va, zero), a_hi = _mm256_unpackhi_epi8(va, zero);
+    __m256i b_lo = _mm256_unpacklo_epi8(vb, zero), b_hi = _mm256_unpackhi_epi8(vb, zero);
+    __m256i near[4];
+    __m256i q0 = blend8Avx2(_mm256_unpacklo_epi16(a_lo, b_lo), weights, m, &near[0]);
+    __m256i q1 = blend8Avx2(_mm256_unpackhi_epi16(a_lo, b_lo), weights, m, &near[1]);
+    __m256i q2 = blend8Avx2(_mm256_unpacklo_epi16(a_hi, b_hi), weights, m, &near[2]);
+    __m256i q3 = blend8Avx2(_mm256_unpackhi_epi16(a_hi, b_hi), weights, m, &near[3]);
+    __m256i result = _mm256_packus_epi16(_mm256_packs_epi32(q0, q1), _mm256_packs_epi32(q2, q3));
+    unsigned int unsure = (unsigned int)_mm256_movemask_epi8(_mm256_packs_epi16(_mm256_packs_epi32(near[0], near[1]), _mm256_packs_epi32(near[2], near[3])));
+    if (unsure == 0) {
+      _mm256_storeu_si256((__m256i *)(out + i), result);
+    }
+    else { //out may be a or b, so fix before storing
+      unsigned char block[2 * BLOCK];
+      _mm256_storeu_si256((__m256i *)block, result);
+      fixBlend(block, a + i, b + i, unsure, alpha);
+      memcpy(out + i, block, 2 * BLOCK);
+    }
+  }
+  return i + blendSsse3(out + i, a + i, b + i, n - i, alpha, w, margin);
+}
+
+/* Helper function for accumulate_simd
+ * add 16 bytes of sums at a time; the lane width only matters for the add
+ */
+__attribute__((target("ssse3")))
+static size_t accumulateSsse3(unsigned char *dst, const unsigned char *src, size_t bytes, int wide) {
+  size_t i = 0;
+  for (; i + 16 <= bytes; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(dst + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(src + i));
+    _mm_storeu_si128((__m128i *)(dst + i), wide ? _mm_add_epi64(a, b) : _mm_add_epi32(a, b));
+  }
+  return i;
+}
+
+/* Helper function for accumulate_simd
+ * add 64 bytes of sums at a time, then 16 with the SSSE3 loop
+ */
+__attribute__((target("avx2")))
+static size_t accumulateAvx2(unsigned char *dst, const unsigned char *src, size_t bytes, int wide) {
+  size_t i = 0;
+  for (; i + 64 <= bytes; i += 64) {
+    __m256i a0 = _mm256_loadu_si256((const __m256i *)(dst + i));
+    __m256i a1 = _mm256_loadu_si256((const __m256i *)(dst + i + 32));
+    __m256i b0 = _mm256_loadu_si256((const __m256i *)(src + i));
+    __m256i b1 = _mm256_loadu_si256((const __m256i *)(src + i + 32));
+    _mm256_storeu_si256((__m256i *)(dst + i), wide ? _mm256_add_epi64(a0, b0) : _mm256_add_epi32(a0, b0));
+    _mm256_storeu_si256((__m256i *)(dst + i + 32), wide ? _mm256_add_epi64(a1, b1) : _mm256_add_epi32(a1, b1));
+  }
+  return i + accumulateSsse3(dst + i, src + i, bytes - i, wide);
+}
+
+/* Helper function for the convolve kernels
+ * the low 32 bits of the products of the lanes, which SSSE3 has no
+ * instruction for: the even and odd lanes are multiplied separately
+ */
+__attribute__((target("ssse3")))
+static inline __m128i mulloSsse3(__m128i a, __m128i b) {
+  __m128i even = _mm_mul_epu32(a, b);
+  __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+  return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+/* Helper function for window_sums_simd
+ * 4 window sums at a time, inlined by windowSsse3 with constant sizes for
+ * the small kernels. The taps are added in the scalar loop's order, so
+ * float sums round the same way.
+ */
+__attribute__((target("ssse3")))
+static inline size_t windowSumsSsse3(void *out, const void *const *lines, const void *weights, int kw, int kh, size_t n, int integer) {
+  size_t x = 0;
+  if (integer) {
+    const int *w = weights;
+    for (; x + 4 <= n; x += 4) {
+      __m128i acc = _mm_setzero_si128();
+      for (int k = 0; k < kh; k++) {
+	const int *l = (const int *)lines[k] + x;
+	for (int j = 0; j < kw; j++) {
+	  acc = _mm_add_epi32(acc, mulloSsse3(_mm_set1_epi32(w[k * kw + j]), _mm_loadu_si128((const __m128i *)(l + 3 * j))));
+	}
+      }
+      _mm_storeu_si128((__m128i *)((int *)out + x), acc);
+    }
+  }
+  else {
+    const float *w = weights;
+    for (; x + 4 <= n; x += 4) {
+      __m128 acc = _mm_setzero_ps();
+      for (int k = 0; k < kh; k++) {
+	const float *l = (const float *)lines[k] + x;
+	for (int j = 0; j < kw; j++) {
+	  acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(w[k * kw + j]), _mm_loadu_ps(l + 3 * j)));
+	}
+      }
+      _mm_storeu_ps((float *)out + x, acc);
+    }
+  }
+  return x;
+}
+
+/* Helper function for window_sums_simd
+ * windowSumsSsse3 with the sizes of the 3x3 and 5x5 kernels (and their 3
+ * and 5 tap passes) known at compile time, so the taps are unrolled
+ */
+__attribute__((target("ssse3")))
+static size_t windowSsse3(void *out, const void *const *lines, const void *weights, int kw, int kh, size_t n, int integer) {
+  if (kw == 3 && kh == 3) {
+    return windowSumsSsse3(out, lines, weights, 3, 3, n, integer);
+  }
+  if (kw == 5 && kh == 5) {
+    return windowSumsSsse3(out, lines, weights, 5, 5, n, integer);
+  }
+  if (kw == 3 && kh == 1) {
+    return windowSumsSsse3(out, lines, weights, 3, 1, n, integer);
+  }
+  if (kw == 1 && kh == 3) {
+    return windowSumsSsse3(out, lines, weights, 1, 3, n, integer);
+  }
+  if (kw == 5 && kh == 1) {
+    return windowSumsSsse3(out, lines, weights, 5, 1, n, integer);
+  }
+  if (kw == 1 && kh == 5) {
+    return windowSumsSsse3(out, lines, weights, 1, 5, n, integer);
+  }
+  return windowSumsSsse3(out, lines, weights, kw, kh, n, integer);
+}
+
+/* Helper function for window_sums_simd
+ * 8 window sums at a time, like windowSumsSsse3
+ */
+__attribute__((target("avx2")))
+static inline size_t windowSumsAvx2(void *out, const void *const *lines, const void *weights, int kw, int kh, size_t n, int integer) {
+  size_t x = 0;
+  if (integer) {
+    const int *w = weights;
+    for (; x + 8 <= n; x += 8) {
+      __m256i acc = _mm256_setzero_si256();
+      for (int k = 0; k < kh; k++) {
+	const int *l = (const int *)lines[k] + x;
+	for (int j = 0; j < kw; j++) {
+	  acc = _mm256_add_epi32(acc, _mm256_mullo_epi32(_mm256_set1_epi32(w[k * kw + j]), _mm256_loadu_si256((const __m256i *)(l + 3 * j))));
+	}
+      }
+      _mm256_storeu_si256((__m256i *)((int *)out + x), acc);
+    }
+  }
+  else {
+    const float *w = weights;
+    for (; x + 8 <= n; x += 8) {
+      __m256 acc = _mm256_setzero_ps();
+      for (int k = 0; k < kh; k++) {
+	const float *l = (const float *)lines[k] + x;
+	for (int j = 0; j < kw; j++) {
+	  acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_set1_ps(w[k * kw + j]), _mm256_loadu_ps(l + 3 * j)));
+	}
+      }
+      _mm256_storeu_ps((float *)out + x, acc);
+    }
+  }
+  return x;
+}
+
+/* Helper function for window_sums_simd
+ * windowSumsAvx2 with constant sizes like windowSsse3, then the rest 4
+ * at a time
+ */
+__attribute__((target("avx2")))
+static size_t windowAvx2(void *out, const void *const *lines, const void *weights, int kw, int kh, size_t n, int integer) {
+  size_t x;
+  if (kw == 3 && kh == 3) {
+    x = windowSumsAvx2(out, lines, weights, 3, 3, n, integer);
+  }
+  else if (kw == 5 && kh == 5) {
+    x = windowSumsAvx2(out, lines, weights, 5, 5, n, integer);
+  }
+  else if (kw == 3 && kh == 1) {
+    x = windowSumsAvx2(out, lines, weights, 3, 1, n, integer);
+  }
+  else if (kw == 1 && kh == 3) {
+    x = windowSumsAvx2(out, lines, weights, 1, 3, n, integer);
+  }
+  else if (kw == 5 && kh == 1) {
+    x = windowSumsAvx2(out, lines, weights, 5, 1, n, integer);
+  }
+  else if (kw == 1 && kh == 5) {
+    x = windowSumsAvx2(out, lines, weights, 1, 5, n, integer);
+  }
+  else {
+    x = windowSumsAvx2(out, lines, weights, kw, kh, n, integer);
+  }
+  if (n - x >= 4) { //the lines are read through offset copies of their pointers
+    const void *rest[WINDOW_MAX_LINES];
+    size_t size = integer ? sizeof(int) : sizeof(float);
+    for (int k = 0; k < kh; k++) {
+      rest[k] = (const unsigned char *)lines[k] + x * size;
+    }
+    x += windowSsse3((unsigned char *)out + x * size, rest, weights, kw, kh, n - x, integer);
+  }
+  return x;
+}
+
+/* Helper function for widen_simd
+ * 8 bytes at a time into ints or floats
+ */
+__attribute__((target("ssse3")))
+static size_t widenSsse3(void *dst, const unsigned char *src, size_t n, int integer) {
+  size_t x = 0;
+  __m128i zero = _mm_setzero_si128();
+  for (; x + 8 <= n; x += 8) {
+    __m128i words = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(src + x)), zero);
+    __m128i lo = _mm_unpacklo_epi16(words, zero);
+    __m128i hi = _mm_unpackhi_epi16(words, zero);
+    if (integer) {
+      _mm_storeu_si128((__m128i *)((int *)dst + x), lo);
+      _mm_storeu_si128((__m128i *)((int *)dst + x + 4), hi);
+    }
+    else {
+      _mm_storeu_ps((float *)dst + x, _mm_cvtepi32_ps(lo));
+      _mm_storeu_ps((float *)dst + x + 4, _mm_cvtepi32_ps(hi));
+    }
+  }
+  return x;
+}
+
+/* Helper function for widen_simd
+ * 16 bytes at a time, then 8 with the SSSE3 loop
+ */
+__attribute__((target("avx2")))
+static size_t widenAvx2(void *dst, const unsigned char *src, size_t n, int integer) {
+  size_t x = 0;
+  for (; x + 16 <= n; x += 16) {
+    __m256i lo = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src + x)));
+    __m256i hi = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src + x + 8)));
+    if (integer) {
+      _mm256_storeu_si256((__m256i *)((int *)dst + x), lo);
+      _mm256_storeu_si256((__m256i *)((int *)dst + x + 8), hi);
+    }
+    else {
+      _mm256_storeu_ps((float *)dst + x, _mm256_cvtepi32_ps(lo));
+      _mm256_storeu_ps((float *)dst + x + 8, _mm256_cvtepi32_ps(hi));
+    }
+  }
+  size_t size = integer ? sizeof(int) : sizeof(float);
+  return x + widenSsse3((unsigned char *)dst + x * size, src + x, n - x, integer);
+}
+
+/* Helper function for store_sums_simd
+ * 4 sums (as doubles, 2 at a time) into 4 bytes: times scale plus
+ * offset, clamped to 0-255 and rounded half up
+ */
+__attribute__((target("ssse3")))
+static inline __m128i roundSumsSsse3(__m128i sums, __m128 fsums, int integer, __m128d scale, __m128d offset) {
+  __m128d lo = integer ? _mm_cvtepi32_pd(sums) : _mm_cvtps_pd(fsums);
+  __m128d hi = integer ? _mm_cvtepi32_pd(_mm_srli_si128(sums, 8)) : _mm_cvtps_pd(_mm_movehl_ps(fsums, fsums));
+  __m128d zero = _mm_setzero_pd(), top = _mm_set1_pd(255.0), half = _mm_set1_pd(0.5);
+  lo = _mm_add_pd(_mm_min_pd(_mm_max_pd(_mm_add_pd(_mm_mul_pd(lo, scale), offset), zero), top), half);
+  hi = _mm_add_pd(_mm_min_pd(_mm_max_pd(_mm_add_pd(_mm_mul_pd(hi, scale), offset), zero), top), half);
+  return _mm_unpacklo_epi64(_mm_cvttpd_epi32(lo), _mm_cvttpd_epi32(hi));
+}
+
+/* Helper function for store_sums_simd
+ * 8 sums at a time
+ */
+__attribute__((target("ssse3")))
+static size_t storeSumsSsse3(unsigned char *dst, const void *sums, size_t n, double scale, double offset, int integer) {
+  __m128d vscale = _mm_set1_pd(scale), voffset = _mm_set1_pd(offset);
+  size_t x = 0;
+  for (; x + 8 <= n; x += 8) {
+    __m128i a, b;
+    if (integer) {
+      a = roundSumsSsse3(_mm_loadu_si128((const __m128i *)((const int *)sums + x)), _mm_setzero_ps(), 1, vscale, voffset);
+      b = roundSumsSsse3(_mm_loadu_si128((const __m128i *)((const int *)sums + x + 4)), _mm_setzero_ps(), 1, vscale, voffset);
+    }
+    else {
+      a = roundSumsSsse3(_mm_setzero_si128(), _mm_loadu_ps((const float *)sums + x), 0, vscale, voffset);
+      b = roundSumsSsse3(_mm_setzero_si128(), _mm_loadu_ps((const float *)sums + x + 4), 0, vscale, voffset);
+    }
+    __m128i words = _mm_packs_epi32(a, b);
+    _mm_storel_epi64((__m128i *)(dst + x), _mm_packus_epi16(words, words));
+  }
+  return x;
+}
+
+/* Helper function for store_sums_simd
+ * 8 sums at a time, 4 doubles per step
+ */
+__attribute__((target("avx2")))
+static size_t storeSumsAvx2(unsigned char *dst, const void *sums, size_t n, double scale, double offset, int integer) {
+  __m256d vscale = _mm256_set1_pd(scale), voffset = _mm256_set1_pd(offset);
+  __m256d zero = _mm256_setzero_pd(), top = _mm256_set1_pd(255.0), half = _mm256_set1_pd(0.5);
+  size_t x = 0;
+  for (; x + 8 <= n; x += 8) {
+    __m128i part[2];
+    for (int i = 0; i < 2; i++) {
+      __m256d v = integer ? _mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i *)((const int *)sums + x + 4 * i)))
+	: _mm256_cvtps_pd(_mm_loadu_ps((const float *)sums + x + 4 * i));
+      v = _mm256_add_pd(_mm256_min_pd(_mm256_max_pd(_mm256_add_pd(_mm256_mul_pd(v, vscale), voffset), zero), top), half);
+      part[i] = _mm256_cvttpd_epi32(v);
+    }
+    __m128i words = _mm_packs_epi32(part[0], part[1]);
+    _mm_storel_epi64((__m128i *)(dst + x), _mm_packus_epi16(words, words));
+  }
+  return x;
+}
+
+#endif
+
+
+//______grayscale_simd______
+/* gray pixels in place like grayscale(); returns the number done
+ */
+size_t grayscale_simd( PixelSpan span , size_t count ) {
+#ifdef HAVE_X86_SIMD
+  switch (simdLevel()) {
+  case SIMD_AVX2:
+    return grayscaleAvx2(span, count);
+  case SIMD_SSSE3:
+    return grayscaleSsse3(span, count);
+  }
+#else
+  (void)span;
+  (void)count;
+  (void)fixTies;
+  (void)simdLevel;
+#endif
+  return 0;
+}
+
+//______saturate_simd______
+/* saturate pixels in place like saturate(); returns the number done
+ */
+size_t saturate_simd( PixelSpan span , size_t count , double scale ) {
+#ifdef HAVE_X86_SIMD
+  switch (simdLevel()) {
+  case SIMD_AVX2:
+    return saturateAvx2(span, count, scale);
+  case SIMD_SSSE3:
+    return saturateSsse3(span, count, scale);
+  }
+#else
+  (void)span;
+  (void)count;
+  (void)scale;
+#endif
+  return 0;
+}
+
+//______blend_simd______
+/* blend n bytes like blend(); returns the number done
+ */
+size_t blend_simd( unsigned char *out , const unsigned char *a , const unsigned char *b , size_t n , double alpha ) {
+  int margin;
+  int w = blendWeight(alpha, &margin);
+#ifdef HAVE_X86_SIMD
+  if (w != 0) {
+    switch (simdLevel()) {
+    case SIMD_AVX2:
+      return blendAvx2(out, a, b, n, alpha, w, margin);
+    case SIMD_SSSE3:
+      return blendSsse3(out, a, b, n, alpha, w, margin);
+    }
+  }
+#else
+  (void)out;
+  (void)a;
+  (void)b;
+  (void)n;
+  (void)w;
+  (void)fixBlend;
+#endif
+  return 0;
+}
+
+//______accumulate_simd______
+/* add n sums of src to dst; returns the number done
+ */
+size_t accumulate_simd( void *dst , const void *src , size_t n , int wide ) {
+  size_t size = wide ? sizeof(unsigned long long) : sizeof(unsigned int);
+#ifdef HAVE_X86_SIMD
+  switch (simdLevel()) {
+  case SIMD_AVX2:
+    return accumulateAvx2(dst, src, n * size, wide) / size;
+  case SIMD_SSSE3:
+    return accumulateSsse3(dst, src, n * size, wide) / size;
+  }
+#else
+  (void)dst;
+  (void)src;
+  (void)n;
+  (void)size;
+#endif
+  return 0;
+}
+
+//______window_sums_simd______
+/* the sums of a convolve window; returns the number done
+ */
+size_t window_sums_simd( void *out , const void *const *lines , const void *weights , int kw , int kh , size_t n , int integer ) {
+#ifdef HAVE_X86_SIMD
+  if (kh <= WINDOW_MAX_LINES) {
+    switch (simdLevel()) {
+    case SIMD_AVX2:
+      return windowAvx2(out, lines, weights, kw, kh, n, integer);
+    case SIMD_SSSE3:
+      return windowSsse3(out, lines, weights, kw, kh, n, integer);
+    }
+  }
+#else
+  (void)out;
+  (void)lines;
+  (void)weights;
+  (void)kw;
+  (void)kh;
+  (void)n;
+  (void)integer;
+#endif
+  return 0;
+}
+
+//______widen_simd______
+/* bytes into ints or floats; returns the number done
+ */
+size_t widen_simd( void *dst , const unsigned char *src , size_t n , int integer ) {
+#ifdef HAVE_X86_SIMD
+  switch (simdLevel()) {
+  case SIMD_AVX2:
+    return widenAvx2(dst, src, n, integer);
+  case SIMD_SSSE3:
+    return widenSsse3(dst, src, n, integer);
+  }
+#else
+  (void)dst;
+  (void)src;
+  (void)n;
+  (void)integer;
+#endif
+  return 0;
+}
+
+//______store_sums_simd______
+/* scaled, rounded and clamped sums into bytes; returns the number done
+ */
+size_t store_sums_simd( unsigned char *dst , const void *sums , size_t n , double scale , double offset , int integer ) {
+#ifdef HAVE_X86_SIMD
+  switch (simdLevel()) {
+  case SIMD_AVX2:
+    return storeSumsAvx2(dst, sums, n, scale, offset, integer);
+  case SIMD_SSSE3:
+    return storeSumsSsse3(dst, sums, n, scale, offset, integer);
+  }
+#else
+  (void)dst;
+  (void)sums;
+  (void)n;
+  (void)scale;
+  (void)offset;
+  (void)integer;
+#endif
+  return 0;
+}
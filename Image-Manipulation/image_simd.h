@@ -0,0 +1,77 @@
+#ifndef IMAGE_SIMD_H
+#define IMAGE_SIMD_H
+
+#include <stddef.h>
+#include "ppm_io.h"
+
+
+////////////////////////////////////////////
+// Vectorized inner loops for image_manip //
+////////////////////////////////////////////
+
+/* The kernels below pick the widest instruction set the CPU supports
+ * (AVX2, then SSSE3) the first time they are called. Each one processes
+ * as many whole blocks of pixels as it can and returns how many it did;
+ * the caller finishes the remaining pixels with its scalar loop. The
+ * results are bit-for-bit the same as the scalar code in image_manip.c.
+ * They take pixels in any layout: planar channels are loaded straight
+ * into vector registers, RGBX pixels take one shuffle and a transpose per
+ * 4 pixels, and packed pixels three shuffles per channel.
+ *
+ * Setting the environment variable IMG_SIMD to "none", "ssse3" or "avx2"
+ * caps the instruction set used, e.g. to compare against the scalar path.
+ */
+
+//______grayscale_simd______
+/* gray pixels in place like grayscale(); returns the number done
+ */
+size_t grayscale_simd( PixelSpan span , size_t count );
+
+//______saturate_simd______
+/* saturate pixels in place like saturate(); returns the number done
+ */
+size_t saturate_simd( PixelSpan span , size_t count , double scale );
+
+//______blend_simd______
+/* blend n bytes like blend() does each channel: out[i] is a[i] * alpha +
+ * b[i] * (1 - alpha), truncated. The samples are blended in 15-bit fixed
+ * point and the few that land too close to a whole number to be sure are
+ * redone with the double formula. out may be a or b. Returns the number
+ * done (0 for an alpha outside 0 to 1).
+ */
+size_t blend_simd( unsigned char *out , const unsigned char *a , const unsigned char *b , size_t n , double alpha );
+
+//______accumulate_simd______
+/* add n unsigned sums of src to those of dst, wrapping around: 64-bit
+ * sums (unsigned long long) when wide, else 32-bit (unsigned int), as
+ * the columns of a summed-area table are added up. Returns the number
+ * done.
+ */
+size_t accumulate_simd( void *dst , const void *src , size_t n , int wide );
+
+/* most lines window_sums_simd takes */
+#define WINDOW_MAX_LINES 31
+
+//______window_sums_simd______
+/* n weighted window sums for convolve over lines of interleaved r,g,b
+ * samples: out[x] is the sum over k < kh and j < kw of
+ * weights[k * kw + j] * lines[k][x + 3 * j], all ints when integer is set
+ * (wrapping around), else all floats, with the taps added in that order
+ * so float sums round like the plain loop. Returns the number done.
+ */
+size_t window_sums_simd( void *out , const void *const *lines , const void *weights , int kw , int kh , size_t n , int integer );
+
+//______widen_simd______
+/* n bytes of src into ints (integer set) or floats; returns the number
+ * done
+ */
+size_t widen_simd( void *dst , const unsigned char *src , size_t n , int integer );
+
+//______store_sums_simd______
+/* n ints (integer set) or floats of sums into bytes, each as
+ * sum * scale + offset in doubles, clamped to 0-255 and rounded half up
+ * the way convolve stores them. Returns the number done.
+ */
+size_t store_sums_simd( unsigned char *dst , const void *sums , size_t n , double scale , double offset , int integer );
+
+#endif
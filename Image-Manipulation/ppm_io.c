@@ -1,148 +1,1055 @@
 
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS and MADV_HUGEPAGE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <ctype.h>
 #include "ppm_io.h"
+#include "stats.h"
 #include <math.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <unistd.h>
 
 
-/* helper function for read_ppm, takes a filehandle
- * and reads a number, but detects and skips comment lines
- */
-int read_num( FILE *fp ) {
-  assert(fp);
+static void copyRow(PixelSpan dst, PixelSpan src, int count);
+
 
-  int ch;
-  while((ch = fgetc(fp)) == '#') { // # marks a comment line
-    while( ((ch = fgetc(fp)) != '\n') && ch != EOF ) {
-      /* discard characters til end of line */
+/* largest header read_ppm_info accepts; only long comments get near it */
+#define HEADER_MAX 65536
+
+/* helper function for read_ppm_info and map_ppm, reads a number from the
+ * header in buf starting at *pos, skipping whitespace and comment lines
+ * before it. Returns -1 if there is no number there.
+ */
+static int scan_num( const unsigned char *buf , size_t len , size_t *pos ) {
+  while( *pos < len && ( isspace(buf[*pos]) || buf[*pos] == '#' ) ) {
+    if( buf[*pos] == '#' ) { // # marks a comment line
+      while( *pos < len && buf[*pos] != '\n' ) {
+	(*pos)++;
+      }
+    }
+    else {
+      (*pos)++;
     }
   }
-  ungetc(ch, fp); // put back the last thing we found
 
-  int val;
-  if (fscanf(fp, "%d", &val) == 1) { // try to get an int
-    while(isspace(ch = fgetc(fp))) {
-      // drop trailing whitespace
+  if( *pos >= len || !isdigit(buf[*pos]) ) {
+    fprintf(error_stream(), "Error:ppm_io - failed to read number from file\n");
+    return -1;
+  }
+  int val = 0;
+  while( *pos < len && isdigit(buf[*pos]) ) {
+    if( val > 100000000 ) { // far larger than any real dimension
+      return -1;
     }
-    ungetc(ch, fp);
-    return val; // we got a value, so return it
-  } else {
-    fprintf(stderr, "Error:ppm_io - failed to read number from file\n");
+    val = val * 10 + (buf[*pos] - '0');
+    (*pos)++;
+  }
+  return val;
+}
+
+
+/* helper function for read_ppm_info and map_ppm, parses the header at the
+ * start of buf and sets *pos to the first byte of pixel data (exactly one
+ * whitespace character after the maxval). Returns 0, or -1 if it isn't a
+ * header this codec reads.
+ */
+static int parse_header( const unsigned char *buf , size_t len , PpmHeader *header , size_t *pos ) {
+  /* read in tag; fail if not P2, P3, P5 or P6 */
+  if( len < 3 || buf[0] != 'P' || strchr( "2356" , buf[1] ) == NULL || buf[1] == '\0' || !isspace(buf[2]) ) {
+    fprintf( error_stream() , "Error:ppm_io - not a PPM (bad tag)\n" );
+    return -1;
+  }
+  header->format = buf[1] - '0';
+  *pos = 2;
+
+  /* read image dimensions, cols then rows, then colors */
+  header->cols = scan_num( buf , len , pos );
+  header->rows = scan_num( buf , len , pos );
+  header->maxval = scan_num( buf , len , pos );
+  if( header->maxval < 1 || header->maxval > 65535 ){
+    fprintf( error_stream() , "Error:ppm_io - PPM file with colors outside 1 to 65535\n" );
+    return -1;
+  }
+  if( header->cols<=0 || header->rows<=0 ){
+    fprintf( error_stream() , "Error:ppm_io - PPM file with non-positive dimensions\n" );
+    return -1;
+  }
+
+  /* a single whitespace character separates the header from the pixels */
+  if( *pos >= len || !isspace(buf[*pos]) ) {
+    fprintf( error_stream() , "Error:ppm_io - failed to read number from file\n" );
     return -1;
   }
+  (*pos)++;
+  return 0;
 }
 
 
-Image read_ppm( FILE *fp ) {
-  Image im = { NULL , 0 , 0 };
-  
+/* read and parse the header of any format this codec reads */
+int read_ppm_info( FILE *fp , PpmHeader *header ) {
+
   /* confirm that we received a good file handle */
   if( !fp ){
-    fprintf( stderr , "Error:ppm_io - bad file pointer\n" );
-    return im;
+    fprintf( error_stream() , "Error:ppm_io - bad file pointer\n" );
+    return -1;
   }
 
-  int rows=-1 , cols=-1;
+  /* gather the header bytes up to the whitespace after the fourth token
+   * (tag, cols, rows, maxval), so fp is left at the first pixel */
+  unsigned char *buf = malloc( HEADER_MAX );
+  if( buf == NULL ) {
+    return -1;
+  }
+  size_t len = 0;
+  int tokens = 0 , in_token = 0 , comment = 0 , ch = 0;
+  flockfile( fp );
+  while( tokens < 4 && len < HEADER_MAX && ( ch = getc_unlocked( fp ) ) != EOF ) {
+    buf[len++] = (unsigned char)ch;
+    if( comment ) {
+      comment = ch != '\n';
+    }
+    else if( ch == '#' && !in_token ) { // # marks a comment line
+      comment = 1;
+    }
+    else if( isspace(ch) ) {
+      tokens += in_token;
+      in_token = 0;
+    }
+    else {
+      in_token = 1;
+    }
+  }
+  funlockfile( fp );
 
-  /* read in tag; fail if not P6 */
-  char tag[20];
-  tag[19] = '\0';
-  fscanf( fp , "%19s\n" , tag );
-  if( strncmp( tag , "P6" , 20 ) ) {
-    fprintf( stderr , "Error:ppm_io - not a PPM (bad tag)\n" );
-    return im;
+  size_t pos;
+  int rc = tokens == 4 ? parse_header( buf , len , header , &pos ) : -1;
+  if( tokens < 4 ) {
+    fprintf( error_stream() , "Error:ppm_io - not a PPM (bad tag)\n" );
   }
-  /* read image dimensions */
+  free( buf );
+  return rc;
+}
 
-  //read in columns
-  cols = read_num( fp ); // NOTE: cols, then rows (i.e. X size followed by Y size)
-  //read in rows
-  rows = read_num( fp );
 
-  //read in colors; fail if not 255
-  int colors = read_num( fp );
-  if( colors!=255 ){
-    fprintf( stderr , "Error:ppm_io - PPM file with colors different from 255\n" );
-    return im;
+/* Helper function for the readers
+ * the next number of an ASCII (P2/P3) image, or -1 at the end of the file
+ * or on anything that isn't a number; values above 65535 are clamped.
+ * The caller holds the lock on fp.
+ */
+static long readAscii(FILE *fp) {
+  int ch = getc_unlocked(fp);
+  while (ch != EOF && (isspace(ch) || ch == '#')) {
+    if (ch == '#') { //comments may appear between samples too
+      while (ch != EOF && ch != '\n') {
+	ch = getc_unlocked(fp);
+      }
+    }
+    ch = getc_unlocked(fp);
+  }
+  if (ch == EOF || !isdigit(ch)) {
+    return -1;
+  }
+  long val = 0;
+  while (ch != EOF && isdigit(ch)) {
+    if (val <= 65535) {
+      val = val * 10 + (ch - '0');
+    }
+    ch = getc_unlocked(fp);
+  }
+  //the character after a number is whitespace (or the end of the file)
+  return val > 65535 ? 65535 : val;
+}
+
+/* Helper function for the readers
+ * number of samples and raw bytes in one row of the file
+ */
+static size_t rowSamples(const PpmHeader *h) {
+  return (size_t)h->cols * (h->format == 2 || h->format == 5 ? 1 : 3);
+}
+
+/* Helper function for the readers
+ * read one row of samples as they are in the file into samples (ASCII and
+ * 16-bit formats, values above maxval counting as maxval) or raw (8-bit
+ * binary formats, where samples is left alone). Returns 0, or -1 if the
+ * file ends early.
+ */
+static int readSamples(FILE *fp, const PpmHeader *h, unsigned char *raw, unsigned short *samples) {
+  size_t n = rowSamples(h);
+  if (h->format == 2 || h->format == 3) {
+    flockfile(fp);
+    for (size_t i = 0; i < n; i++) {
+      long v = readAscii(fp);
+      if (v < 0) {
+	funlockfile(fp);
+	return -1;
+      }
+      samples[i] = (unsigned short)(v < h->maxval ? v : h->maxval);
+    }
+    funlockfile(fp);
+    return 0;
+  }
+  if (h->maxval <= 255) {
+    return fread(raw, 1, n, fp) == n ? 0 : -1;
+  }
+  //16-bit samples are big-endian
+  if (fread(raw, 2, n, fp) != n) {
+    return -1;
+  }
+  for (size_t i = 0; i < n; i++) {
+    unsigned short v = (unsigned short)(raw[2 * i] << 8 | raw[2 * i + 1]);
+    samples[i] = v < h->maxval ? v : (unsigned short)h->maxval;
+  }
+  return 0;
+}
+
+/* the scratch buffers readSamples needs, and a table taking every sample
+ * value readSamples can give (up to maxval, or any byte) to the output
+ * scale: 0-255 when wide is 0, else 0-65535. A plain 8-bit P6 needs none
+ * of them.
+ */
+struct PpmDecoder {
+  unsigned char *raw;
+  unsigned short *samples;
+  unsigned char *lut8;
+  unsigned short *lut16;
+};
+typedef struct PpmDecoder Decoder;
+
+/* Helper function for the readers
+ * set up d for a file with header h; returns 0, or -1 if out of memory
+ * (d can be stopped either way)
+ */
+static int startDecoder(Decoder *d, const PpmHeader *h, int wide) {
+  d->raw = NULL;
+  d->samples = NULL;
+  d->lut8 = NULL;
+  d->lut16 = NULL;
+  if (!wide && h->format == 6 && h->maxval == 255) {
+    return 0;
+  }
+  size_t n = rowSamples(h);
+  unsigned long maxval = (unsigned long)h->maxval;
+  size_t entries = maxval < 256 ? 256 : maxval + 1; //raw bytes can pass a small maxval
+  d->raw = malloc(2 * n);
+  d->samples = malloc(sizeof(unsigned short) * n);
+  d->lut8 = wide ? NULL : malloc(entries);
+  d->lut16 = wide ? malloc(sizeof(unsigned short) * entries) : NULL;
+  if (d->raw == NULL || d->samples == NULL || (d->lut8 == NULL && d->lut16 == NULL)) {
+    return -1;
+  }
+  //round to nearest, so 16-bit values narrow exactly to v / 257
+  for (unsigned long v = 0; v < entries; v++) {
+    unsigned long s = v < maxval ? v : maxval;
+    if (wide) {
+      d->lut16[v] = (unsigned short)((s * 65535 + maxval / 2) / maxval);
+    }
+    else {
+      d->lut8[v] = (unsigned char)((s * 255 + maxval / 2) / maxval);
+    }
+  }
+  return 0;
+}
+
+static void stopDecoder(Decoder *d) {
+  free(d->raw);
+  free(d->samples);
+  free(d->lut8);
+  free(d->lut16);
+}
+
+/* Helper function for the readers
+ * read one row of any format into 8-bit pixels
+ */
+static int decodeRow8(FILE *fp, const PpmHeader *h, const Decoder *d, Pixel *out) {
+  unsigned char *dst = (unsigned char *)out;
+  int gray = h->format == 2 || h->format == 5;
+  int bytes = h->maxval <= 255 && (h->format == 5 || h->format == 6);
+  if (h->format == 6 && bytes) { //straight into the row, then rescaled
+    if (fread(dst, 3, h->cols, fp) != (size_t)h->cols) {
+      return -1;
+    }
+    for (int i = 0; i < h->cols * 3; i++) {
+      dst[i] = d->lut8[dst[i]];
+    }
+    return 0;
+  }
+  if (readSamples(fp, h, d->raw, d->samples) != 0) {
+    return -1;
+  }
+  size_t n = rowSamples(h);
+  if (gray) {
+    for (size_t i = 0; i < n; i++) {
+      unsigned char v = d->lut8[bytes ? d->raw[i] : d->samples[i]];
+      dst[3 * i] = dst[3 * i + 1] = dst[3 * i + 2] = v;
+    }
+  }
+  else {
+    for (size_t i = 0; i < n; i++) {
+      dst[i] = d->lut8[d->samples[i]];
+    }
+  }
+  return 0;
+}
+
+/* Helper function for the readers
+ * read one row of any format into 16-bit r,g,b samples
+ */
+static int decodeRow16(FILE *fp, const PpmHeader *h, const Decoder *d, unsigned short *dst) {
+  int gray = h->format == 2 || h->format == 5;
+  int bytes = h->maxval <= 255 && (h->format == 5 || h->format == 6);
+  if (readSamples(fp, h, d->raw, d->samples) != 0) {
+    return -1;
+  }
+  size_t n = rowSamples(h);
+  for (size_t i = 0; i < n; i++) {
+    unsigned short v = d->lut16[bytes ? d->raw[i] : d->samples[i]];
+    if (gray) {
+      dst[3 * i] = dst[3 * i + 1] = dst[3 * i + 2] = v;
+    }
+    else {
+      dst[i] = v;
+    }
+  }
+  return 0;
+}
+
+
+PpmDecoder* start_ppm_decoder( const PpmHeader *header ) {
+  PpmDecoder *decoder = malloc( sizeof(PpmDecoder) );
+  if( decoder != NULL && startDecoder( decoder , header , 0 ) != 0 ) {
+    stop_ppm_decoder( decoder );
+    decoder = NULL;
+  }
+  return decoder;
+}
+
+
+void stop_ppm_decoder( PpmDecoder *decoder ) {
+  if( decoder != NULL ) {
+    stopDecoder( decoder );
+    free( decoder );
   }
+}
+
 
-  //confirm that dimensions are positive
-  if( cols<=0 || rows<=0 ){
-    fprintf( stderr , "Error:ppm_io - PPM file with non-positive dimensions\n" );
+/* read the next count rows of any format as 8-bit pixels */
+int read_ppm_pixels( FILE *fp , const PpmHeader *header , PpmDecoder *decoder , Pixel *buf , int count ) {
+  if( header->format == 6 && header->maxval == 255 ) { // nothing to convert
+    return read_ppm_rows( fp , buf , header->cols , count );
+  }
+  Decoder own;
+  int owned = decoder == NULL; //one just for this call
+  if( owned ) {
+    decoder = startDecoder( &own , header , 0 ) == 0 ? &own : NULL;
+  }
+  int got = 0;
+  while( decoder != NULL && got < count && decodeRow8( fp , header , decoder , buf + (size_t)got * header->cols ) == 0 ) {
+    got++;
+  }
+  if( owned ) {
+    stopDecoder( &own );
+  }
+  return got;
+}
+
+
+/* skip the next count rows of any format; binary rows all take the same
+ * number of bytes, so they are seeked past instead of read */
+int skip_ppm_rows( FILE *fp , const PpmHeader *header , int count ) {
+  if( count <= 0 ) {
+    return 0;
+  }
+  if( header->format == 5 || header->format == 6 ) {
+    off_t bytes = (off_t)rowSamples( header ) * ( header->maxval > 255 ? 2 : 1 ) * count;
+    if( fseeko( fp , bytes , SEEK_CUR ) == 0 ) {
+      return 0;
+    }
+  }
+  //ASCII rows are scanned past and unseekable binary ones read into a
+  //scratch row; neither needs the samples decoded
+  size_t n = rowSamples( header );
+  int got = 0;
+  if( header->format == 2 || header->format == 3 ) {
+    flockfile( fp );
+    for( ; got < count; got++ ) {
+      size_t i = 0;
+      while( i < n && readAscii( fp ) >= 0 ) {
+	i++;
+      }
+      if( i < n ) {
+	break;
+      }
+    }
+    funlockfile( fp );
+  }
+  else {
+    size_t bytes = n * ( header->maxval > 255 ? 2 : 1 );
+    unsigned char *row = malloc( bytes );
+    while( row != NULL && got < count && fread( row , 1 , bytes , fp ) == bytes ) {
+      got++;
+    }
+    free( row );
+  }
+  return got == count ? 0 : -1;
+}
+
+
+Image read_ppm( FILE *fp ) {
+  return read_ppm_layout( fp , LAYOUT_PACKED );
+}
+
+
+/* rows read at a time by read_ppm_layout for layouts other than packed */
+#define READ_BAND 64
+
+Image read_ppm_layout( FILE *fp , Layout layout ) {
+  Image im = { NULL , 0 , 0 , NULL , 0 , LAYOUT_PACKED , 0 };
+
+  PpmHeader header;
+  if( read_ppm_info( fp , &header ) != 0 ) {
     return im;
   }
+  int rows = header.rows , cols = header.cols;
 
   /* Allocate the new image */
-  im = make_image( rows , cols );
+  im = make_image_uninit( rows , cols , layout );
   if( !im.data ){
-    fprintf( stderr , "Error:ppm_io - Could not allocate new image\n" );
+    fprintf( error_stream() , "Error:ppm_io - Could not allocate new image\n" );
     return im;
   }
   /* finally, read in Pixels */
 
+  /* 16-bit samples go straight into place */
+  if( layout == LAYOUT_RGB16 ) {
+    Decoder d;
+    int row = 0;
+    if( startDecoder( &d , &header , 1 ) == 0 ) {
+      while( row < rows && decodeRow16( fp , &header , &d , (unsigned short *)( (unsigned char *)im.data + im.stride * row ) ) == 0 ) {
+	row++;
+      }
+    }
+    stopDecoder( &d );
+    if( row < rows ) {
+      fprintf(error_stream(), "Error:ppm_io - failed to read data from file!\n");
+      free_image( &im );
+    }
+    return im;
+  }
+
   /* read in the binary Pixel data */
-  if( fread( im.data , sizeof(Pixel) , im.rows * im.cols , fp ) != (size_t)(im.rows * im.cols) ) {
-    fprintf(stderr, "Error:ppm_io - failed to read data from file!\n");
-    free_image( &im );
+  if( layout == LAYOUT_PACKED ) {
+    if( read_ppm_pixels( fp , &header , NULL , im.data , im.rows ) != im.rows ) {
+      fprintf(error_stream(), "Error:ppm_io - failed to read data from file!\n");
+      free_image( &im );
+      return im;
+    }
     return im;
   }
 
+  /* other layouts: read a band of rows and spread it into place */
+  Pixel *band = malloc( sizeof(Pixel) * cols * READ_BAND );
+  PpmDecoder *decoder = start_ppm_decoder( &header );
+  for( int row = 0; band != NULL && decoder != NULL && row < rows; row += READ_BAND ) {
+    int count = rows - row < READ_BAND ? rows - row : READ_BAND;
+    if( read_ppm_pixels( fp , &header , decoder , band , count ) != count ) {
+      break;
+    }
+    for( int i = 0; i < count; i++ ) {
+      Image packed = { band , 1 , cols , NULL , 0 , LAYOUT_PACKED , sizeof(Pixel) * cols };
+      copyRow( image_row( im , row + i ) , image_row( packed , i ) , cols );
+    }
+    if( row + count == rows ) {
+      free( band );
+      stop_ppm_decoder( decoder );
+      return im;
+    }
+  }
+  fprintf(error_stream(), "Error:ppm_io - failed to read data from file!\n");
+  free( band );
+  stop_ppm_decoder( decoder );
+  free_image( &im );
   //return the image struct pointer
   return im;
 }
 
 
+/* read the next count rows of pixels following the header */
+int read_ppm_rows( FILE *fp , Pixel *buf , int cols , int count ) {
+  size_t got = fread( buf , sizeof(Pixel) * cols , count , fp );
+  return (int)got;
+}
+
+
+Image map_ppm( FILE *fp ) {
+  Image im = { NULL , 0 , 0 , NULL , 0 , LAYOUT_PACKED , 0 };
+
+  /* confirm that we received a good file handle */
+  if( !fp ){
+    fprintf( error_stream() , "Error:ppm_io - bad file pointer\n" );
+    return im;
+  }
+
+  /* only regular files can be mapped; anything else is read normally */
+  struct stat st;
+  if( fstat( fileno( fp ) , &st ) != 0 || !S_ISREG( st.st_mode ) || st.st_size == 0 ) {
+    return read_ppm( fp );
+  }
+  size_t size = (size_t)st.st_size;
+  unsigned char *map = mmap( NULL , size , PROT_READ | PROT_WRITE , MAP_PRIVATE , fileno( fp ) , 0 );
+  if( map == MAP_FAILED ) {
+    return read_ppm( fp );
+  }
+
+  PpmHeader header;
+  size_t pos;
+  if( parse_header( map , size < HEADER_MAX ? size : HEADER_MAX , &header , &pos ) != 0 ) {
+    munmap( map , size );
+    return im;
+  }
+
+  /* only 8-bit P6 pixels can be used where they are; the other formats
+   * are decoded by read_ppm from the start of the file */
+  if( header.format != 6 || header.maxval != 255 ) {
+    munmap( map , size );
+    if( fseek( fp , 0 , SEEK_SET ) != 0 ) {
+      return im;
+    }
+    return read_ppm( fp );
+  }
+
+  int rows = header.rows , cols = header.cols;
+  if( size - pos < sizeof(Pixel) * (size_t)rows * cols ) {
+    fprintf(error_stream(), "Error:ppm_io - failed to read data from file!\n");
+    munmap( map , size );
+    return im;
+  }
+
+  /* the pixels are read front to back by every operation */
+  posix_madvise( map , size , POSIX_MADV_SEQUENTIAL );
+
+  im.data = (Pixel *)( map + pos );
+  im.rows = rows;
+  im.cols = cols;
+  im.map = map;
+  im.map_size = size;
+  im.stride = sizeof(Pixel) * cols;
+  return im;
+}
 
 
 /* Write given image to disk as a PPM; assumes fp is not null */
 int write_ppm(FILE *fp , const Image im ) {
-  //write the tag  into the file as normal ie: P6 col x row and color
-  fprintf(fp, "P6\n%d  %d\n255\n", im.cols, im.rows);
-  fwrite(im.data, sizeof(Pixel), (im.cols) * (im.rows), fp);
-  return im.rows * im.cols;
+  if (im.layout == LAYOUT_RGB16) { //16-bit samples are written big-endian
+    if (fprintf(fp, "P6\n%d  %d\n65535\n", im.cols, im.rows) < 0) {
+      return 0;
+    }
+    unsigned char *row = malloc((size_t)6 * im.cols);
+    if (row == NULL) {
+      return 0;
+    }
+    int i = 0;
+    for (; i < im.rows; i++) {
+      const unsigned short *src = (const unsigned short *)((const unsigned char *)im.data + im.stride * i);
+      for (int j = 0; j < 3 * im.cols; j++) {
+	row[2 * j] = (unsigned char)(src[j] >> 8);
+	row[2 * j + 1] = (unsigned char)src[j];
+      }
+      if (fwrite(row, 6, im.cols, fp) != (size_t)im.cols) {
+	break;
+      }
+    }
+    free(row);
+    return i * im.cols;
+  }
+
+  if (write_ppm_header(fp, im.rows, im.cols) != 0) {
+    return 0;
+  }
+  if (im.layout == LAYOUT_PACKED) {
+    return write_ppm_rows(fp, im.data, im.cols, im.rows) * im.cols;
+  }
+
+  //other layouts are packed a row at a time
+  Pixel *row = malloc(sizeof(Pixel) * im.cols);
+  if (row == NULL) {
+    return 0;
+  }
+  Image packed = { row , 1 , im.cols , NULL , 0 , LAYOUT_PACKED , sizeof(Pixel) * im.cols };
+  int i = 0;
+  for (; i < im.rows; i++) {
+    copyRow(image_row(packed, 0), image_row(im, i), im.cols);
+    if (write_ppm_rows(fp, row, im.cols, 1) != 1) {
+      break;
+    }
+  }
+  free(row);
+  return i * im.cols;
 
   
 }
 
 
-/* allocate a new image of the specified size;
- * doesn't initialize pixel values */
+/* write the PPM header for an image of the given size */
+int write_ppm_header(FILE *fp , int rows , int cols ) {
+  //write the tag  into the file as normal ie: P6 col x row and color
+  return fprintf(fp, "P6\n%d  %d\n255\n", cols, rows) < 0 ? -1 : 0;
+}
+
+
+/* write count rows of pixels after the header */
+int write_ppm_rows(FILE *fp , const Pixel *buf , int cols , int count ) {
+  return (int)fwrite(buf, sizeof(Pixel) * cols, count, fp);
+}
+
+
+/* overwrite a rectangle of an 8-bit P6 file with the pixels of region;
+ * every row of the rectangle is one positional write at its offset in
+ * the file, so nothing else is read or rewritten */
+int patch_ppm(FILE *fp , const Image region , int x , int y ) {
+  assert(region.layout == LAYOUT_PACKED);
+  PpmHeader header;
+  if (fseek(fp, 0, SEEK_SET) != 0 || read_ppm_info(fp, &header) != 0) {
+    return -1;
+  }
+  if (header.format != 6 || header.maxval != 255 || x < 0 || y < 0 ||
+      x + region.cols > header.cols || y + region.rows > header.rows) {
+    return -1;
+  }
+  off_t start = ftello(fp); //first pixel
+  if (start < 0) {
+    return -1;
+  }
+  int fd = fileno(fp);
+  size_t row_bytes = sizeof(Pixel) * region.cols;
+  for (int i = 0; i < region.rows; i++) {
+    const unsigned char *src = image_row(region, i).chan[0];
+    off_t at = start + ((off_t)(y + i) * header.cols + x) * (off_t)sizeof(Pixel);
+    size_t done = 0;
+    while (done < row_bytes) {
+      ssize_t put = pwrite(fd, src + done, row_bytes - done, at + (off_t)done);
+      if (put <= 0) {
+	return -1;
+      }
+      done += (size_t)put;
+    }
+  }
+  return 0;
+}
+
+
+/* The buffer pool behind alloc_buffer. Requests are rounded up to a size
+ * class (8 classes per doubling, so at most 1/8 is wasted) and released
+ * buffers wait on a free list per class, linked through their first bytes,
+ * until a request of the same class takes them back. Classes of at least
+ * LARGE_BUFFER come straight from anonymous mmap: those pages arrive zeroed
+ * by the kernel without being touched, and are asked to be huge pages
+ * (unless IMG_HUGEPAGES=0) to cut TLB misses on big frames. */
+#define SMALLEST_CLASS 4096
+#define CLASS_STEPS 8
+#define POOL_CLASSES 512
+#define LARGE_BUFFER ((size_t)2 << 20)
+static void *pool[POOL_CLASSES]; // free list heads
+static int pooled_count = 0; // buffers on all the free lists
+static int pool_limit = 4; // enough for the stages of one pipeline
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t huge_once = PTHREAD_ONCE_INIT;
+static int huge_pages = 1;
+
+
+/* Helper function for the buffer pool
+ * the class of a request of size bytes, and the bytes buffers of that
+ * class really have
+ */
+static int sizeClass(size_t size, size_t *class_size) {
+  if (size <= SMALLEST_CLASS) {
+    *class_size = SMALLEST_CLASS;
+    return 0;
+  }
+  size_t base = SMALLEST_CLASS;
+  int doublings = 0;
+  while (base * 2 < size) {
+    base *= 2;
+    doublings++;
+  }
+  size_t step = base / CLASS_STEPS;
+  size_t steps = (size - base + step - 1) / step; // 1 to CLASS_STEPS
+  *class_size = base + steps * step;
+  return 1 + doublings * CLASS_STEPS + (int)(steps - 1);
+}
+
+/* Helper function for the buffer pool
+ * the bytes buffers of class c have, the inverse of sizeClass
+ */
+static size_t classBytes(int c) {
+  if (c == 0) {
+    return SMALLEST_CLASS;
+  }
+  size_t base = (size_t)SMALLEST_CLASS << ((c - 1) / CLASS_STEPS);
+  return base + (size_t)((c - 1) % CLASS_STEPS + 1) * (base / CLASS_STEPS);
+}
+
+/* Helper function for the buffer pool
+ * read IMG_HUGEPAGES once
+ */
+static void detectHugePages(void) {
+  const char *env = getenv("IMG_HUGEPAGES");
+  huge_pages = env == NULL || strcmp(env, "0") != 0;
+}
+
+/* Helper function for the buffer pool
+ * get a new buffer of a class from the system; *zeroed says whether it is
+ * known to be all zero
+ */
+static void* newBuffer(size_t class_size, int *zeroed) {
+  if (class_size >= LARGE_BUFFER) {
+    void *buf = mmap(NULL, class_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED) {
+      return NULL;
+    }
+    pthread_once(&huge_once, detectHugePages);
+#ifdef MADV_HUGEPAGE
+    if (huge_pages) {
+      madvise(buf, class_size, MADV_HUGEPAGE); //only a hint, failing is fine
+    }
+#endif
+    *zeroed = 1;
+    return buf;
+  }
+  void *buf;
+  if (posix_memalign(&buf, IMAGE_ALIGN, class_size) != 0) {
+    return NULL;
+  }
+  *zeroed = 0;
+  return buf;
+}
+
+/* Helper function for the buffer pool
+ * give a buffer of a class back to the system
+ */
+static void dropBuffer(void *buf, size_t class_size) {
+  if (class_size >= LARGE_BUFFER) {
+    munmap(buf, class_size);
+  }
+  else {
+    free(buf);
+  }
+}
+
+/* Helper function for the buffer pool
+ * a buffer for size bytes, from the pool if it has one
+ */
+static void* takeBuffer(size_t size, int *zeroed) {
+  size_t class_size;
+  int c = sizeClass(size, &class_size);
+  if (c >= POOL_CLASSES) {
+    return NULL;
+  }
+  pthread_mutex_lock(&pool_lock);
+  void *buf = pool[c];
+  if (buf != NULL) {
+    memcpy(&pool[c], buf, sizeof(void *)); //unlink it
+    pooled_count--;
+  }
+  pthread_mutex_unlock(&pool_lock);
+  if (stats_enabled) {
+    stats_add_buffer(class_size, buf != NULL);
+  }
+  if (buf != NULL) {
+    *zeroed = 0;
+    return buf;
+  }
+  return newBuffer(class_size, zeroed);
+}
 
 
+/* Helper function for the buffer pool
+ * free kept buffers, largest classes first, until at most keep are left;
+ * called with pool_lock held
+ */
+static void trimPool(int keep) {
+  for (int c = POOL_CLASSES - 1; c >= 0 && pooled_count > keep; c--) {
+    while (pool[c] != NULL && pooled_count > keep) {
+      void *buf = pool[c];
+      memcpy(&pool[c], buf, sizeof(void *));
+      pooled_count--;
+      dropBuffer(buf, classBytes(c));
+    }
+  }
+}
+
+
+/* keep up to max_buffers released buffers around for reuse */
+void set_buffer_recycling( int max_buffers ) {
+  pthread_mutex_lock(&pool_lock);
+  pool_limit = max_buffers > 0 ? max_buffers : 0;
+  trimPool(pool_limit); //drop whatever no longer fits
+  pthread_mutex_unlock(&pool_lock);
+}
+
+
+/* free every kept buffer */
+void trim_buffers( void ) {
+  pthread_mutex_lock(&pool_lock);
+  trimPool(0);
+  pthread_mutex_unlock(&pool_lock);
+}
+
+
+/* allocate size bytes aligned to IMAGE_ALIGN, reusing a released buffer of
+ * the same size class if one is kept; the contents are undefined */
+void* alloc_buffer( size_t size ) {
+  int zeroed;
+  return takeBuffer(size, &zeroed);
+}
+
+
+/* like alloc_buffer, but all zero; fresh large buffers are already zero,
+ * so only small or reused ones are cleared */
+void* alloc_buffer_zeroed( size_t size ) {
+  int zeroed;
+  void *buf = takeBuffer(size, &zeroed);
+  if (buf != NULL && !zeroed) {
+    memset(buf, 0, size);
+  }
+  return buf;
+}
+
+
+/* give back a buffer from alloc_buffer; size must be the size asked for */
+void release_buffer( void *buf , size_t size ) {
+  if (buf == NULL) {
+    return;
+  }
+  size_t class_size;
+  int c = sizeClass(size, &class_size);
+  pthread_mutex_lock(&pool_lock);
+  if (pooled_count < pool_limit) {
+    memcpy(buf, &pool[c], sizeof(void *)); //link it in front
+    pool[c] = buf;
+    pooled_count++;
+    buf = NULL;
+  }
+  pthread_mutex_unlock(&pool_lock);
+  if (buf != NULL) {
+    dropBuffer(buf, class_size);
+  }
+}
+
+
+/* allocate a new image of the specified size;
+ * doesn't initialize pixel values */
 Image make_image( int rows , int cols ) {
-  //allocate space for the image data
-  Image im;
-  im.rows = rows;
-  im.cols = cols;
-  im.data = malloc(sizeof(Pixel) * rows * cols);
+  return make_image_uninit( rows , cols , LAYOUT_PACKED );
+}
 
 
-  for (int i = 0; i < rows * cols; i++){
-    im.data[i].r = 0;
-    im.data[i].g = 0;
-    im.data[i].b = 0;
+/* Helper function for make_image_uninit and make_image_zeroed
+ * an image of the size and layout with no pixels allocated yet
+ */
+static Image imageShape(int rows, int cols, Layout layout) {
+  Image im = { NULL , rows , cols , NULL , 0 , layout , 0 };
+  if (layout == LAYOUT_PACKED) {
+    im.stride = sizeof(Pixel) * cols;
   }
-  
+  else if (layout == LAYOUT_RGB16) {
+    im.stride = 3 * sizeof(unsigned short) * cols;
+  }
+  else { //round every row up to a whole number of aligned blocks
+    size_t row = (size_t)cols * (layout == LAYOUT_RGBX ? 4 : 1);
+    im.stride = (row + IMAGE_ALIGN - 1) / IMAGE_ALIGN * IMAGE_ALIGN;
+  }
+  return im;
+}
+
+
+/* allocate a new image of the specified size and layout;
+ * doesn't initialize pixel values */
+Image make_image_uninit( int rows , int cols , Layout layout ) {
+  Image im = imageShape(rows, cols, layout);
+  im.data = alloc_buffer(image_bytes(im));
+  return im;
+}
+
+
+/* allocate a new all black image of the specified size and layout */
+Image make_image_zeroed( int rows , int cols , Layout layout ) {
+  Image im = imageShape(rows, cols, layout);
+  im.data = alloc_buffer_zeroed(image_bytes(im));
   return im;
 }
 
 
+/* bytes taken up by the pixels of an image with its layout */
+size_t image_bytes( const Image im ) {
+  return im.stride * im.rows * (im.layout == LAYOUT_PLANAR ? 3 : 1);
+}
+
+
+/* the pixels of row row of the image */
+PixelSpan image_row( const Image im , int row ) {
+  assert(im.layout != LAYOUT_RGB16);
+  PixelSpan span;
+  unsigned char *start = (unsigned char *)im.data + im.stride * row;
+  if (im.layout == LAYOUT_PLANAR) {
+    size_t plane = im.stride * im.rows;
+    span.chan[0] = start;
+    span.chan[1] = start + plane;
+    span.chan[2] = start + 2 * plane;
+    span.step = 1;
+  }
+  else {
+    span.chan[0] = start;
+    span.chan[1] = start + 1;
+    span.chan[2] = start + 2;
+    span.step = im.layout == LAYOUT_RGBX ? 4 : 3;
+  }
+  return span;
+}
+
+
+/* Helper function for copyRow
+ * the copy loop, inlined with constant steps for the common cases below
+ */
+static inline void copyPixels(PixelSpan dst, int dst_step, PixelSpan src, int src_step, int count) {
+  for (int i = 0; i < count; i++) {
+    dst.chan[0][i * dst_step] = src.chan[0][i * src_step];
+    dst.chan[1][i * dst_step] = src.chan[1][i * src_step];
+    dst.chan[2][i * dst_step] = src.chan[2][i * src_step];
+  }
+}
+
+/* copy count pixels between two layouts */
+static void copyRow(PixelSpan dst, PixelSpan src, int count) {
+  if (dst.step == src.step && dst.step != 1) { //interleaved channels, same layout
+    memcpy(dst.chan[0], src.chan[0], (size_t)count * dst.step);
+  }
+  else if (dst.step == src.step) {
+    for (int c = 0; c < 3; c++) {
+      memcpy(dst.chan[c], src.chan[c], count);
+    }
+  }
+  else if (dst.step == 3 && src.step == 4) {
+    copyPixels(dst, 3, src, 4, count);
+  }
+  else if (dst.step == 4 && src.step == 3) {
+    copyPixels(dst, 4, src, 3, count);
+  }
+  else if (dst.step == 3 && src.step == 1) {
+    copyPixels(dst, 3, src, 1, count);
+  }
+  else if (dst.step == 1 && src.step == 3) {
+    copyPixels(dst, 1, src, 3, count);
+  }
+  else {
+    copyPixels(dst, dst.step, src, src.step, count);
+  }
+}
+
+
+/* Helper function for copy_layout
+ * the 16-bit samples of row row of a LAYOUT_RGB16 image
+ */
+static unsigned short* wideRow(const Image im, int row) {
+  return (unsigned short *)((unsigned char *)im.data + im.stride * row);
+}
+
+/* a copy of in in another layout, leaving in alone */
+Image copy_layout( const Image in , Layout layout ) {
+  Image out = make_image_uninit(in.rows, in.cols, layout);
+  if (out.data == NULL) {
+    return out;
+  }
+  for (int row = 0; row < in.rows; row++) {
+    if (in.layout == LAYOUT_RGB16 && layout == LAYOUT_RGB16) {
+      memcpy(wideRow(out, row), wideRow(in, row), in.stride);
+    }
+    else if (in.layout == LAYOUT_RGB16) { //narrow, rounding v / 257
+      const unsigned short *src = wideRow(in, row);
+      PixelSpan dst = image_row(out, row);
+      for (int i = 0; i < in.cols; i++) {
+	for (int c = 0; c < 3; c++) {
+	  dst.chan[c][i * dst.step] = (unsigned char)((src[3 * i + c] + 128) / 257);
+	}
+      }
+    }
+    else if (layout == LAYOUT_RGB16) { //widen exactly
+      PixelSpan src = image_row(in, row);
+      unsigned short *dst = wideRow(out, row);
+      for (int i = 0; i < in.cols; i++) {
+	for (int c = 0; c < 3; c++) {
+	  dst[3 * i + c] = (unsigned short)(src.chan[c][i * src.step] * 257);
+	}
+      }
+    }
+    else {
+      copyRow(image_row(out, row), image_row(in, row), in.cols);
+    }
+  }
+  return out;
+}
+
+
+/* a copy of in in another layout; frees in */
+Image convert_layout( const Image in , Layout layout ) {
+  if (in.layout == layout) {
+    return in;
+  }
+  Image out = copy_layout(in, layout);
+  if (out.data != NULL) {
+    Image old = in;
+    free_image(&old);
+  }
+  return out;
+}
+
+
 /* output dimensions of the image to stdout */
 void output_dims( const Image im ) {
   printf( "cols = %d, rows = %d" , im.cols , im.rows );
 }
 
+
+static pthread_once_t error_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t error_key; // the error stream of the calling thread
+
+/* Helper function for error_stream and set_error_stream
+ * create the thread key once
+ */
+static void makeErrorKey(void) {
+  pthread_key_create(&error_key, NULL);
+}
+
+FILE* error_stream( void ) {
+  pthread_once(&error_key_once, makeErrorKey);
+  FILE *fp = pthread_getspecific(error_key);
+  return fp != NULL ? fp : stderr;
+}
+
+void set_error_stream( FILE *fp ) {
+  pthread_once(&error_key_once, makeErrorKey);
+  pthread_setspecific(error_key, fp);
+}
+
 /* free_image
  * utility function to free inner and outer pointers, 
  * and set to null 
  */
 void free_image( Image *im ) {
-  //  if (im != NULL && im -> data != NULL){
-  free(im -> data);
-  // }
+  if (im -> map != NULL) { //data points into a file mapping
+    munmap(im -> map, im -> map_size);
+    im -> map = NULL;
+    im -> map_size = 0;
+  }
+  else {
+    release_buffer(im -> data, image_bytes(*im));
+  }
+  im -> data = NULL;
   im -> cols = 0;
   im -> rows = 0;
 
@@ -184,6 +1091,40 @@ double** createMatrix(int *n, double sigma) {
 
 }
 
+/* Helper function for blur in image_manip
+ * creating the 1D gaussian filter. The 2D gaussian from createMatrix
+ * is the outer product of this kernel with itself, so blurring rows
+ * and then columns with it gives the same result in O(n) per pixel.
+ * The taps are normalized to sum to 1.
+ */
+double* createKernel(int *n, double sigma) {
+
+  *n = (int) (sigma * 10); //same width as createMatrix
+  if (*n % 2 == 0) { //if size is even, make it odd
+    (*n)++;
+  }
+  if (*n < 1) {
+    *n = 1;
+  }
+
+  double* kernel = malloc(sizeof(double) * (*n));
+  if (kernel == NULL) {
+    return NULL;
+  }
+
+  int half = *n / 2;
+  double total = 0.0;
+  for (int i = -half; i <= half; i++) {
+    kernel[i + half] = exp( -(i * i) / (2 * (sigma * sigma)));
+    total += kernel[i + half];
+  }
+  for (int i = 0; i < *n; i++) {
+    kernel[i] /= total;
+  }
+
+  return kernel;
+}
+
 /* Helper function for blur in image_manip
  * applying blur to each pixel
  */
@@ -17,21 +17,123 @@ typedef struct {
   unsigned char b;
 } Pixel;
 
+/* how the pixels of an Image are laid out in memory
+ * LAYOUT_PACKED  an array of Pixel, rows back to back. This is what
+ *                read_ppm/map_ppm/make_image produce, and the only layout
+ *                the operations other than grayscale, saturate, blend and
+ *                blur work on directly.
+ * LAYOUT_RGBX    4 bytes per pixel (r, g, b and an unused byte), so a pixel
+ *                never straddles a vector load
+ * LAYOUT_PLANAR  all the red values, then all the green, then all the blue
+ * LAYOUT_RGB16   r, g and b as unsigned shorts (0 to 65535), rows back to
+ *                back, for keeping the full depth of 16-bit files. Only
+ *                read_ppm_layout, write_ppm and copy_layout/convert_layout
+ *                handle it (image_row doesn't), so convert to another
+ *                layout before running an operation.
+ * For RGBX and planar, every row (of every plane) starts on a 64-byte
+ * boundary, stride bytes after the one before.
+ */
+typedef enum { LAYOUT_PACKED , LAYOUT_RGBX , LAYOUT_PLANAR , LAYOUT_RGB16 } Layout;
+
+/* the bytes at which 64-byte aligned buffers and rows start */
+#define IMAGE_ALIGN 64
+
 /* struct to store an entire image
  * pixels are linearized in row-major order, with the first block of pixels corresponding to the first row, then the second, etc.
  */
 typedef struct {
-  Pixel *data;
+  Pixel *data; // the pixels; for layouts other than LAYOUT_PACKED just the start of the buffer
   int rows;
   int cols;
+  void *map; // start of the file mapping when data points into one (see map_ppm), else NULL
+  size_t map_size;
+  Layout layout;
+  size_t stride; // bytes from the start of one row to the next (within a plane)
 } Image;
 
-/* read PPM formatted image from a file (assumes fp != NULL) */
+/* a run of pixels in any layout: channel c of the i-th pixel is
+ * chan[c][i * step], so step is 3 for packed, 4 for RGBX and 1 for
+ * planar pixels */
+typedef struct {
+  unsigned char *chan[3];
+  int step;
+} PixelSpan;
+
+/* what the header of a binary (P6) or ASCII (P3) PPM, or a binary (P5) or
+ * ASCII (P2) PGM, says */
+typedef struct {
+  int format; // 2, 3, 5 or 6, as in the tag
+  int rows;
+  int cols;
+  int maxval; // largest sample value, 1 to 65535; above 255 binary samples take 2 bytes
+} PpmHeader;
+
+/* read PPM formatted image from a file (assumes fp != NULL); any of the
+ * formats above is accepted, with samples scaled to 0-255 (rounded) and
+ * gray images turned into r = g = b */
 Image read_ppm( FILE * fp );
 
-/* write PPM formatted image to a file (assumes fp != NULL) */
+/* read_ppm straight into the given layout; LAYOUT_RGB16 scales samples
+ * to 0-65535 instead, so 16-bit files keep every bit */
+Image read_ppm_layout( FILE * fp , Layout layout );
+
+/* map a PPM formatted file into memory instead of reading it (assumes fp != NULL);
+ * the image data points straight into a private copy-on-write mapping of the file,
+ * so it can be modified in place without touching the file. Falls back to
+ * read_ppm when the file can't be mapped or holds another format than 8-bit
+ * P6. fp may be closed afterwards;
+ * free_image releases the mapping */
+Image map_ppm( FILE * fp );
+
+/* write PPM formatted image to a file (assumes fp != NULL); images in
+ * the other layouts are packed a row at a time on the way out, and
+ * LAYOUT_RGB16 images are written with 16-bit samples (maxval 65535).
+ * Returns the number of pixels written, fewer if a write came up short */
 int write_ppm( FILE * fp , const Image img );
 
+/* streaming versions of read_ppm/write_ppm, for working through an image
+ * a band of rows at a time without holding all of it in memory */
+
+/* read the header of any format read_ppm takes, leaving fp at the first
+ * pixel; returns 0, or -1 if it isn't a valid header */
+int read_ppm_info( FILE * fp , PpmHeader *header );
+
+/* the scratch rows and sample table read_ppm_pixels converts a file with
+ * that header through; reading a file a band at a time with one decoder
+ * sets them up once instead of for every band. NULL if out of memory */
+typedef struct PpmDecoder PpmDecoder;
+PpmDecoder* start_ppm_decoder( const PpmHeader *header );
+
+/* free a decoder from start_ppm_decoder (NULL is ignored) */
+void stop_ppm_decoder( PpmDecoder *decoder );
+
+/* read the next count rows of an image with that header into buf as 8-bit
+ * pixels, converting like read_ppm through decoder (NULL makes one for
+ * just this call); returns the number of complete rows read */
+int read_ppm_pixels( FILE * fp , const PpmHeader *header , PpmDecoder *decoder , Pixel *buf , int count );
+
+/* skip the next count rows of an image with that header, seeking past
+ * them in the binary formats; returns 0, or -1 if the file ends first */
+int skip_ppm_rows( FILE * fp , const PpmHeader *header , int count );
+
+/* read the next count rows of an image with cols columns into buf;
+ * returns the number of complete rows read */
+int read_ppm_rows( FILE * fp , Pixel *buf , int cols , int count );
+
+/* write the PPM header for an image of the given size; returns 0, or -1 on error */
+int write_ppm_header( FILE * fp , int rows , int cols );
+
+/* write count rows of an image with cols columns from buf;
+ * returns the number of rows written */
+int write_ppm_rows( FILE * fp , const Pixel *buf , int cols , int count );
+
+/* write the pixels of a packed image (whose rows may be stride apart
+ * within a bigger one) over the rectangle of an existing 8-bit binary PPM
+ * file whose top left corner is column x, row y, in place with positional
+ * writes (fp must be open for reading and writing); returns 0, or -1 if
+ * the file isn't one or the rectangle doesn't fit in it */
+int patch_ppm( FILE * fp , const Image region , int x , int y );
+
 /* utility function to free inner and outer pointers,
  * and set to null */
 void free_image( Image * im );
@@ -40,13 +142,72 @@ void free_image( Image * im );
  * doesn't initialize pixel values */
 Image make_image( int rows , int cols );
 
+/* allocate a new image of the specified size and layout;
+ * doesn't initialize pixel values */
+Image make_image_uninit( int rows , int cols , Layout layout );
+
+/* allocate a new all black image of the specified size and layout; large
+ * images get fresh pages the kernel has already zeroed when the pool has
+ * none to reuse, so nothing is written until the pixels are */
+Image make_image_zeroed( int rows , int cols , Layout layout );
+
+/* a copy of in in another layout, leaving in alone; on failure the
+ * result has NULL data */
+Image copy_layout( const Image in , Layout layout );
+
+/* a copy of in in another layout; frees in and returns the copy (or in
+ * itself if it already has that layout). On failure the result has NULL
+ * data and in is left alone. */
+Image convert_layout( const Image in , Layout layout );
+
+/* the pixels of row row of the image */
+PixelSpan image_row( const Image im , int row );
+
+/* bytes taken up by the pixels of an image with its layout */
+size_t image_bytes( const Image im );
+
+/* buffer recycling: free_image and release_buffer keep up to max_buffers
+ * freed buffers in a pool sorted by size class (sizes within 1/8 of each
+ * other share a class), and make_image and alloc_buffer hand one of the
+ * right class back out instead of allocating. The default of 4 lets the
+ * stages of a pipeline reuse each other's buffers; batch runs raise it and
+ * 0 frees everything kept. Safe to use from several threads. */
+void set_buffer_recycling( int max_buffers );
+
+/* free every buffer the pool is keeping, leaving the limit as it is */
+void trim_buffers( void );
+
+/* allocate size bytes aligned to IMAGE_ALIGN, reusing a kept buffer when
+ * there is one; the contents are undefined. Buffers of 2MB and more are
+ * mapped straight from the kernel and asked to be huge pages (set
+ * IMG_HUGEPAGES=0 to turn that off). */
+void* alloc_buffer( size_t size );
+
+/* like alloc_buffer, but all zero */
+void* alloc_buffer_zeroed( size_t size );
+
+/* free a buffer from alloc_buffer (size as passed to it), or keep it */
+void release_buffer( void *buf , size_t size );
+
 /* output dimensions of the image to stdout */
 void output_dims( const Image im );
 
+/* where error messages go: stderr, or the stream set_error_stream gave
+ * the calling thread (a daemon job's own, to send back to its client) */
+FILE* error_stream( void );
+
+/* send the calling thread's error messages to fp; NULL means stderr */
+void set_error_stream( FILE *fp );
+
 /* Blur helper function to generate the gaussian filter
 */
 double** createMatrix(int *n, double sigma);
 
+/* Blur helper function to generate the normalized 1D gaussian filter
+ * used by the separable blur
+*/
+double* createKernel(int *n, double sigma);
+
 /* Apply the gaussian blur to each pixel for the nenw image
 */
 Pixel applyBlur(Image im, double** gaussian, int size, int dx, int dy);
@@ -1,11 +1,20 @@
 //project.c
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "ppm_io.h"
+#include "qoi_io.h"
 #include "image_manip.h"
+#include "thread_pool.h"
+#include "stats.h"
+#include "serve.h"
 #include <ctype.h>
+#include <math.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 // Return (exit) codes
 #define RC_SUCCESS            0
@@ -19,363 +28,1696 @@
 #define RC_UNSPECIFIED_ERR    8
 
 
+// most stages a pipeline can have
+#define MAX_STAGES 64
+
+// bytes of rows read at a time when a resize shrinks the image as it is read
+#define SHRINK_BAND (8 << 20)
+
+/* one operation of a pipeline, e.g. "blur 2" or "rotate-ccw" */
+typedef struct {
+  char *name; // operation name
+  char **args; // arguments following the name
+  int nargs;
+} Stage;
+
 void print_usage();
+char* take_option(int *argc, char* argv[], const char *name);
+int take_flag(int *argc, char* argv[], const char *name);
+char* command_line(int argc, char* argv[]);
+size_t parse_size(const char *text);
+int parse_threads(const char *text);
+int parse_number(const char *text, double *value);
+int parse_layout(const char *text, Layout *layout);
+int is_input_name(const char *name);
+int is_output_name(const char *name);
+int is_qoi_name(const char *name);
+int parse_stages(int first, int argc, char* argv[], Stage stages[], int *count);
+int check_stage(const Stage *stage);
+int is_pointwise(const Stage *stage);
+PointOp point_op(const Stage *stage);
+int is_turn(const Stage *stage);
+int is_resize(const Stage *stage);
+int stage_size(const Stage *stage, int rows, int cols, int *out_rows, int *out_cols);
+Image load_shrunk(FILE *fp, const Stage *stage, Layout layout, int *rows, int *cols);
+Image run_stages(Image im, const Stage stages[], int count, int in_place);
+int runs_in_place(const Stage *stage);
+BlurMode blur_stage_engine(const Stage *stage);
+int read_number(FILE *fp, double *value);
+int load_kernel(const char *name, double weights[], Kernel *kernel);
+Image load_image(FILE *fp, int qoi, Layout layout);
+int write_image(const char *name, const Image im);
+int blend_command(int argc, char* argv[], Layout layout);
+int run_command(int argc, char* argv[]);
+int batch_command(const char *manifest, int stats);
+void batch_worker(void *arg, int begin, int end);
+int stream_operation(const char *in_name, const char *out_name, const Stage stages[], int count, size_t limit);
+int parse_roi(const char *text, int roi[4]);
+int roi_operation(const char *in_name, const char *out_name, const Stage stages[], int count, const int roi[4], int patch);
+int copy_file(const char *in_name, const char *out_name, size_t *bytes);
+int serve_command(int argc, char* argv[], char **output);
 
 int main (int argc, char* argv[]) {
+
+  //options may appear anywhere on the command line; pull them out first
+  char *batch = take_option(&argc, argv, "--batch");
+  char *serve = take_option(&argc, argv, "--serve");
+  char *client = take_option(&argc, argv, "--client");
+  char *threads = take_option(&argc, argv, "-j");
+  int stats = take_flag(&argc, argv, "--stats");
+
+  //hand the command to a daemon when one is named; $IMG_SOCKET lets
+  //scripts switch over unchanged, and runs locally if nobody answers
+  char *daemon_path = client != NULL ? client : getenv("IMG_SOCKET");
+  if (daemon_path != NULL && daemon_path[0] != '\0' && batch == NULL && serve == NULL) {
+    if (stats) {
+      argv[argc++] = "--stats"; //there is room, it was taken out above
+    }
+    char *output, *errors;
+    int rc = send_job(daemon_path, argc, argv, &output, &errors);
+    if (errors != NULL) {
+      fputs(errors, stderr);
+      free(errors);
+    }
+    if (output != NULL) {
+      fputs(output, stdout);
+      free(output);
+    }
+    if (rc >= 0) {
+      return rc;
+    }
+    if (rc == SEND_NO_REPLY || client != NULL) {
+      fprintf(error_stream(), "no answer from the daemon at %s\n", daemon_path);
+      return RC_UNSPECIFIED_ERR;
+    }
+    if (stats) {
+      argc--;
+    }
+  }
+
+  if (threads == NULL) {
+    threads = getenv("IMG_THREADS");
+  }
+  if (threads != NULL) {
+    int n = parse_threads(threads);
+    if (n < 0) {
+      fprintf(error_stream(), "invalid thread count\n");
+      return RC_INVALID_OP_ARGS;
+    }
+    set_thread_count(n);
+  }
+
+  //a manifest with one command per line instead of a single command
+  if (batch != NULL) {
+    if (argc > 1) {
+      fprintf(error_stream(), "--batch takes the commands from the manifest only\n");
+      return RC_INVALID_OP_ARGS;
+    }
+    return batch_command(batch, stats);
+  }
+
+  //a daemon running the command lines clients send
+  if (serve != NULL) {
+    if (argc > 1) {
+      fprintf(error_stream(), "--serve takes the commands from its clients only\n");
+      return RC_INVALID_OP_ARGS;
+    }
+    return serve_jobs(serve, serve_command, RC_UNSPECIFIED_ERR) == 0 ? RC_SUCCESS : RC_OPEN_FAILED;
+  }
+
+  //with --stats, time the whole command and print what was recorded
+  char *command = stats ? command_line(argc, argv) : NULL;
+  if (stats) {
+    stats_start_run(1);
+  }
+  int rc = run_command(argc, argv);
+  char *json = stats_finish_run(command != NULL ? command : "", rc);
+  if (json != NULL) {
+    printf("%s\n", json);
+    free(json);
+  }
+  free(command);
+  return rc;
+}
+
+
+/* run one command line (argv[0] is ignored) and return its RC_* code
+ */
+int run_command(int argc, char* argv[]) {
+
+  char *mem_limit = take_option(&argc, argv, "--mem-limit");
+  char *layout_name = take_option(&argc, argv, "--layout");
+  char *roi_text = take_option(&argc, argv, "--roi");
+  int patch = take_flag(&argc, argv, "--roi-patch");
+  int in_place = take_flag(&argc, argv, "--in-place");
+  Layout layout = LAYOUT_PACKED;
+  if (layout_name != NULL && !parse_layout(layout_name, &layout)) {
+    fprintf(error_stream(), "invalid layout, expected packed, rgbx or planar\n");
+    return RC_INVALID_OP_ARGS;
+  }
+  if (layout != LAYOUT_PACKED && mem_limit != NULL) {
+    fprintf(error_stream(), "--layout can't be combined with --mem-limit\n");
+    return RC_INVALID_OP_ARGS;
+  }
+  int roi[4];
+  if (roi_text != NULL && !parse_roi(roi_text, roi)) {
+    fprintf(error_stream(), "invalid region, expected --roi x,y,width,height\n");
+    return RC_INVALID_OP_ARGS;
+  }
+  if ((roi_text != NULL && (mem_limit != NULL || layout != LAYOUT_PACKED)) || (patch && roi_text == NULL)) {
+    fprintf(error_stream(), "--roi can't be combined with --mem-limit or --layout, and --roi-patch needs --roi\n");
+    return RC_INVALID_OP_ARGS;
+  }
+  if (in_place && (mem_limit != NULL || roi_text != NULL || layout != LAYOUT_PACKED)) {
+    fprintf(error_stream(), "--in-place can't be combined with --mem-limit, --roi or --layout\n");
+    return RC_INVALID_OP_ARGS;
+  }
   
   //if the command line doesnt have at least one arguments (the file name) it should return RC_MISSING_FILE  
   if (argc < 2) {
-    fprintf(stderr, "ERROR: the filename was not provided\n"); 
+    fprintf(error_stream(), "ERROR: the filename was not provided\n"); 
     return RC_MISSING_FILENAME;
   }
   //if there aren't at least 3 arguments then an operation is not specified                                                                                                         
   if (argc < 3) {
-    fprintf(stderr, "Did not specify an operation\n");
+    fprintf(error_stream(), "Did not specify an operation\n");
     return RC_OPEN_FAILED;
   }
   
   if (argc < 4 ) {
-    fprintf(stderr,"No operation given\n");
+    fprintf(error_stream(), "No operation given\n");
     return RC_INVALID_OPERATION;
   }
-  if (strstr(argv[1], ".ppm") == NULL || strstr(argv[2], ".ppm") == NULL) {
-    fprintf(stderr, "Input file(s) do not contain '.ppm'\n");
+  //inputs may also be grayscale .pgm files; the output is a .ppm or a .qoi
+  int second_is_input = strcmp(argv[3], "blend") == 0;
+  if (!is_input_name(argv[1]) || !(second_is_input ? is_input_name(argv[2]) : is_output_name(argv[2]))) {
+    fprintf(error_stream(), "Input file(s) do not contain '.ppm' or '.qoi'\n");
     return RC_WRITE_FAILED;
   }
-  //consider blend edge case (this requires 2 files to be present initially)
-  char *operation = argv[3];
-  if((operation[0] == 'b')){                                                                                                                                                        
-    if((operation[2] == 'e')){
-      if (argc < 4){
-	fprintf(stderr,"missing a second file name for blend\n");
-	return RC_MISSING_FILENAME;
-      }
+
+  //blend takes its second input where the other operations take the output
+  if (strcmp(argv[3], "blend") == 0) {
+    if (mem_limit != NULL || roi_text != NULL || in_place) {
+      fprintf(error_stream(), "blend can't be run with --mem-limit, --roi or --in-place\n");
+      return RC_INVALID_OP_ARGS;
+    }
+    return blend_command(argc, argv, layout);
+  }
+
+  //everything after the output file is a pipeline of stages separated by ":"
+  Stage stages[MAX_STAGES];
+  int count;
+  int rc = parse_stages(3, argc, argv, stages, &count);
+  if (rc != RC_SUCCESS) {
+    return rc;
+  }
+
+  //make sure every stage is valid before doing any work, the shrink-on-load
+  //of a leading resize included
+  for (int i = 0; i < count; i++) {
+    rc = check_stage(&stages[i]);
+    if (rc != RC_SUCCESS) {
+      return rc;
     }
   }
   
-  //open a file for reaidng binary based on the command line
-  FILE *fp = fopen(argv[1], "rb+");
-  if ( fp == NULL){
-    fprintf(stderr, "invalid file entered\n");
-    return RC_OPEN_FAILED;
+  //with a memory limit, stream the image through in bands instead of loading it
+  if (mem_limit != NULL) {
+    size_t limit = parse_size(mem_limit);
+    if (limit == 0) {
+      fprintf(error_stream(), "invalid memory limit\n");
+      return RC_INVALID_OP_ARGS;
+    }
+    return stream_operation(argv[1], argv[2], stages, count, limit);
+  }
+
+  //with a region, read only the rows it (and its blur halo) covers
+  if (roi_text != NULL) {
+    return roi_operation(argv[1], argv[2], stages, count, roi, patch);
   }
-  Image change_image;
-  Image input_image = read_ppm(fp);
-  change_image = make_image(input_image.rows, input_image.cols);
 
-  //load teh original r,g,b channels from iput into chnage_image;
-  for(int i = 0; i  < input_image.rows * input_image.cols; i++){
-    change_image.data[i].r = input_image.data[i].r;
-    change_image.data[i].g = input_image.data[i].g;
-    change_image.data[i].b = input_image.data[i].b;
+  //in place, every stage has to work in the image's own memory
+  for (int i = 0; in_place && i < count; i++) {
+    if (strcmp(stages[i].name, "blur") == 0 && !runs_in_place(&stages[i])) {
+      fprintf(error_stream(), "only the exact blur can be run with --in-place (without --mode, blur uses the box engine from sigma %g; add --mode=exact)\n", BLUR_AUTO_SIGMA);
+      return RC_INVALID_OP_ARGS;
+    }
+    if (!runs_in_place(&stages[i])) {
+      fprintf(error_stream(), "%s can't be run with --in-place\n", stages[i].name);
+      return RC_INVALID_OP_ARGS;
+    }
   }
   
-  free_image(&input_image);
+  //open a file for reaidng binary based on the command line
+  FILE *fp = fopen(argv[1], "rb");
+  if ( fp == NULL){
+    fprintf(error_stream(), "invalid file entered\n");
+    return RC_OPEN_FAILED;
+  }
+  //a leading resize shrinks the rows of a PPM as they are read, sized from the full image
+  int resize_rows = 0, resize_cols = 0;
+  int qoi = is_qoi_name(argv[1]);
+  Image change_image = count > 0 && is_resize(&stages[0]) && !qoi ? load_shrunk(fp, &stages[0], layout, &resize_rows, &resize_cols) : load_image(fp, qoi, layout);
   fclose(fp);
   
   if(change_image.data == NULL){//if the file entered into the command line doesn't have data return ERROR
     free_image(&change_image);
-    fprintf(stderr, "the file you have inputed contains incorrect image data");
+    fprintf(error_stream(), "the file you have inputed contains incorrect image data");
     return RC_INVALID_PPM;
   }
 
-  //chain of command to figure out what to do in  each operation case
-
-  //applying grayscale
-  if(strcmp(operation, "grayscale") == 0){
-    if(change_image.data == NULL){
-      fprintf(stderr, "You have not provided a proper ppm_file to be opened");
+  int first = 0;
+  if (resize_rows > 0) {
+    StatsMark t = stats_begin();
+    Image result = resize(change_image, resize_rows, resize_cols);
+    if (result.data == NULL) {
       free_image(&change_image);
-      return RC_INVALID_PPM;
     }
-    if (argc != 4) {
-      free_image(&change_image);
-      fprintf(stderr, "Invalid number of arguments\n");
+    change_image = result;
+    stats_end(stages[0].name, t);
+    first = 1;
+  }
+  change_image = run_stages(change_image, stages + first, count - first, in_place);
+  if(change_image.data == NULL){
+    fprintf(error_stream(), "You have not provided a proper ppm_file to be opened");
+    return RC_UNSPECIFIED_ERR;
+  }
+
+  rc = write_image(argv[2], change_image);
+  free_image(&change_image);
+  return rc;
+}
+
+
+/* blend: ./project <input1> <input2> blend <output> <alpha> [: more stages]
+ * Returns one of the RC_* codes.
+ */
+int blend_command(int argc, char* argv[], Layout layout) {
+  //check the arguments, every stage and the output name before reading anything
+  Stage stages[MAX_STAGES];
+  int count = 0;
+  int rc = RC_SUCCESS;
+  if (argc < 6 || (argc > 6 && strcmp(argv[6], ":") != 0)) {
+    fprintf(error_stream(), "Invalid number of arguments\n");
+    return RC_INVALID_OP_ARGS;
+  }
+  if (argc > 6) { //stages to run on the blended image
+    rc = parse_stages(7, argc, argv, stages, &count);
+  }
+  for (int i = 0; i < count && rc == RC_SUCCESS; i++) {
+    rc = check_stage(&stages[i]);
+  }
+  if (rc != RC_SUCCESS) {
+    return rc;
+  }
+
+  double value;
+  if (!parse_number(argv[5], &value)) {
+    fprintf(error_stream(), "invalid argument type\n"); // command line argument expects a number, reads something else
+    return RC_OP_ARGS_RANGE_ERR;
+  } 
+  float alpha = (float)value;
+
+  if (!is_output_name(argv[4])) {
+    fprintf(error_stream(), "Output file does not contain '.ppm' or '.qoi' extension");
+    return RC_WRITE_FAILED;
+  }
+
+  FILE *fp1 = fopen(argv[1], "rb");
+  FILE *fp2 = fopen(argv[2], "rb");
+
+  if (fp1 == NULL || fp2 == NULL) {
+    fprintf(error_stream(), "Invalid file entered\n");
+    if (fp1 != NULL) {
+      fclose(fp1);
+    }
+    if (fp2 != NULL) {
+      fclose(fp2);
+    }
+    return RC_OPEN_FAILED;
+  }
+        
+  Image in1 = load_image(fp1, is_qoi_name(argv[1]), layout);
+  Image in2 = load_image(fp2, is_qoi_name(argv[2]), layout);
+  fclose(fp1);
+  fclose(fp2);
+  if (in1.data == NULL || in2.data == NULL) {
+    fprintf(error_stream(), "the file you have inputed contains incorrect image data");
+    free_image(&in1);
+    free_image(&in2);
+    return RC_INVALID_PPM;
+  }
+
+  //writes over the larger input when it can; frees both inputs either way
+  StatsMark t = stats_begin();
+  Image change_image = blend_in_place(in1, in2 , alpha);
+  stats_end("blend", t);
+  if (change_image.data == NULL) {
+    free_image(&in1);
+    free_image(&in2);
+  }
+  change_image = run_stages(change_image, stages, count, 0);
+
+  if(change_image.data == NULL){
+    fprintf(error_stream(), "You have not provided a proper ppm_file to be opened");
+    return RC_WRITE_FAILED;
+  }
+
+  rc = write_image(argv[4], change_image);
+  free_image(&change_image);
+  return rc;
+}
+
+
+/* split argv[first..argc-1] into stages at each ":" argument.
+ * Returns RC_SUCCESS, or an RC_* code if a stage is empty or there are too many.
+ */
+int parse_stages(int first, int argc, char* argv[], Stage stages[], int *count) {
+  *count = 0;
+  int i = first;
+  while (i < argc) {
+    if (*count == MAX_STAGES) {
+      fprintf(error_stream(), "Too many stages (at most %d)\n", MAX_STAGES);
       return RC_INVALID_OP_ARGS;
     }
-      
-    else {
-      change_image = grayscale(change_image);
-      FILE *fp1 = fopen(argv[2], "wb");
-      if(fp1 == NULL){
-	fprintf(stderr, "write_ppm failed.\n");
-	free_image(&change_image);
-	//fclose(fp1);
-	return RC_WRITE_FAILED;
-      }
-      if (strstr(argv[2], ".ppm") == NULL) {
-	fprintf(stderr, "Output file does not contain '.ppm' extension");
-	free_image(&change_image);
-	fclose(fp1);
-	return RC_WRITE_FAILED;
+    if (strcmp(argv[i], ":") == 0) {
+      fprintf(error_stream(), "No operation given\n");
+      return RC_INVALID_OPERATION;
+    }
+    Stage *stage = &stages[(*count)++];
+    stage->name = argv[i++];
+    stage->args = argv + i;
+    stage->nargs = 0;
+    while (i < argc && strcmp(argv[i], ":") != 0) {
+      stage->nargs++;
+      i++;
+    }
+    if (i < argc) { //skip the separator, which must be followed by another stage
+      i++;
+      if (i == argc) {
+	fprintf(error_stream(), "No operation given\n");
+	return RC_INVALID_OPERATION;
       }
-	  
-      write_ppm(fp1, change_image);
-      fclose(fp1);
-    }	
-    free_image(&change_image);
-    return RC_SUCCESS;
-      
+    }
   }
-  
-  if(strcmp(operation, "blend") == 0){
-    FILE *fp1 = fopen(argv[1], "rb+");
-    FILE *fp2 = fopen(argv[2], "rb+");
-
-    if (fp1 == NULL && fp2 == NULL) {
-      fprintf(stderr, "Invalid file entered\n");
-      //fclose(fp2);                                                                                                                                                               
-      //fclose(fp2);                                                                                                                                                               
-      free_image(&change_image);
-      return RC_OPEN_FAILED;
+  return RC_SUCCESS;
+}
+
+
+/* parse a numeric operation argument; returns 0 if it isn't a number
+ */
+int parse_number(const char *text, double *value) {
+  *value = atof(text);
+  //atof gives 0 for anything it can't read, so 0 is only valid if written as such
+  return !(*value == 0 && strcmp(text, "0") != 0 && strcmp(text, "0.0") != 0);
+}
+
+
+/* make sure a stage names a known operation with the right arguments.
+ * Returns RC_SUCCESS or the matching RC_* error code.
+ */
+int check_stage(const Stage *stage) {
+  int wanted; //number of required arguments, all numeric
+  int optional = 0;
+  if (strcmp(stage->name, "grayscale") == 0 || strcmp(stage->name, "pointilism") == 0 || strcmp(stage->name, "invert") == 0 || is_turn(stage)) {
+    wanted = 0;
+  }
+  else if (strcmp(stage->name, "saturate") == 0 || strcmp(stage->name, "thumbnail") == 0 || strcmp(stage->name, "gamma") == 0
+	   || strcmp(stage->name, "brightness") == 0 || strcmp(stage->name, "contrast") == 0 || strcmp(stage->name, "box-blur") == 0
+	   || strcmp(stage->name, "convolve") == 0) {
+    wanted = 1;
+  }
+  else if (strcmp(stage->name, "resize") == 0 || strcmp(stage->name, "mean") == 0) {
+    wanted = 2;
+  }
+  else if (strcmp(stage->name, "levels") == 0) {
+    wanted = 2;
+    optional = 1; //gamma
+  }
+  else if (strcmp(stage->name, "blur") == 0) {
+    wanted = 1;
+    optional = 1; //--mode=...
+  }
+  else if (strcmp(stage->name, "rotate") == 0) {
+    wanted = 1;
+    optional = 1; //--filter=...
+  }
+  else {
+    fprintf(error_stream(), "Invalid operation\n");
+    return RC_INVALID_OPERATION;
+  }
+
+  if (stage->nargs < wanted || stage->nargs > wanted + optional) {
+    fprintf(error_stream(), "Invalid number of arguments\n");
+    return RC_INVALID_OP_ARGS;
+  }
+  double value;
+  //blur's and rotate's optional arguments are their mode and filter, convolve's a file name
+  int numeric = strcmp(stage->name, "blur") == 0 || strcmp(stage->name, "rotate") == 0 ? wanted
+    : strcmp(stage->name, "convolve") == 0 ? 0 : stage->nargs;
+  for (int i = 0; i < numeric; i++) {
+    if (!parse_number(stage->args[i], &value)) {
+      fprintf(error_stream(), "invalid argument type\n"); // command line argument expects a number, reads something else
+      return RC_OP_ARGS_RANGE_ERR;
     }
-    else if (fp1 != NULL && fp2 == NULL ){
-      fclose(fp1);
-      free_image(&change_image);
-      fprintf(stderr, "Invalid file entered\n");
-      return RC_OPEN_FAILED;
+  }
+  int rows, cols;
+  if (is_resize(stage) && !stage_size(stage, 1, 1, &rows, &cols)) {
+    fprintf(error_stream(), "sizes must be whole numbers of pixels\n");
+    return RC_OP_ARGS_RANGE_ERR;
+  }
+  //a box-blur radius may be 0, a mean's width and height must be at least 1
+  int is_box = strcmp(stage->name, "box-blur") == 0;
+  for (int i = 0; (is_box || strcmp(stage->name, "mean") == 0) && i < stage->nargs; i++) {
+    char *end;
+    long size = strtol(stage->args[i], &end, 10);
+    if (*end != '\0' || size < (is_box ? 0 : 1) || size > 1 << 20) {
+      fprintf(error_stream(), "sizes must be whole numbers of pixels\n");
+      return RC_OP_ARGS_RANGE_ERR;
+    }
+  }
+  PointOp op = is_pointwise(stage) ? point_op(stage) : (PointOp){ POINT_GRAYSCALE , 0.0 , 0.0 , 0.0 };
+  if ((op.kind == POINT_GAMMA && !(op.arg > 0)) || (op.kind == POINT_CONTRAST && !(op.arg >= 0))
+      || (op.kind == POINT_LEVELS && !(op.arg >= 0 && op.arg < op.arg2 && op.arg2 <= 255 && op.arg3 > 0))) {
+    fprintf(error_stream(), "%s argument out of range\n", stage->name);
+    return RC_OP_ARGS_RANGE_ERR;
+  }
+  if (strcmp(stage->name, "blur") == 0 && stage->nargs == 2 && strcmp(stage->args[1], "--mode=exact") != 0 && strcmp(stage->args[1], "--mode=box") != 0 && strcmp(stage->args[1], "--mode=iir") != 0) {
+    fprintf(error_stream(), "invalid blur mode\n");
+    return RC_INVALID_OP_ARGS;
+  }
+  if (strcmp(stage->name, "rotate") == 0 && !isfinite(atof(stage->args[0]))) {
+    fprintf(error_stream(), "rotate argument out of range\n");
+    return RC_OP_ARGS_RANGE_ERR;
+  }
+  if (strcmp(stage->name, "rotate") == 0 && stage->nargs == 2 && strcmp(stage->args[1], "--filter=bilinear") != 0 && strcmp(stage->args[1], "--filter=bicubic") != 0) {
+    fprintf(error_stream(), "invalid rotate filter\n");
+    return RC_INVALID_OP_ARGS;
+  }
+  if (strcmp(stage->name, "convolve") == 0) {
+    double weights[CONVOLVE_MAX * CONVOLVE_MAX];
+    Kernel kernel;
+    return load_kernel(stage->args[0], weights, &kernel);
+  }
+  return RC_SUCCESS;
+}
+
 
+/* read the next number of a kernel file, skipping white space and
+ * comments (# to the end of the line). Returns 1, 0 at the end of the
+ * file, or -1 if the next word isn't a number.
+ */
+int read_number(FILE *fp, double *value) {
+  int ch = getc(fp);
+  while (ch != EOF && (isspace(ch) || ch == '#')) {
+    if (ch == '#') {
+      while (ch != EOF && ch != '\n') {
+	ch = getc(fp);
+      }
     }
-    else if (fp2 == NULL && fp1 == NULL){
-      fclose(fp2);
-      free_image(&change_image);
-      fprintf(stderr, "Invalid file entered\n");
-      return RC_OPEN_FAILED;
+    else {
+      ch = getc(fp);
+    }
+  }
+  if (ch == EOF) {
+    return 0;
+  }
+  char word[64];
+  size_t n = 0;
+  while (ch != EOF && !isspace(ch) && ch != '#') {
+    if (n + 1 < sizeof(word)) {
+      word[n++] = (char)ch;
     }
+    else {
+      return -1;
+    }
+    ch = getc(fp);
+  }
+  ungetc(ch, fp);
+  word[n] = '\0';
+  char *end;
+  *value = strtod(word, &end);
+  return *end == '\0' && isfinite(*value) ? 1 : -1;
+}
 
-    if (argc != 6) {
-      fclose(fp1);
-      fclose(fp2);
-      free_image(&change_image);
-      fprintf(stderr, "Invalid number of arguments\n");
-      return RC_INVALID_OP_ARGS;
+
+/* read the kernel file of a convolve stage into kernel, with its weights
+ * kept in weights (room for CONVOLVE_MAX * CONVOLVE_MAX of them). The file
+ * holds numbers separated by white space: the width and height (odd, at
+ * most CONVOLVE_MAX), height rows of width weights, then optionally the
+ * divisor (the sum of the weights if not given, or 1 if that is 0) and an
+ * offset added after dividing (0 if not given). Returns one of the RC_*
+ * codes.
+ */
+int load_kernel(const char *name, double weights[], Kernel *kernel) {
+  FILE *fp = fopen(name, "r");
+  if (fp == NULL) {
+    fprintf(error_stream(), "could not open the kernel file %s\n", name);
+    return RC_INVALID_OP_ARGS;
+  }
+  double size[2];
+  int rc = RC_SUCCESS;
+  for (int i = 0; i < 2 && rc == RC_SUCCESS; i++) {
+    if (read_number(fp, &size[i]) != 1) {
+      rc = RC_INVALID_OP_ARGS;
     }
-    float alpha  = atof(argv[5]);
-    if(alpha == 0 && strcmp(argv[5], "0") != 0 && strcmp(argv[5], "0.0") != 0){//consider edge case in which value is 0
-      fprintf(stderr, "invalid argument type\n"); // command line argument expects a number, reads something else
-      fclose(fp1);
-      fclose(fp2);
-      free_image(&change_image);
+    else if (size[i] != floor(size[i]) || size[i] < 1 || size[i] > CONVOLVE_MAX || fmod(size[i], 2) != 1) {
+      fprintf(error_stream(), "kernel sides must be odd numbers from 1 to %d\n", CONVOLVE_MAX);
+      fclose(fp);
       return RC_OP_ARGS_RANGE_ERR;
-    } 
-        
-    Image in1 = read_ppm(fp1);
-    Image in2 = read_ppm(fp2);
-    alpha = atof(argv[5]);
-	
-    free_image(&change_image);
-    change_image = blend(in1, in2 , alpha);
-    fclose(fp1);
-    fclose(fp2);
-    free_image(&in1);
-    free_image(&in2);	
+    }
+  }
+  int count = rc == RC_SUCCESS ? (int)size[0] * (int)size[1] : 0;
+  double total = 0.0;
+  for (int i = 0; i < count && rc == RC_SUCCESS; i++) {
+    if (read_number(fp, &weights[i]) != 1) {
+      rc = RC_INVALID_OP_ARGS;
+    }
+    total += weights[i];
+  }
+  double extra[3] = { total != 0 ? total : 1.0 , 0.0 , 0.0 }; //divisor, offset
+  for (int i = 0; i < 3 && rc == RC_SUCCESS; i++) {
+    int got = read_number(fp, &extra[i]);
+    if (got < 0 || (got > 0 && i == 2)) { //at most the divisor and offset follow
+      rc = RC_INVALID_OP_ARGS;
+    }
+    if (got <= 0) {
+      break;
+    }
+  }
+  fclose(fp);
+  if (rc != RC_SUCCESS) {
+    fprintf(error_stream(), "invalid kernel file %s\n", name);
+    return rc;
+  }
+  if (extra[0] == 0) {
+    fprintf(error_stream(), "the kernel's divisor can't be 0\n");
+    return RC_OP_ARGS_RANGE_ERR;
+  }
+  kernel->width = (int)size[0];
+  kernel->height = (int)size[1];
+  kernel->weights = weights;
+  kernel->divisor = extra[0];
+  kernel->offset = extra[1];
+  return RC_SUCCESS;
+}
 
-    if(change_image.rows == 0 && change_image.cols == 0){
-      fprintf(stderr, "You have not provided a proper ppm_file to be opened");
-      free_image(&change_image);
-      return RC_WRITE_FAILED;
+
+/* true for stages that only look at one pixel at a time, which run_stages
+ * fuses into a single pass with apply_pointwise
+ */
+int is_pointwise(const Stage *stage) {
+  return strcmp(stage->name, "grayscale") == 0 || strcmp(stage->name, "saturate") == 0
+    || strcmp(stage->name, "gamma") == 0 || strcmp(stage->name, "brightness") == 0
+    || strcmp(stage->name, "contrast") == 0 || strcmp(stage->name, "levels") == 0
+    || strcmp(stage->name, "invert") == 0;
+}
+
+
+/* the apply_pointwise operation for a pointwise stage (whose arguments
+ * have been checked, or are taken as 0)
+ */
+PointOp point_op(const Stage *stage) {
+  static const struct {
+    const char *name;
+    PointOpKind kind;
+  } kinds[] = {
+    { "grayscale" , POINT_GRAYSCALE } , { "saturate" , POINT_SATURATE } , { "gamma" , POINT_GAMMA } ,
+    { "brightness" , POINT_BRIGHTNESS } , { "contrast" , POINT_CONTRAST } , { "levels" , POINT_LEVELS } ,
+    { "invert" , POINT_INVERT }
+  };
+  PointOp op = { POINT_GRAYSCALE , 0.0 , 0.0 , 1.0 }; //levels' gamma defaults to 1
+  for (size_t i = 0; i < sizeof(kinds) / sizeof(kinds[0]); i++) {
+    if (strcmp(stage->name, kinds[i].name) == 0) {
+      op.kind = kinds[i].kind;
     }
-	
-    else {
-      FILE *fp1 = fopen(argv[4], "wb");
-      if(fp1 == NULL){
-	fprintf(stderr, "write_ppm failed.\n");
-	fclose(fp1);
-	return RC_WRITE_FAILED;
+  }
+  double *args[3] = { &op.arg , &op.arg2 , &op.arg3 };
+  for (int i = 0; i < stage->nargs && i < 3; i++) {
+    *args[i] = atof(stage->args[i]);
+  }
+  return op;
+}
+
+
+/* true for the rotations and flips
+ */
+int is_turn(const Stage *stage) {
+  return strcmp(stage->name, "rotate-ccw") == 0 || strcmp(stage->name, "rotate-cw") == 0
+    || strcmp(stage->name, "rotate-180") == 0 || strcmp(stage->name, "flip-h") == 0
+    || strcmp(stage->name, "flip-v") == 0;
+}
+
+
+/* run checked stages on im in order, keeping the image in memory between them;
+ * with in_place set (all the stages must pass runs_in_place) none of them
+ * makes a second image. Returns the result (data is NULL if an operation failed).
+ */
+Image run_stages(Image im, const Stage stages[], int count, int in_place) {
+  int i = 0;
+  while (i < count && im.data != NULL) {
+    const Stage *stage = &stages[i];
+    StatsMark t = stats_begin();
+
+    if (is_pointwise(stage)) { //gather the run of pointwise stages
+      PointOp ops[MAX_STAGES];
+      int nops = 0;
+      while (i < count && is_pointwise(&stages[i])) {
+	ops[nops++] = point_op(&stages[i]);
+	i++;
       }
-      if (strstr(argv[4], ".ppm") == NULL) {
-	fprintf(stderr, "Output file does not contain '.ppm' extension");
-	fclose(fp1);
-	return RC_WRITE_FAILED;
+      im = apply_pointwise(im, ops, nops);
+      stats_end("pointwise", t);
+      continue;
+    }
+
+    if (strcmp(stage->name, "blur") == 0) {
+      Image result = in_place ? blur_in_place(im, atof(stage->args[0])) : blur_with_mode(im, atof(stage->args[0]), blur_stage_engine(stage));
+      if (result.data == NULL) {
+	free_image(&im);
       }
-      write_ppm(fp1, change_image);	  
-      fclose(fp1);
-      free_image(&change_image);
-      return RC_SUCCESS;
-    }	
-  }
-    
-  //apply the blur function
-   
-  else if(strcmp(operation, "blur") == 0){
-    if (argc != 5) {
-      free_image(&change_image);
-      fprintf(stderr, "Invalid number of arguments\n");
-      return RC_INVALID_OP_ARGS;
+      im = result;
     }
-    float sigma  = atof(argv[4]);
-    if(sigma == 0 && strcmp(argv[4], "0") != 0 && strcmp(argv[4], "0.0") != 0){
-      fprintf(stderr, "invalid argument type\n"); // command line argument expects a number, reads something else
-      free_image(&change_image);
-      return RC_OP_ARGS_RANGE_ERR;
+    else if (strcmp(stage->name, "box-blur") == 0 || strcmp(stage->name, "mean") == 0) {
+      int w = atoi(stage->args[0]);
+      Image result = stage->nargs == 1 ? box_blur(im, w) : mean_filter(im, w, atoi(stage->args[1]));
+      if (result.data == NULL) {
+	free_image(&im);
+      }
+      im = result;
     }
-      
-    change_image =  blur(change_image, atof(argv[4]));
-      
-
-    if(change_image.data == NULL){
-      fprintf(stderr, "You have not provided a proper ppm_file to be opened");
-      free_image(&change_image);
-      return RC_WRITE_FAILED;
+    else if (strcmp(stage->name, "convolve") == 0) {
+      double weights[CONVOLVE_MAX * CONVOLVE_MAX];
+      Kernel kernel;
+      Image result = { NULL , 0 , 0 , NULL , 0 , LAYOUT_PACKED , 0 };
+      if (load_kernel(stage->args[0], weights, &kernel) == RC_SUCCESS) {
+	result = convolve(im, &kernel);
+      }
+      if (result.data == NULL) {
+	free_image(&im);
+      }
+      im = result;
     }
-	
-    else {
-      FILE *fp1 = fopen(argv[2], "wb");
-      if(fp1 == NULL){
-	fprintf(stderr, "write_ppm failed.\n");
-	fclose(fp1);
-	return RC_WRITE_FAILED;
+    else if (strcmp(stage->name, "rotate") == 0) {
+      //optional sampling, --filter=bilinear|bicubic
+      RotateFilter filter = stage->nargs == 2 && strcmp(stage->args[1], "--filter=bicubic") == 0 ? ROTATE_BICUBIC : ROTATE_BILINEAR;
+      Image result = rotate(im, atof(stage->args[0]), filter);
+      if (result.data == NULL) {
+	free_image(&im);
       }
-      if (strstr(argv[2], ".ppm" ) == NULL) {
-	fprintf(stderr, "Output file does not contain '.ppm' extension");
-	fclose(fp1); // check for valgrind
-	return RC_WRITE_FAILED;
+      im = result;
+    }
+    else if (strcmp(stage->name, "pointilism") == 0) {
+      Image result = in_place ? pointilism_in_place(im, 1) : pointilism(im, 1);//the seed value is supposed to be 1
+      if (result.data == NULL) {
+	free_image(&im);
       }
-	    
-      write_ppm(fp1, change_image);
-      fclose(fp1);
-      free_image(&change_image);
-      return RC_SUCCESS;
+      im = result;
     }
-  }
-      
-  //applying the pointilism function
-  
-  if(strcmp(operation, "pointilism") == 0){
-    if (argc != 4) {
-      free_image(&change_image);
-      fprintf(stderr, "Invalid number of arguments\n");
-      return RC_INVALID_OP_ARGS;
+    else if (is_resize(stage)) {
+      int rows, cols;
+      stage_size(stage, im.rows, im.cols, &rows, &cols);
+      Image result = resize(im, rows, cols);
+      if (result.data == NULL) {
+	free_image(&im);
+      }
+      im = result;
     }
-    change_image = pointilism(change_image, 1);//the seed value is supposed to be 1
+    else if (is_turn(stage)) {
+      Image result;
+      if (strcmp(stage->name, "rotate-ccw") == 0) {
+	result = in_place ? rotate_ccw_in_place(im) : rotate_ccw(im);
+      }
+      else if (strcmp(stage->name, "rotate-cw") == 0) {
+	result = in_place ? rotate_cw_in_place(im) : rotate_cw(im);
+      }
+      else if (strcmp(stage->name, "rotate-180") == 0) {
+	result = rotate_180(im);
+      }
+      else if (strcmp(stage->name, "flip-h") == 0) {
+	result = flip_h(im);
+      }
+      else {
+	result = flip_v(im);
+      }
+      if (result.data == NULL) {
+	free_image(&im);
+      }
+      im = result;
+    }
+    stats_end(stage->name, t);
+    i++;
+  }
+  return im;
+}
 
-    if(change_image.data == NULL){
-      fprintf(stderr, "You have not provided a proper ppm_file to be opened");
-      free_image(&change_image);
-      return RC_WRITE_FAILED;
+
+/* the engine a checked blur stage runs: its optional --mode=exact|box|iir,
+ * with the default (auto) resolved by sigma like blur_with_mode does.
+ * Every path that runs a blur picks the engine here, so the exact-only
+ * ones (--mem-limit, --roi, --in-place) can refuse the others.
+ */
+BlurMode blur_stage_engine(const Stage *stage) {
+  BlurMode mode = BLUR_AUTO;
+  if (stage->nargs == 2) {
+    if (strcmp(stage->args[1], "--mode=exact") == 0) {
+      mode = BLUR_EXACT;
+    }
+    else if (strcmp(stage->args[1], "--mode=box") == 0) {
+      mode = BLUR_BOX;
     }
-	
     else {
-      FILE *fp1 = fopen(argv[2], "wb");
-      if(fp1 == NULL){
-	fprintf(stderr, "write_ppm failed.\n");
-	fclose(fp1);
-	return RC_WRITE_FAILED;
-      }
-      if (strstr(argv[2], ".ppm") == NULL) {
-	fprintf(stderr, "Output file does not contain '.ppm' extension");
-	fclose(fp1);
-	return RC_WRITE_FAILED;
-      }
-      write_ppm(fp1, change_image);
-      fclose(fp1);
-      free_image(&change_image);
-      return RC_SUCCESS;
+      mode = BLUR_IIR;
     }
   }
-  
+  return blur_engine(atof(stage->args[0]), mode);
+}
 
-  //applying the saturate function
-  if(strcmp(operation, "saturate") == 0){
-    if (argc != 5) {
-      free_image(&change_image);
-      fprintf(stderr, "Invalid number of arguments\n");
-      return RC_INVALID_OP_ARGS;
+
+/* true for stages that can run in the image's own memory: the pointwise
+ * ones, the rotations and flips, pointilism and a blur whose engine is
+ * the exact one (the engine that depends on nearby rows alone)
+ */
+int runs_in_place(const Stage *stage) {
+  if (strcmp(stage->name, "blur") == 0) {
+    return blur_stage_engine(stage) == BLUR_EXACT;
+  }
+  return is_pointwise(stage) || is_turn(stage) || strcmp(stage->name, "pointilism") == 0;
+}
+
+
+/* whether a stage is resize or thumbnail
+ */
+int is_resize(const Stage *stage) {
+  return strcmp(stage->name, "resize") == 0 || strcmp(stage->name, "thumbnail") == 0;
+}
+
+
+/* the size a resize or thumbnail stage turns a rows x cols image into:
+ * resize <width> <height>, or thumbnail <max-edge> scaling the longer side
+ * down to max-edge (never up) and keeping the aspect ratio. Returns 0 if
+ * the arguments aren't sizes.
+ */
+int stage_size(const Stage *stage, int rows, int cols, int *out_rows, int *out_cols) {
+  long values[2];
+  if (stage->nargs != (strcmp(stage->name, "resize") == 0 ? 2 : 1)) {
+    return 0;
+  }
+  for (int i = 0; i < stage->nargs; i++) {
+    char *end;
+    values[i] = strtol(stage->args[i], &end, 10);
+    if (end == stage->args[i] || *end != '\0' || values[i] < 1 || values[i] > 1 << 20) {
+      return 0;
     }
-    double scale = atof(argv[4]);
+  }
+  if (strcmp(stage->name, "resize") == 0) {
+    *out_cols = (int)values[0];
+    *out_rows = (int)values[1];
+    return 1;
+  }
+  int longest = rows > cols ? rows : cols;
+  double scale = longest > values[0] ? (double)values[0] / longest : 1.0;
+  *out_rows = (int)(rows * scale + 0.5) > 0 ? (int)(rows * scale + 0.5) : 1;
+  *out_cols = (int)(cols * scale + 0.5) > 0 ? (int)(cols * scale + 0.5) : 1;
+  return 1;
+}
 
-    if(scale == 0 && strcmp(argv[4], "0") != 0 && strcmp(argv[4], "0.0") != 0){
-      fprintf(stderr, "invalid argument type\n"); // command line argument expects a number, reads something else
-      free_image(&change_image);
-      return RC_OP_ARGS_RANGE_ERR;
+
+/* load the image for a pipeline that starts with the resize or thumbnail
+ * stage, setting rows and cols to the size it asks for (left alone if
+ * its arguments are bad). When that shrinks the image 2x or more, the
+ * blocks resize would average are averaged as the rows are read, a band
+ * at a time, so the full size image is never held in memory; otherwise
+ * it is loaded as usual. Either way resize gives the same pixels.
+ */
+Image load_shrunk(FILE *fp, const Stage *stage, Layout layout, int *rows, int *cols) {
+  Image im = { NULL , 0 , 0 , NULL , 0 , LAYOUT_PACKED , 0 };
+  PpmHeader header;
+  int kx = 1, ky = 1;
+  if (read_ppm_info(fp, &header) == 0 && stage_size(stage, header.rows, header.cols, rows, cols)) {
+    resize_factors(header.rows, header.cols, *rows, *cols, &ky, &kx);
+  }
+  if (kx == 1 && ky == 1) {
+    return fseek(fp, 0, SEEK_SET) == 0 ? load_image(fp, 0, layout) : im;
+  }
+
+  StatsMark t = stats_begin();
+  im = make_image_uninit(header.rows / ky, header.cols / kx, layout);
+  size_t row_bytes = sizeof(Pixel) * header.cols;
+  int blocks = (int)(SHRINK_BAND / (row_bytes * ky)); //output rows per band
+  blocks = blocks < 1 ? 1 : blocks > im.rows ? im.rows : blocks;
+  Pixel *band = malloc(row_bytes * ky * blocks);
+  PpmDecoder *decoder = start_ppm_decoder(&header); //set up once for all the bands
+  if (band == NULL || decoder == NULL) {
+    free_image(&im);
+  }
+  for (int r = 0; r < im.rows && im.data != NULL; r += blocks) {
+    int n = im.rows - r < blocks ? im.rows - r : blocks;
+    if (read_ppm_pixels(fp, &header, decoder, band, n * ky) != n * ky) {
+      fprintf(error_stream(), "Error:ppm_io - failed to read data from file!\n");
+      free_image(&im);
+      break;
     }
-    change_image = saturate(change_image, atof(argv[4]));
+    Image rows_read = { band, n * ky, header.cols, NULL, 0, LAYOUT_PACKED, row_bytes };
+    if (shrink_band(rows_read, kx, ky, im, r) != 0) {
+      free_image(&im);
+    }
+  }
+  free(band);
+  stop_ppm_decoder(decoder);
+  stats_end("read", t);
+  if (stats_enabled && im.data != NULL) {
+    long pos = ftell(fp);
+    stats_add_io((size_t)(pos > 0 ? pos : 0), 0);
+  }
+  return im;
+}
 
-    if(change_image.data == NULL){
-      fprintf(stderr, "You have not provided a proper ppm_file to be opened");
-      free_image(&change_image);
-      return RC_WRITE_FAILED;
+
+/* read an image from fp (a QOI file if qoi is set, else a PPM) into
+ * memory laid out as asked. Packed PPMs are mapped instead of read; the
+ * mapping is private, so the in-place operations never write back to the
+ * input file
+ */
+Image load_image(FILE *fp, int qoi, Layout layout) {
+  StatsMark t = stats_begin();
+  Image im = qoi ? read_qoi_layout(fp, layout) : layout == LAYOUT_PACKED ? map_ppm(fp) : read_ppm_layout(fp, layout);
+  stats_end("read", t);
+  if (stats_enabled && im.data != NULL) { //a mapped file counts as read whole
+    long pos = ftell(fp);
+    stats_add_io(im.map != NULL ? im.map_size : (size_t)(pos > 0 ? pos : 0), 0);
+  }
+  return im;
+}
+
+
+/* write im to the named file, as a QOI if the name says so and
+ * otherwise a PPM; returns one of the RC_* codes
+ */
+int write_image(const char *name, const Image im) {
+  FILE *fp = fopen(name, "wb");
+  if(fp == NULL){
+    fprintf(error_stream(), "write_ppm failed.\n");
+    return RC_WRITE_FAILED;
+  }
+  StatsMark t = stats_begin();
+  int written = is_qoi_name(name) ? write_qoi(fp, im) : write_ppm(fp, im);
+  if (stats_enabled) {
+    long pos = ftell(fp);
+    stats_add_io(0, (size_t)(pos > 0 ? pos : 0));
+  }
+  stats_end("write", t);
+  if (ferror(fp) || written < im.rows * im.cols) {
+    fclose(fp);
+    fprintf(error_stream(), "write_ppm failed.\n");
+    return RC_WRITE_FAILED;
+  }
+  if (fclose(fp) != 0) {
+    fprintf(error_stream(), "write_ppm failed.\n");
+    return RC_WRITE_FAILED;
+  }
+  return RC_SUCCESS;
+}
+
+
+/* one line of a batch manifest, split into a command line */
+typedef struct {
+  int line; // line number in the manifest
+  int argc;
+  char **argv;
+  int rc; // result of running it
+  char *stats; // its --stats JSON, or NULL
+} BatchJob;
+
+/* the jobs of a batch, handed out one at a time to whichever thread is free */
+typedef struct {
+  BatchJob *jobs;
+  int count;
+  int next; // first job nobody has taken yet
+  int stats; // record each job with --stats
+  pthread_mutex_t lock;
+} Batch;
+
+
+/* worker for batch_command: keep taking the next job until there are none
+ * left. Every job runs on this thread alone (parallel_for calls made while
+ * the batch is running don't spread out further), so files run side by side.
+ */
+void batch_worker(void *arg, int begin, int end) {
+  Batch *batch = arg;
+  (void)begin;
+  (void)end;
+  for (;;) {
+    pthread_mutex_lock(&batch->lock);
+    int i = batch->next++;
+    pthread_mutex_unlock(&batch->lock);
+    if (i >= batch->count) {
+      break;
     }
+    BatchJob *job = &batch->jobs[i];
+    char *command = batch->stats ? command_line(job->argc, job->argv) : NULL;
+    if (batch->stats) {
+      stats_start_run(0);
+    }
+    job->rc = run_command(job->argc, job->argv);
+    job->stats = stats_finish_run(command != NULL ? command : "", job->rc);
+    free(command);
+  }
+}
 
-    else {
-      FILE *fp1 = fopen(argv[2], "wb");
-      if(fp1 == NULL){
-	fprintf(stderr, "write_ppm failed.\n");
-	fclose(fp1);
-	free_image(&change_image);
-	return RC_WRITE_FAILED;
-      }
-      if (strstr(argv[2], ".ppm") == NULL) {
-	fprintf(stderr, "Output file does not contain '.ppm' extension");
-	free_image(&change_image);
-	fclose(fp1);
-	return RC_WRITE_FAILED;
+
+/* run one job for --serve as a command line of its own; with --stats
+ * among its arguments the JSON is handed back in *output for the client
+ */
+int serve_command(int argc, char* argv[], char **output) {
+  int stats = take_flag(&argc, argv, "--stats");
+  char *command = stats ? command_line(argc, argv) : NULL;
+  if (stats) {
+    stats_start_run(0); //this job's own, whatever the others are doing
+  }
+  int rc = run_command(argc, argv);
+  char *json = stats_finish_run(command != NULL ? command : "", rc);
+  if (json != NULL) {
+    *output = malloc(strlen(json) + 2);
+    if (*output != NULL) {
+      sprintf(*output, "%s\n", json);
+    }
+  }
+  free(json);
+  free(command);
+  return rc;
+}
+
+
+/* batch: ./project --batch <manifest> [-j <threads>]
+ * run every line of the manifest as if it were a command line of its own,
+ * e.g. "dog.ppm dog_small.ppm blur 2 : rotate-ccw" or
+ * "dog.ppm cat.ppm blend out.ppm 0.5"; blank lines and lines starting with
+ * # are skipped. Lines run on the -j threads side by side, and image
+ * buffers and blur kernels are reused from one line to the next. A line
+ * that fails is reported with its RC_* code and the rest still run. With
+ * stats every line gets its own --stats record.
+ * Returns RC_SUCCESS, or the code of the first line that failed.
+ */
+int batch_command(const char *manifest, int stats) {
+  FILE *fp = fopen(manifest, "rb");
+  if (fp == NULL) {
+    fprintf(error_stream(), "could not open batch manifest %s\n", manifest);
+    return RC_OPEN_FAILED;
+  }
+  //read the whole manifest; the command lines point into this text
+  size_t size = 0, cap = 4096;
+  char *text = malloc(cap);
+  size_t got;
+  while (text != NULL && (got = fread(text + size, 1, cap - size - 1, fp)) > 0) {
+    size += got;
+    if (size + 1 == cap) {
+      char *bigger = realloc(text, cap * 2);
+      if (bigger == NULL) {
+	free(text);
       }
-      write_ppm(fp1, change_image);
-      fclose(fp1);
-      free_image(&change_image);
-      return RC_SUCCESS;
+      text = bigger;
+      cap *= 2;
     }
+  }
+  fclose(fp);
+  if (text == NULL) {
+    fprintf(error_stream(), "batch manifest is too large\n");
+    return RC_UNSPECIFIED_ERR;
+  }
+  text[size] = '\0';
 
+  //at most one job per line, and one argument per two characters of it
+  //(plus the program name and the closing NULL of each line)
+  int lines = 1;
+  for (size_t i = 0; i < size; i++) {
+    lines += text[i] == '\n';
+  }
+  BatchJob *jobs = malloc(sizeof(BatchJob) * lines);
+  char **args = malloc(sizeof(char *) * (size / 2 + 3 * (size_t)lines));
+  if (jobs == NULL || args == NULL) {
+    free(text);
+    free(jobs);
+    free(args);
+    return RC_UNSPECIFIED_ERR;
   }
 
-  //applying the rotate function
-  if (strcmp(operation, "rotate-ccw") == 0) {
-    if (argc != 4) {
-      free_image(&change_image);
-      fprintf(stderr, "Invalid number of arguments\n");
-      return RC_INVALID_OP_ARGS;
+  int count = 0;
+  char **arg = args;
+  char *p = text;
+  for (int line = 1; *p != '\0'; line++) {
+    char *eol = strchr(p, '\n');
+    if (eol != NULL) {
+      *eol = '\0';
+    }
+    BatchJob *job = &jobs[count];
+    job->line = line;
+    job->stats = NULL;
+    job->argv = arg;
+    job->argc = 1;
+    *arg++ = "project";
+    for (char *tok = p; *tok != '\0'; ) { //split on whitespace in place
+      while (isspace((unsigned char)*tok)) {
+	*tok++ = '\0';
+      }
+      if (*tok == '\0') {
+	break;
+      }
+      *arg++ = tok;
+      job->argc++;
+      while (*tok != '\0' && !isspace((unsigned char)*tok)) {
+	tok++;
+      }
     }
-    Image rotated_image = rotate_ccw(change_image);
-      
-    if (rotated_image.data == NULL) {
-      fprintf(stderr, "You have not provided a proper ppm_file to be opened");
-      free_image(&rotated_image);
-      return RC_WRITE_FAILED;
+    if (job->argc > 1 && job->argv[1][0] != '#') {
+      job->argv[job->argc] = NULL;
+      arg++;
+      count++;
     }
-      
     else {
-      FILE *fp1 = fopen(argv[2], "wb");
+      arg = job->argv; //blank or comment, reuse its slots
+    }
+    if (eol == NULL) {
+      break;
+    }
+    p = eol + 1;
+  }
 
-      if(fp1 == NULL){
-	fprintf(stderr, "write_ppm failed.\n");
-	free_image(&rotated_image);
-	fprintf(stderr, "failed to write ppm file");
-	return RC_WRITE_FAILED;
-      }
+  //images of the same size come and go, so keep a few buffers per thread
+  Batch batch;
+  batch.jobs = jobs;
+  batch.count = count;
+  batch.next = 0;
+  batch.stats = stats;
+  pthread_mutex_init(&batch.lock, NULL);
+  set_buffer_recycling(4 * get_thread_count());
+  parallel_for(get_thread_count(), batch_worker, &batch);
+  set_buffer_recycling(0);
+  pthread_mutex_destroy(&batch.lock);
 
-      else if (strstr(argv[2], ".ppm") == NULL) {
-	fprintf(stderr, "Output file does not contain '.ppm' extension");
-	fclose(fp1);
-	free_image(&rotated_image);
-	fprintf(stderr, "not a valid ppm file name\n");
-	return RC_WRITE_FAILED;
-      }
-		
-      else {
-	write_ppm(fp1, rotated_image);
-	fclose(fp1);
-	free_image(&rotated_image);
-	return RC_SUCCESS;
+  //report in manifest order, whichever order the jobs finished in
+  int rc = RC_SUCCESS;
+  int failed = 0;
+  for (int i = 0; i < count; i++) {
+    if (jobs[i].stats != NULL) {
+      printf("%s\n", jobs[i].stats);
+      free(jobs[i].stats);
+    }
+    if (jobs[i].rc != RC_SUCCESS) {
+      fprintf(error_stream(), "%s:%d: %s failed with code %d\n", manifest, jobs[i].line, jobs[i].argc > 1 ? jobs[i].argv[1] : "", jobs[i].rc);
+      if (failed++ == 0) {
+	rc = jobs[i].rc;
       }
     }
   }
-
-    
-  else {
-    fprintf(stderr, "Invalid operation\n");
-    free_image(&change_image);
-    return RC_INVALID_OPERATION;
+  if (failed > 0) {
+    fprintf(error_stream(), "%d of %d batch commands failed\n", failed, count);
   }
 
+  free(text);
+  free(jobs);
+  free(args);
+  return rc;
 }
+
+
 void print_usage() {
-  printf("USAGE: ./project <input-image> <output-image> <command-name> <command-args>\n");
+  printf("USAGE: ./project <input-image> <output-image> <command-name> <command-args> [: <command-name> <command-args> ...]\n");
+  printf("   (images are .ppm/.pgm files, or .qoi for the compressed QOI format)\n");
   printf("SUPPORTED COMMANDS:\n");
   printf("   grayscale\n" );
   printf("   blend <target image> <alpha value>\n" );
   printf("   rotate-ccw\n" );
+  printf("   rotate-cw\n" );
+  printf("   rotate-180\n" );
+  printf("   rotate <degrees> [--filter=bilinear|bicubic]\n" );
+  printf("   flip-h\n" );
+  printf("   flip-v\n" );
   printf("   pointilism\n" );
-  printf("   blur <sigma>\n" );
+  printf("   blur <sigma> [--mode=exact|box|iir]\n" );
   printf("   saturate <scale>\n" );
+  printf("   gamma <gamma>\n" );
+  printf("   brightness <offset>\n" );
+  printf("   contrast <factor>\n" );
+  printf("   levels <black> <white> [<gamma>]\n" );
+  printf("   box-blur <radius>\n" );
+  printf("   mean <width> <height>\n" );
+  printf("   convolve <kernel-file>\n" );
+  printf("   invert\n" );
+  printf("   resize <width> <height>\n" );
+  printf("   thumbnail <max-edge>\n" );
+  printf("OPTIONS:\n");
+  printf("   --mem-limit <bytes>[K|M|G]  stream pointwise stages or exact blur\n");
+  printf("                               through memory in bands using at most\n");
+  printf("                               this much\n");
+  printf("   --in-place                  never hold a second copy of the image: run\n");
+  printf("                               the pointwise stages, rotations, flips,\n");
+  printf("                               pointilism and exact blur in its own memory\n");
+  printf("   --layout packed|rgbx|planar  hold the pixels in memory as r,g,b\n");
+  printf("                               triples, padded r,g,b,x or three planes\n");
+  printf("   -j <threads>                run on this many threads (0 = one per CPU);\n");
+  printf("                               defaults to $IMG_THREADS, or 1\n");
+  printf("   --batch <manifest>          run each line of the manifest as a command\n");
+  printf("                               (<input-image> <output-image> <command-name> ...)\n");
+  printf("   --roi <x>,<y>,<w>,<h>       run pointwise and blur stages on\n");
+  printf("                               just this region, reading only its rows, and\n");
+  printf("                               write the region as the output image\n");
+  printf("   --roi-patch                 with --roi, write the whole image instead, with\n");
+  printf("                               only the region changed (in place if the output\n");
+  printf("                               is the input, which must be 8-bit binary PPM)\n");
+  printf("   --serve <socket>            run as a daemon, taking command lines from\n");
+  printf("                               clients on this Unix socket until SIGTERM\n");
+  printf("   --client <socket>           have the daemon run this command line; set\n");
+  printf("                               $IMG_SOCKET instead to use it when it is up\n");
+  printf("   --stats                     print the time, I/O and buffers of each stage\n");
+  printf("                               as a line of JSON (one per command in a batch)\n");
+}
+
+
+/* whether name looks like an image read_ppm can read (.ppm, .pgm or
+ * .pnm) or a QOI file
+ */
+int is_input_name(const char *name) {
+  return strstr(name, ".ppm") != NULL || strstr(name, ".pgm") != NULL || strstr(name, ".pnm") != NULL || is_qoi_name(name);
+}
+
+
+/* whether name looks like an image write_image can write (.ppm or .qoi)
+ */
+int is_output_name(const char *name) {
+  return strstr(name, ".ppm") != NULL || is_qoi_name(name);
+}
+
+
+/* whether name is a QOI file, which is read and written with qoi_io
+ * instead of as a PPM
+ */
+int is_qoi_name(const char *name) {
+  return strstr(name, ".qoi") != NULL;
+}
+
+
+/* parse the name of a --layout; returns 0 if it isn't one
+ */
+int parse_layout(const char *text, Layout *layout) {
+  if (strcmp(text, "packed") == 0) {
+    *layout = LAYOUT_PACKED;
+  }
+  else if (strcmp(text, "rgbx") == 0) {
+    *layout = LAYOUT_RGBX;
+  }
+  else if (strcmp(text, "planar") == 0) {
+    *layout = LAYOUT_PLANAR;
+  }
+  else {
+    return 0;
+  }
+  return 1;
+}
+
+
+/* remove "name value" from the command line if it is there, shifting the
+ * remaining arguments down; returns the value ("" if it is missing) or NULL
+ */
+char* take_option(int *argc, char* argv[], const char *name) {
+  for (int i = 1; i < *argc; i++) {
+    if (strcmp(argv[i], name) == 0) {
+      char *value = i + 1 < *argc ? argv[i + 1] : "";
+      int taken = i + 1 < *argc ? 2 : 1;
+      for (int j = i; j + taken <= *argc; j++) {
+	argv[j] = argv[j + taken];
+      }
+      *argc -= taken;
+      return value;
+    }
+  }
+  return NULL;
+}
+
+
+/* remove the flag name from the command line if it is there, shifting the
+ * remaining arguments down; returns whether it was there
+ */
+int take_flag(int *argc, char* argv[], const char *name) {
+  for (int i = 1; i < *argc; i++) {
+    if (strcmp(argv[i], name) == 0) {
+      for (int j = i; j < *argc; j++) {
+	argv[j] = argv[j + 1];
+      }
+      (*argc)--;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+
+/* argv[1..argc-1] joined by spaces, for labelling --stats output
+ * (malloc'd; NULL if memory runs out)
+ */
+char* command_line(int argc, char* argv[]) {
+  size_t size = 1;
+  for (int i = 1; i < argc; i++) {
+    size += strlen(argv[i]) + 1;
+  }
+  char *text = malloc(size);
+  if (text == NULL) {
+    return NULL;
+  }
+  char *out = text;
+  for (int i = 1; i < argc; i++) {
+    size_t len = strlen(argv[i]);
+    if (i > 1) {
+      *out++ = ' ';
+    }
+    memcpy(out, argv[i], len);
+    out += len;
+  }
+  *out = '\0';
+  return text;
+}
+
+
+/* parse a thread count such as 4, or 0 for one per CPU; returns -1 if invalid
+ */
+int parse_threads(const char *text) {
+  char *end;
+  long value = strtol(text, &end, 10);
+  if (end == text || *end != '\0' || value < 0 || value > 1024) {
+    return -1;
+  }
+  return (int)value;
+}
+
+
+/* parse a byte count such as 65536, 512K, 64M or 2G; returns 0 if invalid
+ */
+size_t parse_size(const char *text) {
+  char *end;
+  double value = strtod(text, &end);
+  if (end == text || value <= 0) {
+    return 0;
+  }
+  if (*end == 'K' || *end == 'k') {
+    value *= 1024.0;
+    end++;
+  }
+  else if (*end == 'M' || *end == 'm') {
+    value *= 1024.0 * 1024.0;
+    end++;
+  }
+  else if (*end == 'G' || *end == 'g') {
+    value *= 1024.0 * 1024.0 * 1024.0;
+    end++;
+  }
+  if (*end != '\0') {
+    return 0;
+  }
+  return (size_t)value;
+}
+
+
+/* run a pipeline of grayscale/saturate stages, or a single (exact) blur, on
+ * in_name a band of rows at a time, so that no more than about limit bytes of
+ * image data are held in memory no matter how tall the image is. Blur keeps
+ * blur_halo(sigma) rows of context above and below each band.
+ * Returns one of the RC_* codes.
+ */
+int stream_operation(const char *in_name, const char *out_name, const Stage stages[], int count, size_t limit) {
+  PointOp ops[MAX_STAGES];
+  int nops = 0;
+  int is_blur = 0;
+  double sigma = 0;
+  for (int i = 0; i < count; i++) {
+    if (is_pointwise(&stages[i])) {
+      ops[nops++] = point_op(&stages[i]);
+    }
+    //only the exact blur is row-local, so a blur that runs another engine
+    //(including the default from BLUR_AUTO_SIGMA up) can't be streamed
+    else if (count == 1 && strcmp(stages[i].name, "blur") == 0 && blur_stage_engine(&stages[i]) == BLUR_EXACT) {
+      sigma = atof(stages[i].args[0]);
+      is_blur = sigma != 0;
+    }
+    else if (strcmp(stages[i].name, "blur") == 0 && count == 1) {
+      fprintf(error_stream(), "only the exact blur can be run with --mem-limit (without --mode, blur uses the box engine from sigma %g; add --mode=exact)\n", BLUR_AUTO_SIGMA);
+      return RC_INVALID_OP_ARGS;
+    }
+    else {
+      fprintf(error_stream(), "%s can't be run with --mem-limit\n", stages[i].name);
+      return RC_INVALID_OP_ARGS;
+    }
+  }
+  //QOI chunks can't be read or written a band at a time from a PPM's rows
+  if (is_qoi_name(in_name) || is_qoi_name(out_name)) {
+    fprintf(error_stream(), "--mem-limit needs PPM input and output files\n");
+    return RC_INVALID_OP_ARGS;
+  }
+
+  FILE *in = fopen(in_name, "rb");
+  if (in == NULL) {
+    fprintf(error_stream(), "invalid file entered\n");
+    return RC_OPEN_FAILED;
+  }
+  PpmHeader header;
+  if (read_ppm_info(in, &header) != 0) {
+    fprintf(error_stream(), "the file you have inputed contains incorrect image data");
+    fclose(in);
+    return RC_INVALID_PPM;
+  }
+  int rows = header.rows, cols = header.cols;
+
+  //pick the band height: blur needs the window, its float copy and the output band
+  size_t row_bytes = sizeof(Pixel) * cols;
+  int halo = is_blur ? blur_halo(sigma) : 0;
+  long long band;
+  if (is_blur) {
+    size_t fixed = 2 * (size_t)halo * row_bytes * 5 + row_bytes * 4;
+    band = limit > fixed ? (long long)((limit - fixed) / (row_bytes * 6)) : 0;
+  }
+  else {
+    band = (long long)(limit / row_bytes);
+  }
+  if (band < 1) {
+    fprintf(error_stream(), "memory limit is too small for this image\n");
+    fclose(in);
+    return RC_OP_ARGS_RANGE_ERR;
+  }
+  if (band > rows) {
+    band = rows;
+  }
+
+  int window_rows = (int)band + (is_blur ? 2 * halo : 0);
+  if (window_rows > rows) {
+    window_rows = rows;
+  }
+  Pixel *window = malloc(row_bytes * window_rows);
+  Pixel *out = is_blur ? malloc(row_bytes * band) : window;
+  PpmDecoder *decoder = start_ppm_decoder(&header); //set up once for all the bands
+  if (window == NULL || out == NULL || decoder == NULL) {
+    fprintf(error_stream(), "could not allocate the band buffers\n");
+    free(window);
+    if (is_blur) {
+      free(out);
+    }
+    stop_ppm_decoder(decoder);
+    fclose(in);
+    return RC_UNSPECIFIED_ERR;
+  }
+
+  FILE *fp = fopen(out_name, "wb");
+  if (fp == NULL) {
+    fprintf(error_stream(), "write_ppm failed.\n");
+    free(window);
+    if (is_blur) {
+      free(out);
+    }
+    stop_ppm_decoder(decoder);
+    fclose(in);
+    return RC_WRITE_FAILED;
+  }
+
+  int rc = RC_SUCCESS;
+  if (write_ppm_header(fp, rows, cols) != 0) {
+    rc = RC_WRITE_FAILED;
+  }
+  int window_row = 0; //first image row held in window
+  int loaded = 0; //number of rows in window
+  for (int row = 0; row < rows && rc == RC_SUCCESS; row += (int)band) {
+    int count = rows - row < band ? rows - row : (int)band;
+    int need_first = row - halo < 0 ? 0 : row - halo;
+    int need_last = row + count + halo > rows ? rows : row + count + halo;
+
+    //slide the rows still needed to the front of the window and read the rest
+    if (need_first > window_row) {
+      int keep = window_row + loaded - need_first;
+      if (keep > 0) {
+	memmove(window, window + (size_t)(need_first - window_row) * cols, row_bytes * keep);
+      }
+      loaded = keep > 0 ? keep : 0;
+      window_row = need_first;
+    }
+    int wanted = need_last - window_row - loaded;
+    if (wanted > 0) {
+      StatsMark t = stats_begin();
+      int got = read_ppm_pixels(in, &header, decoder, window + (size_t)loaded * cols, wanted);
+      stats_end("read", t);
+      if (got != wanted) {
+	fprintf(error_stream(), "Error:ppm_io - failed to read data from file!\n");
+	rc = RC_INVALID_PPM;
+	break;
+      }
+      loaded += wanted;
+    }
+
+    Image band_image = { window, loaded, cols, NULL, 0, LAYOUT_PACKED, sizeof(Pixel) * cols };
+    StatsMark t = stats_begin();
+    if (is_blur) {
+      Image out_image = { out, count, cols, NULL, 0, LAYOUT_PACKED, sizeof(Pixel) * cols };
+      if (blur_band(band_image, window_row, rows, sigma, out_image, row) != 0) {
+	rc = RC_UNSPECIFIED_ERR;
+	break;
+      }
+    }
+    else if (nops > 0) {
+      apply_pointwise(band_image, ops, nops);
+    }
+    //a zero sigma blur leaves the image as it is
+    stats_end(is_blur ? "blur" : "pointwise", t);
+
+    t = stats_begin();
+    if (write_ppm_rows(fp, out, cols, count) != count) {
+      rc = RC_WRITE_FAILED;
+    }
+    stats_end("write", t);
+  }
+
+  if (stats_enabled) {
+    long in_pos = ftell(in), out_pos = ftell(fp);
+    stats_add_io((size_t)(in_pos > 0 ? in_pos : 0), (size_t)(out_pos > 0 ? out_pos : 0));
+  }
+
+  if (fclose(fp) != 0 && rc == RC_SUCCESS) {
+    rc = RC_WRITE_FAILED;
+  }
+  fclose(in);
+  free(window);
+  if (is_blur) {
+    free(out);
+  }
+  stop_ppm_decoder(decoder);
+  return rc;
+}
+
+
+/* parse the x,y,width,height of a --roi; returns 0 if it isn't one
+ */
+int parse_roi(const char *text, int roi[4]) {
+  const char *p = text;
+  for (int i = 0; i < 4; i++) {
+    char *end;
+    long value = strtol(p, &end, 10);
+    if (end == p || value < 0 || value > 1 << 30 || *end != (i < 3 ? ',' : '\0')) {
+      return 0;
+    }
+    roi[i] = (int)value;
+    p = end + 1;
+  }
+  return roi[2] > 0 && roi[3] > 0;
+}
+
+
+/* copy the file in_name to out_name, unless they are the same file;
+ * adds the bytes copied to *bytes. Returns one of the RC_* codes.
+ */
+int copy_file(const char *in_name, const char *out_name, size_t *bytes) {
+  struct stat in_st, out_st;
+  if (stat(in_name, &in_st) != 0) {
+    fprintf(error_stream(), "invalid file entered\n");
+    return RC_OPEN_FAILED;
+  }
+  if (stat(out_name, &out_st) == 0 && in_st.st_dev == out_st.st_dev && in_st.st_ino == out_st.st_ino) {
+    return RC_SUCCESS; //patching the input itself
+  }
+  FILE *in = fopen(in_name, "rb");
+  FILE *out = fopen(out_name, "wb");
+  int rc = in == NULL ? RC_OPEN_FAILED : out == NULL ? RC_WRITE_FAILED : RC_SUCCESS;
+  char *buf = rc == RC_SUCCESS ? malloc(1 << 20) : NULL;
+  if (rc == RC_SUCCESS && buf == NULL) {
+    rc = RC_UNSPECIFIED_ERR;
+  }
+  size_t got;
+  while (rc == RC_SUCCESS && (got = fread(buf, 1, 1 << 20, in)) > 0) {
+    if (fwrite(buf, 1, got, out) != got) {
+      rc = RC_WRITE_FAILED;
+    }
+    *bytes += got;
+  }
+  if (rc == RC_SUCCESS && ferror(in)) {
+    rc = RC_INVALID_PPM;
+  }
+  free(buf);
+  if (in != NULL) {
+    fclose(in);
+  }
+  if (out != NULL && fclose(out) != 0 && rc == RC_SUCCESS) {
+    rc = RC_WRITE_FAILED;
+  }
+  if (rc != RC_SUCCESS) {
+    fprintf(error_stream(), "could not copy %s to %s\n", in_name, out_name);
+  }
+  return rc;
+}
+
+
+/* run a pipeline of pointwise and exact blur stages (the blurs whose
+ * engine resolves to BLUR_EXACT; others are refused) on the region
+ * roi = x, y, width, height of in_name, giving the same pixels as running
+ * it on the whole image and cropping. Only the region's rows and the
+ * blur_halo rows each blur needs above and below are read, seeking past
+ * the rest. The output is the region alone, or with patch the whole input
+ * with the region overwritten (in place with positional writes when
+ * out_name is in_name). Returns one of the RC_* codes.
+ */
+int roi_operation(const char *in_name, const char *out_name, const Stage stages[], int count, const int roi[4], int patch) {
+  int x = roi[0], y = roi[1], w = roi[2], h = roi[3];
+  int halo = 0; //rows the blurs need beyond the region, all together
+  for (int i = 0; i < count; i++) {
+    //only the exact blur is local, like with --mem-limit; one that would
+    //run another engine on the whole image would give other pixels
+    if (strcmp(stages[i].name, "blur") == 0 && blur_stage_engine(&stages[i]) == BLUR_EXACT) {
+      double sigma = atof(stages[i].args[0]);
+      halo += sigma != 0 ? blur_halo(sigma) : 0;
+    }
+    else if (strcmp(stages[i].name, "blur") == 0) {
+      fprintf(error_stream(), "only the exact blur can be run with --roi (without --mode, blur uses the box engine from sigma %g; add --mode=exact)\n", BLUR_AUTO_SIGMA);
+      return RC_INVALID_OP_ARGS;
+    }
+    else if (!is_pointwise(&stages[i])) {
+      fprintf(error_stream(), "%s can't be run with --roi\n", stages[i].name);
+      return RC_INVALID_OP_ARGS;
+    }
+  }
+  //rows of a QOI file can't be skipped, and only a PPM can be patched
+  if (is_qoi_name(in_name) || (patch && is_qoi_name(out_name))) {
+    fprintf(error_stream(), "--roi needs a PPM input (and output with --roi-patch)\n");
+    return RC_INVALID_OP_ARGS;
+  }
+
+  FILE *in = fopen(in_name, "rb");
+  if (in == NULL) {
+    fprintf(error_stream(), "invalid file entered\n");
+    return RC_OPEN_FAILED;
+  }
+  PpmHeader header;
+  if (read_ppm_info(in, &header) != 0) {
+    fprintf(error_stream(), "the file you have inputed contains incorrect image data");
+    fclose(in);
+    return RC_INVALID_PPM;
+  }
+  int rows = header.rows, cols = header.cols;
+  //compared as differences, since the sums can pass INT_MAX
+  if (w > cols - x || h > rows - y) {
+    fprintf(error_stream(), "the region doesn't fit in the %dx%d image\n", cols, rows);
+    fclose(in);
+    return RC_OP_ARGS_RANGE_ERR;
+  }
+  if (patch && (header.format != 6 || header.maxval != 255)) {
+    fprintf(error_stream(), "--roi-patch needs an 8-bit binary PPM input\n");
+    fclose(in);
+    return RC_INVALID_PPM;
+  }
+
+  //the window holds image rows window_row on; blurs ping-pong with spare
+  int window_row = y - halo < 0 ? 0 : y - halo;
+  int window_rows = (halo > rows - (y + h) ? rows : y + h + halo) - window_row;
+  size_t row_bytes = sizeof(Pixel) * cols;
+  Pixel *window = malloc(row_bytes * window_rows);
+  Pixel *spare = halo > 0 ? malloc(row_bytes * window_rows) : NULL;
+  if (window == NULL || (halo > 0 && spare == NULL)) {
+    fprintf(error_stream(), "could not allocate the region buffers\n");
+    free(window);
+    free(spare);
+    fclose(in);
+    return RC_UNSPECIFIED_ERR;
+  }
+
+  StatsMark t = stats_begin();
+  long header_end = ftell(in);
+  int rc = RC_SUCCESS;
+  if (skip_ppm_rows(in, &header, window_row) != 0) {
+    rc = RC_INVALID_PPM;
+  }
+  long rows_start = ftell(in);
+  if (rc == RC_SUCCESS && read_ppm_pixels(in, &header, NULL, window, window_rows) != window_rows) {
+    rc = RC_INVALID_PPM;
+  }
+  stats_end("read", t);
+  if (stats_enabled) {
+    long rows_end = ftell(in);
+    stats_add_io((size_t)(header_end > 0 && rows_end > rows_start ? header_end + rows_end - rows_start : 0), 0);
+  }
+  fclose(in);
+  if (rc != RC_SUCCESS) {
+    fprintf(error_stream(), "Error:ppm_io - failed to read data from file!\n");
+  }
+
+  //each blur shrinks the window by its halo, except at the image edges
+  for (int i = 0; i < count && rc == RC_SUCCESS; i++) {
+    Image band = { window, window_rows, cols, NULL, 0, LAYOUT_PACKED, row_bytes };
+    t = stats_begin();
+    if (is_pointwise(&stages[i])) {
+      PointOp op = point_op(&stages[i]);
+      apply_pointwise(band, &op, 1);
+    }
+    else if (atof(stages[i].args[0]) != 0) {
+      double sigma = atof(stages[i].args[0]);
+      int half = blur_halo(sigma);
+      int first = window_row == 0 ? 0 : window_row + half;
+      int last = window_row + window_rows == rows ? rows : window_row + window_rows - half;
+      Image out = { spare, last - first, cols, NULL, 0, LAYOUT_PACKED, row_bytes };
+      if (blur_band(band, window_row, rows, sigma, out, first) != 0) {
+	rc = RC_UNSPECIFIED_ERR;
+      }
+      Pixel *swap = window;
+      window = spare;
+      spare = swap;
+      window_row = first;
+      window_rows = last - first;
+    }
+    stats_end(stages[i].name, t);
+  }
+
+  //the region, as a view into the window
+  Image region = { window + (size_t)(y - window_row) * cols + x, h, w, NULL, 0, LAYOUT_PACKED, row_bytes };
+  t = stats_begin();
+  if (rc == RC_SUCCESS && patch) {
+    size_t copied = 0;
+    rc = copy_file(in_name, out_name, &copied);
+    FILE *fp = rc == RC_SUCCESS ? fopen(out_name, "r+b") : NULL;
+    if (rc == RC_SUCCESS && (fp == NULL || patch_ppm(fp, region, x, y) != 0)) {
+      fprintf(error_stream(), "write_ppm failed.\n");
+      rc = RC_WRITE_FAILED;
+    }
+    if (fp != NULL && fclose(fp) != 0 && rc == RC_SUCCESS) {
+      rc = RC_WRITE_FAILED;
+    }
+    if (stats_enabled) {
+      stats_add_io(copied, copied + sizeof(Pixel) * w * h);
+    }
+  }
+  else if (rc == RC_SUCCESS) {
+    //pack the region's rows to the front of the window, then write them
+    for (int i = 0; i < h; i++) {
+      memmove(window + (size_t)i * w, image_row(region, i).chan[0], sizeof(Pixel) * w);
+    }
+    Image cropped = { window, h, w, NULL, 0, LAYOUT_PACKED, sizeof(Pixel) * w };
+    rc = write_image(out_name, cropped);
+  }
+  if (patch) {
+    stats_end("write", t);
+  }
+
+  free(window);
+  free(spare);
+  return rc;
 }
@@ -0,0 +1,363 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "qoi_io.h"
+#include "ppm_io.h"
+
+
+/* the chunk tags; RGB and RGBA are whole bytes, the rest the top 2 bits */
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF  0x40
+#define QOI_OP_LUMA  0x80
+#define QOI_OP_RUN   0xc0
+#define QOI_OP_RGB   0xfe
+#define QOI_OP_RGBA  0xff
+#define QOI_MASK     0xc0
+
+/* bytes in the header, and in the end marker (7 zeros and a one) */
+#define QOI_HEADER 14
+#define QOI_END 8
+
+/* longest run one chunk can code (62 and 63 would look like RGB/RGBA) */
+#define QOI_RUN_MAX 62
+
+/* bytes read from the file at a time while decoding */
+#define QOI_CHUNK 65536
+
+/* a difference between two samples, wrapped into -128 to 127 */
+#define QOI_WRAP(d) ((((int)(d) + 128) & 255) - 128)
+
+/* a pixel as one number, r in the low byte and alpha in the high one */
+#define QOI_PACK(r, g, b, a) ((unsigned int)(r) | (unsigned int)(g) << 8 | (unsigned int)(b) << 16 | (unsigned int)(a) << 24)
+
+/* where a color goes in the index of recently seen colors */
+#define QOI_HASH(r, g, b, a) (((r) * 3 + (g) * 5 + (b) * 7 + (a) * 11) & 63)
+
+/* what the encoder and decoder both keep track of between rows: the
+ * previous pixel, a run of it still to be written or handed out, and the
+ * index of the 64 colors seen most recently (all packed) */
+typedef struct {
+  unsigned int prev;
+  int run;
+  unsigned int index[64];
+} QoiState;
+
+/* the decoder's window on the file */
+typedef struct {
+  FILE *fp;
+  unsigned char *buf;
+  size_t pos;
+  size_t len;
+} QoiReader;
+
+
+/* Helper function for read_qoi_layout and write_qoi
+ * the state at the start of an image: the previous pixel is opaque black
+ * and the index is empty
+ */
+static void startState(QoiState *s) {
+  memset(s, 0, sizeof(*s));
+  s->prev = QOI_PACK(0, 0, 0, 255);
+}
+
+/* Helper function for read_qoi_layout
+ * a big-endian 32-bit number
+ */
+static unsigned long getLong(const unsigned char *p) {
+  return (unsigned long)p[0] << 24 | (unsigned long)p[1] << 16 | (unsigned long)p[2] << 8 | p[3];
+}
+
+/* Helper function for write_qoi
+ * store a big-endian 32-bit number
+ */
+static void putLong(unsigned char *p, unsigned long v) {
+  p[0] = (unsigned char)(v >> 24);
+  p[1] = (unsigned char)(v >> 16);
+  p[2] = (unsigned char)(v >> 8);
+  p[3] = (unsigned char)v;
+}
+
+/* Helper function for decodeRow
+ * make sure at least want bytes are in the window, keeping the ones not
+ * used yet; returns 0, or -1 if the file ends first
+ */
+static int fillReader(QoiReader *in, size_t want) {
+  if (in->len - in->pos >= want) {
+    return 0;
+  }
+  memmove(in->buf, in->buf + in->pos, in->len - in->pos);
+  in->len -= in->pos;
+  in->pos = 0;
+  in->len += fread(in->buf + in->len, 1, QOI_CHUNK - in->len, in->fp);
+  return in->len >= want ? 0 : -1;
+}
+
+/* Helper function for decodeRow
+ * decode the next count pixels into dst, whose pixels are step apart; returns 0, or -1 if the file
+ * ends first. Every chunk is at most 5 bytes and the end marker follows
+ * the last one, so a good file always has 5 bytes left before a chunk.
+ * The state is worked on in locals, which the stores to dst can't alias.
+ */
+static inline int decodePixels(QoiReader *in, QoiState *s, PixelSpan dst, int step, int count) {
+  unsigned int index[64];
+  memcpy(index, s->index, sizeof(index));
+  unsigned int px = s->prev;
+  int run = s->run;
+  const unsigned char *p = in->buf + in->pos;
+  size_t left = in->len - in->pos; //bytes in the window from p on
+  int rc = 0;
+  for (int i = 0; i < count; i++) {
+    if (run > 0) {
+      run--;
+    }
+    else {
+      if (left < 5) {
+	in->pos = (size_t)(p - in->buf);
+	if (fillReader(in, 5) != 0) {
+	  rc = -1;
+	  break;
+	}
+	p = in->buf + in->pos;
+	left = in->len - in->pos;
+      }
+      const unsigned char *chunk = p;
+      int tag = *p++;
+      if (tag < QOI_OP_DIFF) {
+	px = index[tag];
+	left--;
+	dst.chan[0][i * step] = (unsigned char)px;
+	dst.chan[1][i * step] = (unsigned char)(px >> 8);
+	dst.chan[2][i * step] = (unsigned char)(px >> 16);
+	continue; //already in the index
+      }
+      if (tag < QOI_OP_LUMA) {
+	int r = (int)(px & 255) + ((tag >> 4) & 3) - 2;
+	int g = (int)(px >> 8 & 255) + ((tag >> 2) & 3) - 2;
+	int b = (int)(px >> 16 & 255) + (tag & 3) - 2;
+	px = QOI_PACK(r & 255, g & 255, b & 255, px >> 24);
+      }
+      else if (tag < QOI_OP_RUN) {
+	int vg = (tag & 0x3f) - 32;
+	int r = (int)(px & 255) + vg - 8 + (*p >> 4);
+	int g = (int)(px >> 8 & 255) + vg;
+	int b = (int)(px >> 16 & 255) + vg - 8 + (*p & 15);
+	p++;
+	px = QOI_PACK(r & 255, g & 255, b & 255, px >> 24);
+      }
+      else if (tag == QOI_OP_RGB) {
+	px = QOI_PACK(p[0], p[1], p[2], px >> 24);
+	p += 3;
+      }
+      else if (tag == QOI_OP_RGBA) {
+	px = QOI_PACK(p[0], p[1], p[2], p[3]);
+	p += 4;
+      }
+      else { //a run, this pixel being the first of it
+	run = tag & 0x3f;
+      }
+      index[QOI_HASH(px & 255, px >> 8 & 255, px >> 16 & 255, px >> 24)] = px;
+      left -= (size_t)(p - chunk);
+    }
+    dst.chan[0][i * step] = (unsigned char)px;
+    dst.chan[1][i * step] = (unsigned char)(px >> 8);
+    dst.chan[2][i * step] = (unsigned char)(px >> 16);
+  }
+  in->pos = (size_t)(p - in->buf);
+  memcpy(s->index, index, sizeof(index));
+  s->prev = px;
+  s->run = run;
+  return rc;
+}
+
+/* decodePixels with the step of each layout known at compile time */
+static int decodeRow(QoiReader *in, QoiState *s, PixelSpan dst, int count) {
+  switch (dst.step) {
+  case 3:
+    return decodePixels(in, s, dst, 3, count);
+  case 4:
+    return decodePixels(in, s, dst, 4, count);
+  default:
+    return decodePixels(in, s, dst, 1, count);
+  }
+}
+
+/* Helper function for encodeRow
+ * code the count pixels of src, which are step apart, into out, leaving a
+ * run that reaches the end of the row open for the next one; returns the
+ * end of what was written, at most 4 bytes per pixel plus the run before
+ * the first
+ */
+static inline unsigned char* encodePixels(QoiState *s, PixelSpan src, int step, int count, unsigned char *out) {
+  unsigned int index[64];
+  memcpy(index, s->index, sizeof(index));
+  unsigned int prev = s->prev;
+  int run = s->run;
+  for (int i = 0; i < count; i++) {
+    unsigned int r = src.chan[0][i * step], g = src.chan[1][i * step], b = src.chan[2][i * step];
+    unsigned int px = QOI_PACK(r, g, b, 255);
+    if (px == prev) {
+      if (++run == QOI_RUN_MAX) {
+	*out++ = (unsigned char)(QOI_OP_RUN | (run - 1));
+	run = 0;
+      }
+      continue;
+    }
+    if (run > 0) {
+      *out++ = (unsigned char)(QOI_OP_RUN | (run - 1));
+      run = 0;
+    }
+    unsigned int h = QOI_HASH(r, g, b, 255u);
+    if (index[h] == px) {
+      *out++ = (unsigned char)(QOI_OP_INDEX | h);
+    }
+    else {
+      index[h] = px;
+      int vr = QOI_WRAP(r - (prev & 255)), vg = QOI_WRAP(g - (prev >> 8 & 255)), vb = QOI_WRAP(b - (prev >> 16 & 255));
+      int vg_r = vr - vg, vg_b = vb - vg;
+      if ((unsigned)(vr + 2) < 4 && (unsigned)(vg + 2) < 4 && (unsigned)(vb + 2) < 4) {
+	*out++ = (unsigned char)(QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2));
+      }
+      else if ((unsigned)(vg + 32) < 64 && (unsigned)(vg_r + 8) < 16 && (unsigned)(vg_b + 8) < 16) {
+	out[0] = (unsigned char)(QOI_OP_LUMA | (vg + 32));
+	out[1] = (unsigned char)((vg_r + 8) << 4 | (vg_b + 8));
+	out += 2;
+      }
+      else {
+	out[0] = QOI_OP_RGB;
+	out[1] = (unsigned char)r;
+	out[2] = (unsigned char)g;
+	out[3] = (unsigned char)b;
+	out += 4;
+      }
+    }
+    prev = px;
+  }
+  memcpy(s->index, index, sizeof(index));
+  s->prev = prev;
+  s->run = run;
+  return out;
+}
+
+/* encodePixels with the step of each layout known at compile time */
+static unsigned char* encodeRow(QoiState *s, PixelSpan src, int count, unsigned char *out) {
+  switch (src.step) {
+  case 3:
+    return encodePixels(s, src, 3, count, out);
+  case 4:
+    return encodePixels(s, src, 4, count, out);
+  default:
+    return encodePixels(s, src, 1, count, out);
+  }
+}
+
+
+Image read_qoi( FILE *fp ) {
+  return read_qoi_layout( fp , LAYOUT_PACKED );
+}
+
+
+Image read_qoi_layout( FILE *fp , Layout layout ) {
+  Image im = { NULL , 0 , 0 , NULL , 0 , LAYOUT_PACKED , 0 };
+
+  unsigned char header[QOI_HEADER];
+  if( fread( header , 1 , QOI_HEADER , fp ) != QOI_HEADER || memcmp( header , "qoif" , 4 ) != 0 ) {
+    fprintf( error_stream() , "Error:qoi_io - not a QOI file (bad tag)\n" );
+    return im;
+  }
+  unsigned long cols = getLong( header + 4 ) , rows = getLong( header + 8 );
+  if( cols == 0 || rows == 0 || cols > INT_MAX || rows > INT_MAX || ( header[12] != 3 && header[12] != 4 ) || header[13] > 1 ) {
+    fprintf( error_stream() , "Error:qoi_io - QOI file with a bad header\n" );
+    return im;
+  }
+
+  im = make_image_uninit( (int)rows , (int)cols , layout );
+  QoiReader in = { fp , malloc( QOI_CHUNK ) , 0 , 0 };
+  //16-bit images are decoded a row at a time and widened into place
+  Pixel *narrow = layout == LAYOUT_RGB16 ? malloc( sizeof(Pixel) * cols ) : NULL;
+  if( !im.data || in.buf == NULL || ( layout == LAYOUT_RGB16 && narrow == NULL ) ) {
+    fprintf( error_stream() , "Error:qoi_io - Could not allocate new image\n" );
+    free( in.buf );
+    free( narrow );
+    free_image( &im );
+    return im;
+  }
+
+  QoiState s;
+  startState( &s );
+  Image packed = { narrow , 1 , (int)cols , NULL , 0 , LAYOUT_PACKED , sizeof(Pixel) * cols };
+  int row = 0;
+  while( row < im.rows && decodeRow( &in , &s , narrow != NULL ? image_row( packed , 0 ) : image_row( im , row ) , im.cols ) == 0 ) {
+    if( narrow != NULL ) {
+      unsigned short *dst = (unsigned short *)( (unsigned char *)im.data + im.stride * row );
+      for( int i = 0; i < im.cols; i++ ) {
+	dst[3 * i] = (unsigned short)( narrow[i].r * 257 );
+	dst[3 * i + 1] = (unsigned short)( narrow[i].g * 257 );
+	dst[3 * i + 2] = (unsigned short)( narrow[i].b * 257 );
+      }
+    }
+    row++;
+  }
+  free( narrow );
+  free( in.buf );
+  if( row < im.rows ) {
+    fprintf( error_stream() , "Error:qoi_io - failed to read data from file!\n" );
+    free_image( &im );
+  }
+  return im;
+}
+
+
+int write_qoi( FILE *fp , const Image img ) {
+  unsigned char header[QOI_HEADER] = { 'q' , 'o' , 'i' , 'f' };
+  putLong( header + 4 , (unsigned long)img.cols );
+  putLong( header + 8 , (unsigned long)img.rows );
+  header[12] = 3; // rgb
+  header[13] = 0; // srgb
+  static const unsigned char end[QOI_END] = { 0 , 0 , 0 , 0 , 0 , 0 , 0 , 1 };
+
+  //a row codes to at most 4 bytes a pixel, plus a run before and after
+  unsigned char *out = malloc( (size_t)4 * img.cols + 2 );
+  Pixel *narrow = img.layout == LAYOUT_RGB16 ? malloc( sizeof(Pixel) * img.cols ) : NULL;
+  if( out == NULL || ( img.layout == LAYOUT_RGB16 && narrow == NULL ) ) {
+    free( out );
+    free( narrow );
+    return 0;
+  }
+  int row = 0; // rows written in full
+  if( fwrite( header , 1 , QOI_HEADER , fp ) != QOI_HEADER ) {
+    row = -1;
+  }
+
+  QoiState s;
+  startState( &s );
+  Image packed = { narrow , 1 , img.cols , NULL , 0 , LAYOUT_PACKED , sizeof(Pixel) * img.cols };
+  for( ; row >= 0 && row < img.rows; row++ ) {
+    PixelSpan src;
+    if( narrow != NULL ) { //narrow, rounding v / 257 like copy_layout
+      const unsigned short *wide = (const unsigned short *)( (const unsigned char *)img.data + img.stride * row );
+      for( int i = 0; i < img.cols; i++ ) {
+	narrow[i].r = (unsigned char)( ( wide[3 * i] + 128 ) / 257 );
+	narrow[i].g = (unsigned char)( ( wide[3 * i + 1] + 128 ) / 257 );
+	narrow[i].b = (unsigned char)( ( wide[3 * i + 2] + 128 ) / 257 );
+      }
+      src = image_row( packed , 0 );
+    }
+    else {
+      src = image_row( img , row );
+    }
+    unsigned char *stop = encodeRow( &s , src , img.cols , out );
+    if( row == img.rows - 1 && s.run > 0 ) {
+      *stop++ = (unsigned char)( QOI_OP_RUN | ( s.run - 1 ) );
+    }
+    if( fwrite( out , 1 , (size_t)( stop - out ) , fp ) != (size_t)( stop - out ) ) {
+      break; //a short write, reported like write_ppm does
+    }
+  }
+  if( row == img.rows && fwrite( end , 1 , QOI_END , fp ) != QOI_END ) {
+    row = 0; //without its end marker the file is no good
+  }
+  free( out );
+  free( narrow );
+  return row > 0 ? row * img.cols : 0;
+}
@@ -0,0 +1,42 @@
+#ifndef QOI_IO_H
+#define QOI_IO_H
+
+#include <stdio.h>
+#include "ppm_io.h"
+
+
+/////////////////////////////////////////////////////////
+// Reading and writing QOI files ("Quite OK Image"), a //
+// fast lossless format, as an alternative to PPM      //
+/////////////////////////////////////////////////////////
+
+/* A QOI file is a 14-byte header ("qoif", width and height as big-endian
+ * 32-bit numbers, channels and colorspace bytes) followed by the pixels
+ * in row-major order, each coded as a run of the previous pixel, an index
+ * into the 64 most recently seen colors, a small difference from the
+ * previous pixel, or in full, and an 8-byte end marker. Photographs
+ * usually come out at a third to a half of the size of a binary PPM, and
+ * both directions are a single pass over the pixels. */
+
+//______read_qoi______
+/* read a QOI file into a packed image (assumes fp != NULL); files with an
+ * alpha channel are accepted and the alpha dropped. On a bad or truncated
+ * file the result has NULL data.
+*/
+Image read_qoi( FILE * fp );
+
+//______read_qoi_layout______
+/* read_qoi straight into the given layout; LAYOUT_RGB16 gets the 8-bit
+ * samples scaled to 0-65535
+*/
+Image read_qoi_layout( FILE * fp , Layout layout );
+
+//______write_qoi______
+/* write an image of any layout to a file as a 3-channel QOI (assumes
+ * fp != NULL); LAYOUT_RGB16 images are reduced to 8 bits first. Returns
+ * the number of pixels written, fewer if a write came up short (0 if it
+ * was the header or the end marker, or a buffer couldn't be allocated).
+*/
+int write_qoi( FILE * fp , const Image img );
+
+#endif
@@ -0,0 +1,341 @@
+#define _GNU_SOURCE // unshare(CLONE_FS), so each job can have its own working directory
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "serve.h"
+#include "ppm_io.h"
+#include "thread_pool.h"
+
+
+/* largest request (working directory and arguments) a job can be */
+#define REQUEST_MAX 65536
+
+/* most arguments a job can have */
+#define REQUEST_ARGS 256
+
+/* the connections being served */
+static JobFunc job_run;
+static int job_failed_rc;
+static int active = 0; // jobs running
+static int active_max = 1;
+static pthread_mutex_t active_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t active_done = PTHREAD_COND_INITIALIZER;
+static volatile sig_atomic_t stop_serving = 0;
+
+
+/* Helper function for serve_jobs
+ * SIGINT/SIGTERM handler
+ */
+static void stopSignal(int sig) {
+  (void)sig;
+  stop_serving = 1;
+}
+
+/* Helper function for serve_jobs
+ * nothing, run on every thread to start the pool
+ */
+static void warmUp(void *arg, int begin, int end) {
+  (void)arg;
+  (void)begin;
+  (void)end;
+}
+
+/* Helper function for serve_jobs and send_job
+ * send all of buf, without dying of SIGPIPE if the other side is gone;
+ * returns 0, or -1 on error
+ */
+static int sendAll(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t put = send(fd, buf, len, MSG_NOSIGNAL);
+    if (put < 0 && errno == EINTR) {
+      continue;
+    }
+    if (put <= 0) {
+      return -1;
+    }
+    buf += put;
+    len -= (size_t)put;
+  }
+  return 0;
+}
+
+/* Helper function for serve_jobs and send_job
+ * read from fd until the other side stops sending, up to max bytes (plus
+ * a terminating NUL); returns the malloc'd bytes and sets *len, or NULL
+ * on error or if there were more than max
+ */
+static char* readAll(int fd, size_t max, size_t *len) {
+  size_t size = 0, cap = 4096;
+  char *buf = malloc(cap + 1);
+  while (buf != NULL) {
+    if (size == cap) {
+      if (cap >= max) {
+	free(buf);
+	return NULL;
+      }
+      cap = cap * 2 < max ? cap * 2 : max;
+      char *bigger = realloc(buf, cap + 1);
+      if (bigger == NULL) {
+	free(buf);
+	return NULL;
+      }
+      buf = bigger;
+    }
+    ssize_t got = recv(fd, buf + size, cap - size, 0);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got < 0) {
+      free(buf);
+      return NULL;
+    }
+    if (got == 0) {
+      buf[size] = '\0';
+      *len = size;
+      return buf;
+    }
+    size += (size_t)got;
+  }
+  return NULL;
+}
+
+/* Helper function for serve_jobs and send_job
+ * fill in the address of the socket at path; returns -1 if it is too long
+ */
+static int socketAddress(const char *path, struct sockaddr_un *addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr->sun_path)) {
+    return -1;
+  }
+  strcpy(addr->sun_path, path);
+  return 0;
+}
+
+/* Helper function for serve_jobs
+ * serve one connection: the request is the client's working directory and
+ * then the arguments, each ending in a NUL, up to the end of the stream;
+ * the reply is a line with the status code and the length of the job's
+ * error messages, then those messages and then the job's output
+ */
+static void* serveConnection(void *arg) {
+  int fd = (int)(long)arg;
+  size_t len;
+  char *request = readAll(fd, REQUEST_MAX, &len);
+  char *argv[REQUEST_ARGS + 2];
+  int argc = 0;
+  if (request != NULL && len > 0 && request[len - 1] == '\0') {
+    argv[argc++] = "project";
+    for (size_t i = strlen(request) + 1; i < len && argc <= REQUEST_ARGS; i += strlen(request + i) + 1) {
+      argv[argc++] = request + i;
+    }
+  }
+
+  int rc = job_failed_rc;
+  char *output = NULL;
+  int ok = argc > 0 && argc <= REQUEST_ARGS;
+#ifdef CLONE_FS
+  //this thread alone moves to the client's directory
+  ok = ok && unshare(CLONE_FS) == 0 && chdir(request) == 0;
+#endif
+  //what the job would print to stderr is kept for the client instead
+  char *errors = NULL;
+  size_t errors_len = 0;
+  FILE *errors_fp = ok ? open_memstream(&errors, &errors_len) : NULL;
+  if (ok) {
+    argv[argc] = NULL;
+    set_error_stream(errors_fp);
+    rc = job_run(argc, argv, &output);
+    set_error_stream(NULL);
+  }
+  if (errors_fp != NULL) {
+    fclose(errors_fp);
+  }
+
+  char status[48];
+  int n = snprintf(status, sizeof(status), "%d %zu\n", rc, errors != NULL ? errors_len : 0);
+  int sent = sendAll(fd, status, (size_t)n) == 0;
+  if (sent && errors != NULL && errors_len > 0) {
+    sent = sendAll(fd, errors, errors_len) == 0;
+  }
+  if (sent && output != NULL) {
+    sendAll(fd, output, strlen(output));
+  }
+  close(fd);
+  free(errors);
+  free(output);
+  free(request);
+
+  pthread_mutex_lock(&active_lock);
+  active--;
+  pthread_cond_broadcast(&active_done);
+  pthread_mutex_unlock(&active_lock);
+  return NULL;
+}
+
+
+int serve_jobs( const char *path , JobFunc run , int failed_rc ) {
+  struct sockaddr_un addr;
+  if (socketAddress(path, &addr) != 0) {
+    fprintf(stderr, "socket path %s is too long\n", path);
+    return -1;
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    perror("socket");
+    return -1;
+  }
+  //a socket nobody answers on is left over from a daemon that was killed
+  struct stat st;
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+      fprintf(stderr, "a daemon is already serving %s\n", path);
+      close(fd);
+      return -1;
+    }
+    unlink(path);
+  }
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+    fprintf(stderr, "could not listen on %s: %s\n", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  //signals are only taken while waiting for a connection, so a job is
+  //never interrupted; every thread started from here on blocks them
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = stopSignal;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  sigset_t stops, waiting;
+  sigemptyset(&stops);
+  sigaddset(&stops, SIGINT);
+  sigaddset(&stops, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &stops, &waiting);
+  sigdelset(&waiting, SIGINT);
+  sigdelset(&waiting, SIGTERM);
+
+  job_run = run;
+  job_failed_rc = failed_rc;
+  active_max = get_thread_count();
+  set_buffer_recycling(4 * active_max);
+  parallel_for(active_max, warmUp, NULL);
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  while (!stop_serving) {
+    fd_set ready;
+    FD_ZERO(&ready);
+    FD_SET(fd, &ready);
+    if (pselect(fd + 1, &ready, NULL, NULL, NULL, &waiting) < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+      perror("pselect");
+      break;
+    }
+    int conn = accept(fd, NULL, NULL);
+    if (conn < 0) {
+      continue;
+    }
+    //jobs beyond one per thread wait here, still queued in the socket
+    pthread_mutex_lock(&active_lock);
+    while (active >= active_max) {
+      pthread_cond_wait(&active_done, &active_lock);
+    }
+    active++;
+    pthread_mutex_unlock(&active_lock);
+    pthread_t thread;
+    if (pthread_create(&thread, &attr, serveConnection, (void *)(long)conn) != 0) {
+      close(conn);
+      pthread_mutex_lock(&active_lock);
+      active--;
+      pthread_mutex_unlock(&active_lock);
+    }
+  }
+  pthread_attr_destroy(&attr);
+
+  close(fd);
+  unlink(path);
+  pthread_mutex_lock(&active_lock);
+  while (active > 0) {
+    pthread_cond_wait(&active_done, &active_lock);
+  }
+  pthread_mutex_unlock(&active_lock);
+  set_buffer_recycling(0);
+  pthread_sigmask(SIG_UNBLOCK, &stops, NULL);
+  return 0;
+}
+
+
+int send_job( const char *path , int argc , char *argv[] , char **output , char **errors ) {
+  *output = NULL;
+  *errors = NULL;
+  struct sockaddr_un addr;
+  if (socketAddress(path, &addr) != 0) {
+    return SEND_UNREACHABLE;
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return SEND_UNREACHABLE;
+  }
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return SEND_UNREACHABLE;
+  }
+
+  //the working directory, then the arguments, each with its NUL
+  char *cwd = getcwd(NULL, 0);
+  int sent = cwd != NULL && sendAll(fd, cwd, strlen(cwd) + 1) == 0;
+  for (int i = 1; i < argc && sent; i++) {
+    sent = sendAll(fd, argv[i], strlen(argv[i]) + 1) == 0;
+  }
+  free(cwd);
+  if (!sent) {
+    close(fd);
+    return SEND_NO_REPLY;
+  }
+  shutdown(fd, SHUT_WR);
+
+  size_t len;
+  char *reply = readAll(fd, (size_t)1 << 30, &len);
+  close(fd);
+  //the status code and the length of the error messages, then both parts
+  char *end;
+  long rc = reply != NULL ? strtol(reply, &end, 10) : 0;
+  if (reply == NULL || end == reply || *end != ' ') {
+    free(reply);
+    return SEND_NO_REPLY;
+  }
+  char *body;
+  unsigned long long errors_len = strtoull(end + 1, &body, 10);
+  if (body == end + 1 || *body != '\n' || errors_len > len - (size_t)(body + 1 - reply)) {
+    free(reply);
+    return SEND_NO_REPLY;
+  }
+  body++;
+  *errors = malloc((size_t)errors_len + 1);
+  if (*errors == NULL) {
+    free(reply);
+    return SEND_NO_REPLY;
+  }
+  memcpy(*errors, body, (size_t)errors_len);
+  (*errors)[errors_len] = '\0';
+  body += errors_len;
+  memmove(reply, body, len - (size_t)(body - reply) + 1);
+  *output = reply;
+  return (int)rc;
+}
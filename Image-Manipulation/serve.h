@@ -0,0 +1,41 @@
+#ifndef SERVE_H
+#define SERVE_H
+
+
+//////////////////////////////////////////////////////
+// Running command lines for other processes over a //
+// Unix domain socket, with warm threads and caches //
+//////////////////////////////////////////////////////
+
+/* runs one job: argv[1..argc-1] is a command line as typed after
+ * ./project, and argv[argc] is NULL. Returns the command's status code;
+ * *output may be set to malloc'd text for the client's stdout. What the
+ * job writes to error_stream() goes to the client's stderr. */
+typedef int (*JobFunc)( int argc , char *argv[] , char **output );
+
+/* what send_job returns when there was no answer */
+#define SEND_UNREACHABLE -1 // nothing listening at the path, the job wasn't sent
+#define SEND_NO_REPLY -2 // the job was sent but the daemon went away
+
+//______serve_jobs______
+/* listen on a Unix domain socket at path and run each job a client sends
+* with run, up to get_thread_count() at a time, in the client's working
+* directory. The thread pool is started up front and image buffers are
+* kept for reuse, so jobs find both (and the blur kernel cache) warm.
+* Jobs that can't be run (e.g. a malformed request) get failed_rc.
+* A stale socket file left at path is replaced. Runs until SIGINT or
+* SIGTERM, then finishes the running jobs, removes the socket and
+* returns 0; returns -1 if it can't listen at path.
+*/
+int serve_jobs( const char *path , JobFunc run , int failed_rc );
+
+//______send_job______
+/* have the daemon at path run argv[1..argc-1] (a command line like
+* serve_jobs takes) in this process's working directory, and return its
+* status code, or SEND_UNREACHABLE / SEND_NO_REPLY. *output and *errors
+* are set to what the job printed for stdout and for stderr (malloc'd,
+* may be empty) or NULL.
+*/
+int send_job( const char *path , int argc , char *argv[] , char **output , char **errors );
+
+#endif
@@ -0,0 +1,221 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include "stats.h"
+
+
+/* most differently named sections one run keeps; later names are dropped */
+#define STATS_SECTIONS 32
+
+int stats_enabled = 0;
+
+/* one named section of a run */
+typedef struct {
+  const char *name;
+  long calls;
+  double wall;
+  double cpu;
+} StatsSection;
+
+/* everything recorded for one run */
+typedef struct {
+  clockid_t cpu_clock; // process or thread CPU time
+  StatsMark start;
+  size_t bytes_read;
+  size_t bytes_written;
+  long buffers_new;
+  long buffers_reused;
+  size_t buffer_bytes;
+  int nsections;
+  StatsSection sections[STATS_SECTIONS];
+} StatsRun;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t run_key; // the run of the calling thread
+static StatsRun *process_run = NULL; // whole_process run, for threads without one
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER; // guards the counters
+
+
+/* Helper function for the runs
+ * create the thread key once
+ */
+static void makeKey(void) {
+  pthread_key_create(&run_key, NULL);
+}
+
+/* Helper function for the runs
+ * the run counters of the calling thread go to, or NULL
+ */
+static StatsRun* currentRun(void) {
+  pthread_once(&key_once, makeKey);
+  StatsRun *run = pthread_getspecific(run_key);
+  return run != NULL ? run : process_run;
+}
+
+/* Helper function for the runs
+ * seconds on a clock
+ */
+static double seconds(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+/* Helper function for stats_finish_run
+ * append text to the JSON in out as a quoted, escaped string; out has
+ * room for 6 bytes per character plus the quotes
+ */
+static char* putString(char *out, const char *text) {
+  *out++ = '"';
+  for (const unsigned char *p = (const unsigned char *)text; *p != '\0'; p++) {
+    if (*p == '"' || *p == '\\') {
+      *out++ = '\\';
+      *out++ = (char)*p;
+    }
+    else if (*p < 0x20) {
+      out += sprintf(out, "\\u%04x", *p);
+    }
+    else {
+      *out++ = (char)*p;
+    }
+  }
+  *out++ = '"';
+  return out;
+}
+
+
+StatsMark stats_mark( void ) {
+  StatsRun *run = currentRun();
+  StatsMark mark;
+  mark.wall = seconds(CLOCK_MONOTONIC);
+  mark.cpu = seconds(run != NULL ? run->cpu_clock : CLOCK_PROCESS_CPUTIME_ID);
+  return mark;
+}
+
+
+void stats_start_run( int whole_process ) {
+  StatsRun *run = calloc(1, sizeof(StatsRun));
+  if (run == NULL) {
+    return;
+  }
+  run->cpu_clock = whole_process ? CLOCK_PROCESS_CPUTIME_ID : CLOCK_THREAD_CPUTIME_ID;
+  pthread_once(&key_once, makeKey);
+  pthread_setspecific(run_key, run);
+  //other threads may read a stale count, but they have no run of their own
+  //(parallel_for workers see it through the pool's lock)
+  pthread_mutex_lock(&stats_lock);
+  stats_enabled++;
+  if (whole_process) {
+    process_run = run;
+  }
+  pthread_mutex_unlock(&stats_lock);
+  run->start = stats_mark();
+}
+
+
+char* stats_finish_run( const char *command , int rc ) {
+  if (!stats_enabled) {
+    return NULL;
+  }
+  pthread_once(&key_once, makeKey);
+  StatsRun *run = pthread_getspecific(run_key);
+  if (run == NULL) {
+    return NULL;
+  }
+  StatsMark end = stats_mark();
+  pthread_setspecific(run_key, NULL);
+  pthread_mutex_lock(&stats_lock);
+  stats_enabled--;
+  if (process_run == run) {
+    process_run = NULL;
+  }
+  pthread_mutex_unlock(&stats_lock);
+
+  struct rusage usage;
+  long peak_kb = getrusage(RUSAGE_SELF, &usage) == 0 ? usage.ru_maxrss : 0;
+
+  //numbers take well under 64 bytes each, names at most 6 per character
+  size_t cap = 512 + 6 * strlen(command);
+  for (int i = 0; i < run->nsections; i++) {
+    cap += 160 + 6 * strlen(run->sections[i].name);
+  }
+  char *json = malloc(cap);
+  if (json == NULL) {
+    free(run);
+    return NULL;
+  }
+  char *out = json;
+  out += sprintf(out, "{\"command\":");
+  out = putString(out, command);
+  out += sprintf(out, ",\"rc\":%d,\"wall_s\":%.6f,\"cpu_s\":%.6f,\"bytes_read\":%zu,\"bytes_written\":%zu,"
+		 "\"buffers_new\":%ld,\"buffers_reused\":%ld,\"buffer_bytes\":%zu,\"peak_rss_kb\":%ld,\"sections\":[",
+		 rc, end.wall - run->start.wall, end.cpu - run->start.cpu, run->bytes_read, run->bytes_written,
+		 run->buffers_new, run->buffers_reused, run->buffer_bytes, peak_kb);
+  for (int i = 0; i < run->nsections; i++) {
+    const StatsSection *s = &run->sections[i];
+    out += sprintf(out, "%s{\"name\":", i > 0 ? "," : "");
+    out = putString(out, s->name);
+    out += sprintf(out, ",\"calls\":%ld,\"wall_s\":%.6f,\"cpu_s\":%.6f}", s->calls, s->wall, s->cpu);
+  }
+  sprintf(out, "]}");
+  free(run);
+  return json;
+}
+
+
+void stats_add_section( const char *name , StatsMark start ) {
+  StatsRun *run = currentRun();
+  if (run == NULL) {
+    return;
+  }
+  StatsMark end = stats_mark();
+  pthread_mutex_lock(&stats_lock);
+  int i = 0;
+  while (i < run->nsections && strcmp(run->sections[i].name, name) != 0) {
+    i++;
+  }
+  if (i == run->nsections && i < STATS_SECTIONS) {
+    run->sections[i].name = name;
+    run->nsections++;
+  }
+  if (i < run->nsections) {
+    run->sections[i].calls++;
+    run->sections[i].wall += end.wall - start.wall;
+    run->sections[i].cpu += end.cpu - start.cpu;
+  }
+  pthread_mutex_unlock(&stats_lock);
+}
+
+
+void stats_add_io( size_t read , size_t written ) {
+  StatsRun *run = currentRun();
+  if (run == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&stats_lock);
+  run->bytes_read += read;
+  run->bytes_written += written;
+  pthread_mutex_unlock(&stats_lock);
+}
+
+
+void stats_add_buffer( size_t bytes , int reused ) {
+  StatsRun *run = currentRun();
+  if (run == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&stats_lock);
+  if (reused) {
+    run->buffers_reused++;
+  }
+  else {
+    run->buffers_new++;
+  }
+  run->buffer_bytes += bytes;
+  pthread_mutex_unlock(&stats_lock);
+}
@@ -0,0 +1,77 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+
+
+///////////////////////////////////////////////////
+// Timings and counters for --stats, per command //
+///////////////////////////////////////////////////
+
+/* number of runs being recorded; while it is zero everything below does
+ * nothing, and the inline wrappers only test it, so the instrumentation
+ * can stay in the hot paths */
+extern int stats_enabled;
+
+/* a point in time: wall clock and CPU time in seconds */
+typedef struct {
+  double wall;
+  double cpu;
+} StatsMark;
+
+//______stats_start_run______
+/* start recording a run (one command) on the calling thread. With
+* whole_process the CPU times count every thread, and counters bumped on
+* threads that have no run of their own (parallel_for workers) go to this
+* one; otherwise only the calling thread's CPU time counts, which is right
+* for batch jobs that each run on a single thread. Only threads with a
+* run (and the workers of a whole_process run) record anything, so each
+* command that asks for stats gets its own, even next to others.
+*/
+void stats_start_run( int whole_process );
+
+//______stats_finish_run______
+/* stop recording the calling thread's run and return it as one line of
+* JSON (malloc'd, the caller frees it): command and rc as given, wall and
+* CPU seconds, bytes read and written, image buffers taken, peak RSS of
+* the process so far, and the calls, wall and CPU seconds of each section.
+* Sections nest (e.g. "blur.rows" inside "blur"), so they don't add up to
+* the total. NULL if nothing was being recorded.
+*/
+char* stats_finish_run( const char *command , int rc );
+
+//______stats_mark______
+/* the current time on the clocks of the calling thread's run
+*/
+StatsMark stats_mark( void );
+
+//______stats_add_section______
+/* add the time since start to the section called name (a string that
+* outlives the run, e.g. a literal or an argv entry)
+*/
+void stats_add_section( const char *name , StatsMark start );
+
+//______stats_add_io______
+/* count bytes read from and written to image files
+*/
+void stats_add_io( size_t read , size_t written );
+
+//______stats_add_buffer______
+/* count an image buffer of bytes bytes handed out by the buffer pool,
+* either reused from it or newly allocated
+*/
+void stats_add_buffer( size_t bytes , int reused );
+
+/* time a section: StatsMark t = stats_begin(); ...; stats_end("name", t); */
+static inline StatsMark stats_begin( void ) {
+  StatsMark none = { 0 , 0 };
+  return stats_enabled ? stats_mark() : none;
+}
+
+static inline void stats_end( const char *name , StatsMark start ) {
+  if (stats_enabled) {
+    stats_add_section(name, start);
+  }
+}
+
+#endif
@@ -0,0 +1,318 @@
+//test_codecs.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "ppm_io.h"
+#include "qoi_io.h"
+
+// Return (exit) codes
+#define RC_SUCCESS       0
+#define RC_FAILED        1
+
+/* a small file and the pixels read_ppm should make of it: 2x2 pixels as
+ * 8-bit r,g,b, and for 16-bit files also what read_ppm_layout gives in
+ * LAYOUT_RGB16 */
+typedef struct {
+  const char *name;
+  const char *bytes;
+  size_t len;
+  unsigned char expect[12];
+  int wide; // expect16 is filled in
+  unsigned short expect16[12];
+} PpmCase;
+
+#define FILE_BYTES(s) s , sizeof(s) - 1
+
+/* every format at maxval 255 and 65535, and each at an odd maxval; the
+ * 16-bit samples 25700 and 32896 are 100 and 128 times 257 */
+static const PpmCase ppm_cases[] = {
+  { "P6 255" , FILE_BYTES("P6\n2 2\n255\n" "\x00\x00\x00" "\xff\xff\xff" "\x0c\x22\x38" "\xc8\x64\x32") ,
+    { 0,0,0 , 255,255,255 , 12,34,56 , 200,100,50 } , 0 , { 0 } },
+  { "P3 255" , FILE_BYTES("P3\n# a comment\n2 2\n255\n0 0 0  255 255 255\n12 34 56 200 100 50\n") ,
+    { 0,0,0 , 255,255,255 , 12,34,56 , 200,100,50 } , 0 , { 0 } },
+  { "P5 255" , FILE_BYTES("P5 2 2 255\n" "\x00\xff\x4d\x80") ,
+    { 0,0,0 , 255,255,255 , 77,77,77 , 128,128,128 } , 0 , { 0 } },
+  { "P2 255" , FILE_BYTES("P2\n2 2\n255\n0 255\n77 128\n") ,
+    { 0,0,0 , 255,255,255 , 77,77,77 , 128,128,128 } , 0 , { 0 } },
+  { "P6 65535" , FILE_BYTES("P6\n2 2\n65535\n"
+			    "\x00\x00" "\xff\xff" "\x64\x64" "\x80\x80" "\x00\x00" "\xff\xff"
+			    "\x64\x64" "\x64\x64" "\x64\x64" "\xff\xff" "\x80\x80" "\x00\x00") ,
+    { 0,255,100 , 128,0,255 , 100,100,100 , 255,128,0 } ,
+    1 , { 0,65535,25700 , 32896,0,65535 , 25700,25700,25700 , 65535,32896,0 } },
+  { "P3 65535" , FILE_BYTES("P3\n2 2\n65535\n0 65535 25700 32896 0 65535\n25700 25700 25700 65535 32896 0\n") ,
+    { 0,255,100 , 128,0,255 , 100,100,100 , 255,128,0 } ,
+    1 , { 0,65535,25700 , 32896,0,65535 , 25700,25700,25700 , 65535,32896,0 } },
+  { "P5 65535" , FILE_BYTES("P5\n2 2\n65535\n" "\x00\x00" "\xff\xff" "\x64\x64" "\x80\x80") ,
+    { 0,0,0 , 255,255,255 , 100,100,100 , 128,128,128 } ,
+    1 , { 0,0,0 , 65535,65535,65535 , 25700,25700,25700 , 32896,32896,32896 } },
+  { "P2 65535" , FILE_BYTES("P2\n2 2\n65535\n0 65535 25700 32896\n") ,
+    { 0,0,0 , 255,255,255 , 100,100,100 , 128,128,128 } ,
+    1 , { 0,0,0 , 65535,65535,65535 , 25700,25700,25700 , 32896,32896,32896 } },
+  { "P6 15" , FILE_BYTES("P6\n2 2\n15\n" "\x00\x0f\x07" "\x08\x00\x0f" "\x07\x07\x07" "\x0f\x08\x00") ,
+    { 0,255,119 , 136,0,255 , 119,119,119 , 255,136,0 } , 0 , { 0 } },
+  { "P3 1000" , FILE_BYTES("P3\n2 2\n1000\n0 1000 400  400 0 1000\n400 400 400  1000 400 0\n") ,
+    { 0,255,102 , 102,0,255 , 102,102,102 , 255,102,0 } ,
+    1 , { 0,65535,26214 , 26214,0,65535 , 26214,26214,26214 , 65535,26214,0 } },
+  { "P5 1000" , FILE_BYTES("P5\n2 2\n1000\n" "\x00\x00" "\x03\xe8" "\x01\x90" "\x04\xb0") , //1200 counts as 1000
+    { 0,0,0 , 255,255,255 , 102,102,102 , 255,255,255 } ,
+    1 , { 0,0,0 , 65535,65535,65535 , 26214,26214,26214 , 65535,65535,65535 } },
+  { "P2 15" , FILE_BYTES("P2\n2 2\n15\n0 15\n7 8\n") ,
+    { 0,0,0 , 255,255,255 , 119,119,119 , 136,136,136 } , 0 , { 0 } },
+};
+
+/* a 3x2 QOI file by hand with every chunk type: RGB, DIFF, LUMA, RUN,
+ * INDEX (of the first pixel, hash 9) and RGBA, whose alpha is dropped */
+static const char qoi_file[] =
+  "qoif" "\x00\x00\x00\x03" "\x00\x00\x00\x02" "\x04\x00"
+  "\xfe\x0a\x14\x1e" // RGB 10,20,30
+  "\x76" // DIFF +1,-1,0
+  "\xb4\xb3" // LUMA dg +20, dr - dg +3, db - dg -5
+  "\xc0" // RUN of 1
+  "\x09" // INDEX 9
+  "\xff\xc8\x64\x32\x80" // RGBA 200,100,50,128
+  "\x00\x00\x00\x00\x00\x00\x00\x01";
+static const unsigned char qoi_expect[18] = { 10,20,30 , 11,19,30 , 34,39,45 , 34,39,45 , 10,20,30 , 200,100,50 };
+
+static int checks = 0;
+static int failures = 0;
+
+void check(int ok, const char *what, const char *name);
+FILE* file_of(const char *bytes, size_t len);
+int same_pixels(const Image im, const unsigned char *expect);
+void test_ppm_case(const PpmCase *c);
+void test_qoi_chunks(void);
+void test_qoi_round_trip(void);
+void test_short_writes(void);
+
+
+/* check the PPM/PGM reader against small known files in every format and
+ * maxval, and the QOI codec against a hand-made file and a round trip that
+ * uses every chunk type:
+ *   ./test_codecs
+ */
+int main (void) {
+  for (size_t i = 0; i < sizeof(ppm_cases) / sizeof(ppm_cases[0]); i++) {
+    test_ppm_case(&ppm_cases[i]);
+  }
+  test_qoi_chunks();
+  test_qoi_round_trip();
+  test_short_writes();
+  printf("test_codecs: %d checks, %d failed\n", checks, failures);
+  return failures == 0 ? RC_SUCCESS : RC_FAILED;
+}
+
+
+/* count a check, reporting it when it fails
+ */
+void check(int ok, const char *what, const char *name) {
+  checks++;
+  if (!ok) {
+    fprintf(stderr, "FAILED: %s (%s)\n", what, name);
+    failures++;
+  }
+}
+
+/* a temporary file holding len bytes, rewound to the start
+ */
+FILE* file_of(const char *bytes, size_t len) {
+  FILE *fp = tmpfile();
+  if (fp != NULL && (fwrite(bytes, 1, len, fp) != len || fseek(fp, 0, SEEK_SET) != 0)) {
+    fclose(fp);
+    fp = NULL;
+  }
+  return fp;
+}
+
+/* true if the packed image holds the rows * cols r,g,b triples of expect
+ */
+int same_pixels(const Image im, const unsigned char *expect) {
+  if (im.data == NULL || im.layout != LAYOUT_PACKED) {
+    return 0;
+  }
+  for (int y = 0; y < im.rows; y++) {
+    const unsigned char *row = (const unsigned char *)im.data + im.stride * y;
+    if (memcmp(row, expect + (size_t)3 * y * im.cols, (size_t)3 * im.cols) != 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+
+/* read a known file with read_ppm, and read_ppm_layout for 16 bits, and
+ * a copy of it cut short, which has to fail
+ */
+void test_ppm_case(const PpmCase *c) {
+  FILE *fp = file_of(c->bytes, c->len);
+  if (fp == NULL) {
+    check(0, "temporary file", c->name);
+    return;
+  }
+  Image im = read_ppm(fp);
+  check(im.rows == 2 && im.cols == 2 && same_pixels(im, c->expect), "read_ppm pixels", c->name);
+  free_image(&im);
+
+  if (c->wide) {
+    rewind(fp);
+    im = read_ppm_layout(fp, LAYOUT_RGB16);
+    int ok = im.data != NULL && im.rows == 2 && im.cols == 2;
+    for (int y = 0; ok && y < 2; y++) {
+      const unsigned short *row = (const unsigned short *)((const unsigned char *)im.data + im.stride * y);
+      ok = memcmp(row, c->expect16 + 6 * y, 6 * sizeof(unsigned short)) == 0;
+    }
+    check(ok, "read_ppm_layout 16-bit samples", c->name);
+    free_image(&im);
+  }
+  fclose(fp);
+
+  //binary files lose their last byte; ASCII ones their last number
+  size_t len = c->len - 1;
+  if (c->name[1] == '2' || c->name[1] == '3') {
+    while (len > 0 && isspace((unsigned char)c->bytes[len])) {
+      len--;
+    }
+    while (len > 0 && !isspace((unsigned char)c->bytes[len])) {
+      len--;
+    }
+  }
+  fp = file_of(c->bytes, len);
+  if (fp != NULL) {
+    im = read_ppm(fp);
+    check(im.data == NULL, "truncated file rejected", c->name);
+    free_image(&im);
+    fclose(fp);
+  }
+}
+
+
+/* decode the hand-made file with every chunk type
+ */
+void test_qoi_chunks(void) {
+  FILE *fp = file_of(qoi_file, sizeof(qoi_file) - 1);
+  if (fp == NULL) {
+    check(0, "temporary file", "qoi chunks");
+    return;
+  }
+  Image im = read_qoi(fp);
+  check(im.rows == 2 && im.cols == 3 && same_pixels(im, qoi_expect), "read_qoi pixels", "qoi chunks");
+  free_image(&im);
+  fclose(fp);
+}
+
+/* write an image made to need every chunk type write_qoi uses, check
+ * that each shows up in the file, and read it back in every layout
+ */
+void test_qoi_round_trip(void) {
+  const int rows = 4, cols = 100;
+  Image in = make_image(rows, cols);
+  if (in.data == NULL) {
+    check(0, "allocation", "qoi round trip");
+    return;
+  }
+  unsigned long long state = 0x9E3779B97F4A7C15ULL;
+  for (int y = 0; y < rows; y++) {
+    for (int x = 0; x < cols; x++) {
+      Pixel *p = &in.data[y * cols + x];
+      if (x < 20 && y % 2 == 0) { //noise: RGB
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+	unsigned long long bits = state * 0x2545F4914F6CDD1DULL;
+	p->r = (unsigned char)(bits >> 56);
+	p->g = (unsigned char)(bits >> 48);
+	p->b = (unsigned char)(bits >> 40);
+      }
+      else if (x < 20) { //two colors in turn: INDEX
+	p->r = x % 2 ? 250 : 5;
+	p->g = x % 2 ? 10 : 240;
+	p->b = x % 2 ? 90 : 30;
+      }
+      else if (x < 40) { //small steps: DIFF
+	p->r = p->g = p->b = (unsigned char)(100 + x - 20);
+      }
+      else if (x < 60) { //green steps of 10: LUMA
+	p->r = (unsigned char)(x * 2);
+	p->g = (unsigned char)((x - 40) * 10);
+	p->b = (unsigned char)(x * 3);
+      }
+      else { //one color to the end of the row and into the next: RUN
+	p->r = 7;
+	p->g = 77;
+	p->b = 177;
+      }
+    }
+  }
+
+  const Layout layouts[] = { LAYOUT_PACKED , LAYOUT_RGBX , LAYOUT_PLANAR , LAYOUT_RGB16 };
+  const char *names[] = { "qoi round trip packed" , "qoi round trip rgbx" , "qoi round trip planar" , "qoi round trip rgb16" };
+  for (int l = 0; l < 4; l++) {
+    Image src = copy_layout(in, layouts[l]);
+    FILE *fp = tmpfile();
+    if (src.data == NULL || fp == NULL) {
+      check(0, "allocation", names[l]);
+      free_image(&src);
+      if (fp != NULL) {
+	fclose(fp);
+      }
+      continue;
+    }
+    check(write_qoi(fp, src) == rows * cols, "write_qoi count", names[l]);
+    free_image(&src);
+    long size = ftell(fp);
+    rewind(fp);
+
+    //walk the chunks between the header and the end marker
+    unsigned char *bytes = size > 22 ? malloc((size_t)size) : NULL;
+    int seen[6] = { 0 }; // INDEX, DIFF, LUMA, RUN, RGB, RGBA
+    int ok = bytes != NULL && fread(bytes, 1, (size_t)size, fp) == (size_t)size;
+    for (long i = 14; ok && i < size - 8; ) {
+      unsigned char tag = bytes[i];
+      if (tag == 0xfe || tag == 0xff) {
+	seen[tag == 0xfe ? 4 : 5]++;
+	i += tag == 0xfe ? 4 : 5;
+      }
+      else {
+	seen[tag >> 6]++;
+	i += (tag & 0xc0) == 0x80 ? 2 : 1;
+      }
+    }
+    free(bytes);
+    check(ok && seen[0] > 0 && seen[1] > 0 && seen[2] > 0 && seen[3] > 0 && seen[4] > 0, "every chunk type written", names[l]);
+
+    //back in every layout, packed again to compare
+    for (int m = 0; m < 3; m++) {
+      rewind(fp);
+      Image out = read_qoi_layout(fp, layouts[m]);
+      if (out.data != NULL) {
+	out = convert_layout(out, LAYOUT_PACKED);
+      }
+      check(same_pixels(out, (const unsigned char *)in.data), "read_qoi_layout pixels", names[l]);
+      free_image(&out);
+    }
+    fclose(fp);
+  }
+  free_image(&in);
+}
+
+/* writers have to report a full disk as fewer pixels written, not leave
+ * it to the caller to notice
+ */
+void test_short_writes(void) {
+  FILE *fp = fopen("/dev/full", "wb");
+  if (fp == NULL) { //not on Linux
+    return;
+  }
+  setvbuf(fp, NULL, _IONBF, 0);
+  Image im = make_image_zeroed(8, 8, LAYOUT_PACKED);
+  if (im.data == NULL) {
+    check(0, "allocation", "short writes");
+    fclose(fp);
+    return;
+  }
+  check(write_qoi(fp, im) < im.rows * im.cols, "write_qoi short write", "/dev/full");
+  check(write_ppm(fp, im) < im.rows * im.cols, "write_ppm short write", "/dev/full");
+  free_image(&im);
+  fclose(fp);
+}
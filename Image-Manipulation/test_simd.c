@@ -0,0 +1,100 @@
+//test_simd.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "ppm_io.h"
+#include "image_manip.h"
+
+// Return (exit) codes
+#define RC_SUCCESS       0
+#define RC_BAD_ARGS      1
+#define RC_OPEN_FAILED   2
+#define RC_WRITE_FAILED  3
+#define RC_OP_FAILED     4
+
+/* widths around the 8, 16 and 32 pixel blocks of the kernels, so every
+ * tail shorter than a vector comes up */
+static const int widths[] = { 1 , 2 , 3 , 5 , 7 , 8 , 9 , 15 , 16 , 17 , 31 , 32 , 33 , 63 , 64 , 65 , 97 };
+static const Layout layouts[] = { LAYOUT_PACKED , LAYOUT_RGBX , LAYOUT_PLANAR };
+static const double scales[] = { 0.0 , 0.5 , 1.7 , 4.0 };
+
+int run_op(const Image in, Layout layout, int op, FILE *fp);
+
+
+/* run grayscale and saturate over random images of every width in every
+ * layout and write the results to one file:
+ *   ./test_simd <output>
+ * The kernel IMG_SIMD selects is fixed for the whole process, so make test
+ * runs this once per level and compares the files byte for byte.
+ */
+int main (int argc, char* argv[]) {
+  if (argc != 2) {
+    printf("USAGE: ./test_simd <output>\n");
+    return RC_BAD_ARGS;
+  }
+  FILE *fp = fopen(argv[1], "wb");
+  if (fp == NULL) {
+    fprintf(stderr, "could not open %s\n", argv[1]);
+    return RC_OPEN_FAILED;
+  }
+
+  int rc = RC_SUCCESS;
+  unsigned long long state = 0x9E3779B97F4A7C15ULL;
+  int nwidths = (int)(sizeof(widths) / sizeof(widths[0]));
+  int nlayouts = (int)(sizeof(layouts) / sizeof(layouts[0]));
+  int nscales = (int)(sizeof(scales) / sizeof(scales[0]));
+  for (int w = 0; w < nwidths && rc == RC_SUCCESS; w++) {
+    Image in = make_image(3, widths[w]);
+    if (in.data == NULL) {
+      rc = RC_OP_FAILED;
+      break;
+    }
+    for (int i = 0; i < in.rows * in.cols; i++) {
+      //xorshift64*, as checkerboard's noise
+      state ^= state >> 12;
+      state ^= state << 25;
+      state ^= state >> 27;
+      unsigned long long bits = state * 0x2545F4914F6CDD1DULL;
+      in.data[i].r = (unsigned char)(bits >> 56);
+      in.data[i].g = (unsigned char)(bits >> 48);
+      in.data[i].b = (unsigned char)(bits >> 40);
+    }
+    for (int l = 0; l < nlayouts && rc == RC_SUCCESS; l++) {
+      for (int op = -1; op < nscales && rc == RC_SUCCESS; op++) {
+	rc = run_op(in, layouts[l], op, fp);
+      }
+    }
+    free_image(&in);
+  }
+  if (fclose(fp) != 0 && rc == RC_SUCCESS) {
+    rc = RC_WRITE_FAILED;
+  }
+  if (rc != RC_SUCCESS) {
+    fprintf(stderr, "test_simd failed with code %d\n", rc);
+  }
+  return rc;
+}
+
+
+/* run grayscale (op -1) or saturate with scales[op] on a copy of in in the
+ * given layout and append the result, packed, to fp; returns an RC_* code
+ */
+int run_op(const Image in, Layout layout, int op, FILE *fp) {
+  Image copy = copy_layout(in, layout);
+  if (copy.data == NULL) {
+    return RC_OP_FAILED;
+  }
+  Image out = op < 0 ? grayscale(copy) : saturate(copy, scales[op]);
+  if (out.data == NULL) {
+    free_image(&copy);
+    return RC_OP_FAILED;
+  }
+  Image packed = convert_layout(out, LAYOUT_PACKED);
+  if (packed.data == NULL) {
+    free_image(&out);
+    return RC_OP_FAILED;
+  }
+  int rc = write_ppm(fp, packed) == packed.rows * packed.cols ? RC_SUCCESS : RC_WRITE_FAILED;
+  free_image(&packed);
+  return rc;
+}
@@ -0,0 +1,181 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "thread_pool.h"
+
+
+/* ranges handed out per thread; more than one evens out uneven rows */
+#define CHUNKS_PER_THREAD 4
+
+/* held by whichever caller is currently running a parallel_for */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* serializes range_failed */
+static pthread_mutex_t fail_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* protects everything below and signals workers and the caller */
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t job_done = PTHREAD_COND_INITIALIZER;
+
+static int thread_total = 1; // configured thread count, including the caller
+static pthread_t *workers = NULL;
+static int worker_count = 0; // workers currently running
+static int stopping = 0; // set to make the workers exit
+
+/* the job being run */
+static RangeFunc job_fn;
+static void *job_arg;
+static int job_count;
+static int job_chunk; // items per range
+static int job_next; // first item not handed out yet
+static int job_busy; // workers still working on the job
+static unsigned long job_generation; // bumped for every new job
+
+
+/* Helper function for the pool
+ * take ranges of the current job and run them until there are none left;
+ * called with job_lock held, and returns with it held
+ */
+static void runRanges(void) {
+  while (job_next < job_count) {
+    int begin = job_next;
+    int end = begin + job_chunk < job_count ? begin + job_chunk : job_count;
+    job_next = end;
+    pthread_mutex_unlock(&job_lock);
+    job_fn(job_arg, begin, end);
+    pthread_mutex_lock(&job_lock);
+  }
+}
+
+/* Helper function for the pool
+ * body of every worker thread: wait for a job, help with it, repeat
+ */
+static void* workerMain(void *unused) {
+  (void)unused;
+  unsigned long seen = 0;
+  pthread_mutex_lock(&job_lock);
+  for (;;) {
+    while (!stopping && job_generation == seen) {
+      pthread_cond_wait(&job_ready, &job_lock);
+    }
+    if (stopping) {
+      break;
+    }
+    seen = job_generation;
+    runRanges();
+    if (--job_busy == 0) {
+      pthread_cond_signal(&job_done);
+    }
+  }
+  pthread_mutex_unlock(&job_lock);
+  return NULL;
+}
+
+/* Helper function for the pool
+ * stop and join all the workers
+ */
+static void stopWorkers(void) {
+  pthread_mutex_lock(&job_lock);
+  stopping = 1;
+  pthread_cond_broadcast(&job_ready);
+  pthread_mutex_unlock(&job_lock);
+  for (int i = 0; i < worker_count; i++) {
+    pthread_join(workers[i], NULL);
+  }
+  free(workers);
+  workers = NULL;
+  worker_count = 0;
+  stopping = 0;
+}
+
+/* Helper function for the pool
+ * start the thread_total - 1 workers; if some can't be created, the pool
+ * just runs with fewer
+ */
+static void startWorkers(void) {
+  workers = malloc(sizeof(pthread_t) * (thread_total - 1));
+  if (workers == NULL) {
+    return;
+  }
+  while (worker_count < thread_total - 1) {
+    if (pthread_create(&workers[worker_count], NULL, workerMain, NULL) != 0) {
+      fprintf(stderr, "thread_pool - could only start %d worker threads\n", worker_count);
+      break;
+    }
+    worker_count++;
+  }
+}
+
+
+//______set_thread_count______
+/* set how many threads parallel_for spreads work over
+ */
+void set_thread_count( int threads ) {
+  if (threads <= 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cpus > 0 ? (int)cpus : 1;
+  }
+  pthread_mutex_lock(&pool_lock);
+  if (threads != thread_total) {
+    stopWorkers(); //restarted with the new size by the next parallel_for
+    thread_total = threads;
+  }
+  pthread_mutex_unlock(&pool_lock);
+}
+
+//______get_thread_count______
+/* the number of threads parallel_for currently uses
+ */
+int get_thread_count( void ) {
+  return thread_total;
+}
+
+//______parallel_for______
+/* call fn on disjoint ranges covering 0 to count - 1 across the pool
+ */
+void parallel_for( int count , RangeFunc fn , void *arg ) {
+  if (count <= 0) {
+    return;
+  }
+  //single threaded, too little work to share, or the pool is already busy
+  if (thread_total <= 1 || count == 1 || pthread_mutex_trylock(&pool_lock) != 0) {
+    fn(arg, 0, count);
+    return;
+  }
+  if (worker_count == 0) {
+    startWorkers();
+  }
+
+  pthread_mutex_lock(&job_lock);
+  job_fn = fn;
+  job_arg = arg;
+  job_count = count;
+  job_chunk = count / ((worker_count + 1) * CHUNKS_PER_THREAD);
+  if (job_chunk < 1) {
+    job_chunk = 1;
+  }
+  job_next = 0;
+  job_busy = worker_count;
+  job_generation++;
+  pthread_cond_broadcast(&job_ready);
+
+  runRanges(); //the caller works too
+  while (job_busy > 0) {
+    pthread_cond_wait(&job_done, &job_lock);
+  }
+  pthread_mutex_unlock(&job_lock);
+  pthread_mutex_unlock(&pool_lock);
+}
+
+//______range_failed______
+/* set the flag under a lock, so ranges failing at once don't race
+ */
+void range_failed( int *failed ) {
+  pthread_mutex_lock(&fail_lock);
+  *failed = 1;
+  pthread_mutex_unlock(&fail_lock);
+}
@@ -0,0 +1,43 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+
+////////////////////////////////////////////////
+// Shared worker threads for image operations //
+////////////////////////////////////////////////
+
+/* a piece of work for parallel_for: handle the items begin to end - 1
+ * (e.g. image rows) using whatever arg points to */
+typedef void (*RangeFunc)( void *arg , int begin , int end );
+
+//______set_thread_count______
+/* set how many threads parallel_for spreads work over, counting the
+* calling thread; 1 (the default) runs everything on the caller and 0
+* means one per online CPU. Must not be called while a parallel_for is
+* running.
+*/
+void set_thread_count( int threads );
+
+//______get_thread_count______
+/* the number of threads parallel_for currently uses
+*/
+int get_thread_count( void );
+
+//______parallel_for______
+/* call fn on disjoint ranges that together cover 0 to count - 1, spread
+* over the worker threads and the caller, and return once all of them
+* are done. Each item must be independent of the others so the result
+* doesn't depend on how the range is split. A parallel_for started while
+* another one is running (e.g. from inside fn) runs on the caller alone.
+*/
+void parallel_for( int count , RangeFunc fn , void *arg );
+
+//______range_failed______
+/* called by a RangeFunc that can't do its items (e.g. its scratch memory
+* ran out): sets *failed, which the caller of parallel_for checks once it
+* has returned and then gives up on the result. Safe to call from several
+* ranges at once.
+*/
+void range_failed( int *failed );
+
+#endif